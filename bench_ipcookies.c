@@ -0,0 +1,556 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <math.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+#include "shim_ipcookies.h"
+
+/********************************************************************
+
+The microbenchmarks for the hot paths of the library.
+
+Each case runs for at least the given number of seconds (-t),
+in batches doubling in size until then, against a private anonymous
+copy of ipcookie_full_state_t, so the running cookied is not disturbed.
+
+The peers for the cache cases are drawn from the precomputed sequence
+of indices into the populated part of the cache, either uniformly
+or according to Zipf distribution with the exponent given by -s.
+
+The policy_lookup cases look up the peers in the empty policy, and
+in the one with a /64 rule for each of BENCH_POLICY_RULES of them
+under a /32 rule for all (see ipcookies_policy.h). The budget_admit
+case takes from the budgets of the peers' /64s with the default rates,
+which most of the lookups find spent (see ipcookies_budget.h).
+
+Where perf_event_open is available (and permitted), the hardware
+counters are reported per operation as well.
+
+The -H selects the pages backing the copy of the state: the small
+ones (the default), the transparent huge pages (thp), or the hugetlb
+ones (hugetlb, needs the pages reserved in /proc/sys/vm/nr_hugepages);
+compare the dtlb-miss column of the cache cases between them.
+
+At the end, the memory taken per peer by the cache, and how many
+of a number of the peers not in the (nearly full) cache were still
+found in it: never with the full addresses, and with the hashes of
+the compact cache (make COMPACT_CACHE=1) one time in 2^52 per slot
+with the same fingerprint.
+
+Usage: bench_ipcookies [-t <seconds>] [-s <zipf exponent>] [-H small|thp|hugetlb]
+                       [<case name substring>]
+
+********************************************************************/
+
+#define BENCH_SEQ_SIZE (1 << 16)
+#define BENCH_SEQ_MASK (BENCH_SEQ_SIZE - 1)
+
+#define BENCH_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* The /64 rules of the policy_lookup/64s case */
+#define BENCH_POLICY_RULES 256
+
+typedef struct bench_ctx {
+  ipcookie_full_state_t *ipck;
+  ipcookie_view_t view;     /* of ipck, for the shim */
+  struct in6_addr *peers;   /* the peers present in the cache */
+  int n_peers;
+  uint32_t *seq;            /* sequence of indices into the peers */
+  ipcookie_t good_cookie;
+  ipcookie_t bad_cookie;
+} bench_ctx_t;
+
+typedef void (*bench_fn_t)(bench_ctx_t *ctx, uint64_t iters);
+
+static volatile uint64_t bench_sink;
+
+/********************************************************************
+ The hardware counters.
+ ********************************************************************/
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+typedef struct bench_counter_def {
+  char *name;
+  uint32_t type;
+  uint64_t config;
+} bench_counter_def_t;
+
+static bench_counter_def_t bench_counter_defs[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "llc-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "dtlb-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+#define BENCH_N_COUNTERS (sizeof(bench_counter_defs)/sizeof(bench_counter_defs[0]))
+
+static int bench_counter_fds[BENCH_N_COUNTERS];
+
+static void bench_counters_open(void) {
+  struct perf_event_attr attr;
+  int i;
+  for (i = 0; i < BENCH_N_COUNTERS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = bench_counter_defs[i].type;
+    attr.config = bench_counter_defs[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    bench_counter_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void bench_counters_start(void) {
+  int i;
+  for (i = 0; i < BENCH_N_COUNTERS; i++) {
+    if (bench_counter_fds[i] >= 0) {
+      ioctl(bench_counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(bench_counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+static void bench_counters_stop(uint64_t *values) {
+  int i;
+  for (i = 0; i < BENCH_N_COUNTERS; i++) {
+    values[i] = 0;
+    if (bench_counter_fds[i] >= 0) {
+      ioctl(bench_counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(bench_counter_fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+        values[i] = 0;
+      }
+    }
+  }
+}
+
+static void bench_counters_header(void) {
+  int i;
+  for (i = 0; i < BENCH_N_COUNTERS; i++) {
+    printf(" %10s", bench_counter_defs[i].name);
+  }
+}
+
+static void bench_counters_print(uint64_t *values, uint64_t iters) {
+  int i;
+  for (i = 0; i < BENCH_N_COUNTERS; i++) {
+    if (bench_counter_fds[i] >= 0) {
+      printf(" %10.2f", (double)values[i] / iters);
+    } else {
+      printf(" %10s", "n/a");
+    }
+  }
+}
+
+#else
+
+#define BENCH_N_COUNTERS 1
+static void bench_counters_open(void) { }
+static void bench_counters_start(void) { }
+static void bench_counters_stop(uint64_t *values) { }
+static void bench_counters_header(void) { }
+static void bench_counters_print(uint64_t *values, uint64_t iters) { }
+
+#endif
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_run(char *name, bench_fn_t fn, bench_ctx_t *ctx, double min_seconds) {
+  uint64_t iters = 1;
+  uint64_t values[BENCH_N_COUNTERS];
+  double start, elapsed;
+
+  /* warm up, and find the batch size */
+  while (1) {
+    start = bench_now();
+    fn(ctx, iters);
+    elapsed = bench_now() - start;
+    if (elapsed >= min_seconds / 8) {
+      break;
+    }
+    iters *= 2;
+  }
+  iters = iters * (min_seconds / elapsed) + 1;
+
+  bench_counters_start();
+  start = bench_now();
+  fn(ctx, iters);
+  elapsed = bench_now() - start;
+  bench_counters_stop(values);
+
+  printf("%-40s %12.1f %14.0f", name, elapsed * 1e9 / iters, iters / elapsed);
+  bench_counters_print(values, iters);
+  printf("\n");
+}
+
+/********************************************************************
+ The peer generation and the distributions.
+ ********************************************************************/
+
+static void bench_peer_address(struct in6_addr *addr, uint32_t i) {
+  memset(addr, 0, sizeof(*addr));
+  addr->s6_addr[0] = 0x20;
+  addr->s6_addr[1] = 0x01;
+  addr->s6_addr[2] = 0x0d;
+  addr->s6_addr[3] = 0xb8;
+  /* spread the peers over the prefixes, like the real ones would be */
+  addr->s6_addr[6] = 0xff & (i * 2654435761U >> 24);
+  addr->s6_addr[7] = 0xff & (i * 2654435761U >> 16);
+  addr->s6_addr[12] = 0xff & (i >> 24);
+  addr->s6_addr[13] = 0xff & (i >> 16);
+  addr->s6_addr[14] = 0xff & (i >> 8);
+  addr->s6_addr[15] = 0xff & i;
+}
+
+static uint64_t bench_rand_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_rand(void) {
+  /* xorshift64* */
+  bench_rand_state ^= bench_rand_state >> 12;
+  bench_rand_state ^= bench_rand_state << 25;
+  bench_rand_state ^= bench_rand_state >> 27;
+  return bench_rand_state * 2685821657736338717ULL;
+}
+
+static void bench_seq_uniform(uint32_t *seq, int n) {
+  int i;
+  for (i = 0; i < BENCH_SEQ_SIZE; i++) {
+    seq[i] = bench_rand() % n;
+  }
+}
+
+static void bench_seq_zipf(uint32_t *seq, int n, double s) {
+  double *cdf = malloc(n * sizeof(*cdf));
+  double sum = 0;
+  int i;
+
+  if (!cdf) {
+    die_perror("bench malloc");
+  }
+  for (i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, s);
+    cdf[i] = sum;
+  }
+  for (i = 0; i < BENCH_SEQ_SIZE; i++) {
+    double u = sum * (bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (cdf[mid] < u) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    /* the popular peers should not all sit at the start of the table */
+    seq[i] = (lo * 2654435761U) % n;
+  }
+  free(cdf);
+}
+
+/*
+ * Populate the cache with the first n peers as if the SET-COOKIE
+ * has been received for them, with an infinite lifetime, so the
+ * outbound path stays in IPCOOKIE_TS_STILL_VALID. Some of them
+ * may have been evicted by the others landing in the same bucket.
+ */
+
+static void bench_cache_fill(bench_ctx_t *ctx, int n) {
+  ipcookie_entry_t *ce;
+  int i;
+
+  ipcookie_cache_init(&ctx->ipck->cache, &ctx->ipck->state);
+  for (i = 0; i < n; i++) {
+    ce = ipcookie_cache_entry_allocate(&ctx->ipck->cache, &ctx->peers[i], NULL);
+    ipcookie_entry_clear_disable_cookies(ce);
+    ipcookie_entry_clear_expecting_setcookie(ce);
+    ipcookie_entry_set_lifetime_log2(ce, IPCOOKIE_LIFETIME_LOG2_INFINITE);
+    ipcookie_entry_update_mtime(ce);
+    ipcookie_set_stateless(&ctx->ipck->state, &ce->ipcookie, &ctx->peers[i]);
+  }
+  ctx->n_peers = n;
+}
+
+/********************************************************************
+ The cases.
+ ********************************************************************/
+
+static void bench_verify_curr(bench_ctx_t *ctx, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += ipcookie_verify_stateless(&ctx->ipck->state, &ctx->good_cookie, &ctx->peers[0]);
+  }
+}
+
+static void bench_verify_nomatch(bench_ctx_t *ctx, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += ipcookie_verify_stateless(&ctx->ipck->state, &ctx->bad_cookie, &ctx->peers[0]);
+  }
+}
+
+static void bench_set_stateless(bench_ctx_t *ctx, uint64_t iters) {
+  ipcookie_t cookie;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ipcookie_set_stateless(&ctx->ipck->state, &cookie, &ctx->peers[i & 0xff]);
+    bench_sink += cookie[0];
+  }
+}
+
+static void bench_cache_find_hit(bench_ctx_t *ctx, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += (uintptr_t)ipcookie_cache_entry_find_by_address(&ctx->ipck->cache,
+                                      &ctx->peers[ctx->seq[i & BENCH_SEQ_MASK]]);
+  }
+}
+
+static void bench_cache_find_miss(bench_ctx_t *ctx, uint64_t iters) {
+  struct in6_addr missing;
+  uint64_t i;
+  bench_peer_address(&missing, 0xFFFFFFFF);
+  for (i = 0; i < iters; i++) {
+    bench_sink += (uintptr_t)ipcookie_cache_entry_find_by_address(&ctx->ipck->cache, &missing);
+  }
+}
+
+static void bench_outbound_cookie(bench_ctx_t *ctx, uint64_t iters) {
+  void *cookie;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += ipcookies_shim_outbound_cookie(&ctx->view, 1,
+                                      &ctx->peers[ctx->seq[i & BENCH_SEQ_MASK]], &cookie);
+  }
+}
+
+static void bench_policy_lookup(bench_ctx_t *ctx, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += ipcookie_policy_lookup(&ctx->ipck->policy, &ctx->peers[ctx->seq[i & BENCH_SEQ_MASK]]);
+  }
+}
+
+static void bench_budget_admit(bench_ctx_t *ctx, uint64_t iters) {
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    bench_sink += ipcookie_budget_admit(&ctx->ipck->budget, &ctx->peers[ctx->seq[i & BENCH_SEQ_MASK]], 1);
+  }
+}
+
+/*
+ * The policy for the whole 2001:db8::/32, and a /64 of its own for
+ * each of the first n peers, so most of the lookups go all the way
+ * down to the /64 nodes.
+ */
+static void bench_policy_fill(bench_ctx_t *ctx, int n) {
+  ipcookie_policy_rule_t *rules = calloc(n + 1, sizeof(*rules));
+  int i;
+
+  if (!rules) {
+    die_perror("bench calloc");
+  }
+  rules[0].prefix = ctx->peers[0];
+  memset(&rules[0].prefix.s6_addr[4], 0, 12);
+  rules[0].plen = 32;
+  rules[0].policy = IPCOOKIE_POLICY_USE;
+  for (i = 0; i < n; i++) {
+    rules[i + 1].prefix = ctx->peers[i];
+    memset(&rules[i + 1].prefix.s6_addr[8], 0, 8);
+    rules[i + 1].plen = 64;
+    rules[i + 1].policy = IPCOOKIE_POLICY_NEVER | IPCOOKIE_POLICY_EXEMPT;
+  }
+  if (ipcookie_policy_load(&ctx->ipck->policy, rules, n + 1) == -1) {
+    die_perror("bench policy load");
+  }
+  free(rules);
+}
+
+/* The peers not in the cache which it still finds, out of n */
+#define BENCH_COLLISION_LOOKUPS (1 << 24)
+
+static void bench_cache_collisions(bench_ctx_t *ctx) {
+  struct in6_addr missing;
+  uint64_t found = 0;
+  uint32_t i;
+
+  for (i = 0; i < BENCH_COLLISION_LOOKUPS; i++) {
+    bench_peer_address(&missing, IPCOOKIE_CACHE_SIZE + i);
+    found += ipcookie_cache_entry_find_by_address(&ctx->ipck->cache, &missing) != NULL;
+  }
+  printf("\n%-40s %12.1f bytes/peer, %.0f peers/MB\n", "cache_memory",
+         (double)sizeof(ipcookie_cache_t) / IPCOOKIE_CACHE_SIZE,
+         1048576.0 * IPCOOKIE_CACHE_SIZE / sizeof(ipcookie_cache_t));
+  printf("%-40s %12llu of %u peers not in the cache (%d%% full)\n", "cache_collisions",
+         (unsigned long long)found, BENCH_COLLISION_LOOKUPS, ctx->n_peers * 100 / IPCOOKIE_CACHE_SIZE);
+}
+
+static int bench_selected(char *name, char *filter) {
+  return !filter || strstr(name, filter);
+}
+
+int main(int argc, char *argv[]) {
+  bench_ctx_t ctx;
+  double min_seconds = 0.5;
+  double zipf_s = 1.0;
+  char *filter = NULL;
+  int fill_pct[] = { 1, 50, 99 };
+  char name[128];
+  char *pages = "small";
+  size_t len;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "t:s:H:")) != -1) {
+    switch (opt) {
+      case 't':
+        min_seconds = atof(optarg);
+        break;
+      case 's':
+        zipf_s = atof(optarg);
+        break;
+      case 'H':
+        pages = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t <seconds>] [-s <zipf exponent>] [-H small|thp|hugetlb]\n"
+                        "          [<case name substring>]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (optind < argc) {
+    filter = argv[optind];
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  len = (sizeof(*ctx.ipck) + BENCH_HUGE_PAGE_SIZE - 1) & ~(BENCH_HUGE_PAGE_SIZE - 1);
+  ctx.ipck = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (!strcmp(pages, "hugetlb")) {
+    ctx.ipck = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ctx.ipck == MAP_FAILED) {
+      perror("bench MAP_HUGETLB, falling back to the small pages");
+    }
+  }
+#endif
+#ifdef MADV_HUGEPAGE
+  if (!strcmp(pages, "thp")) {
+    ctx.ipck = ipcookies_mmap_aligned(len, BENCH_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    if (ctx.ipck != MAP_FAILED && madvise(ctx.ipck, len, MADV_HUGEPAGE) == -1) {
+      perror("bench MADV_HUGEPAGE");
+    }
+  }
+#endif
+  if (ctx.ipck == MAP_FAILED) {
+    ctx.ipck = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (ctx.ipck == MAP_FAILED) {
+    die_perror("bench mmap");
+  }
+  /* the anonymous pages are fresh */
+  ipcookies_segment_prepare(ctx.ipck, len, 1);
+  if (ipcookies_view_init(&ctx.view, ctx.ipck, len) == -1) {
+    exit(1);
+  }
+  ipcookie_state_init(&ctx.ipck->state);
+  ctx.ipck->state.halflife_log2 = 10;
+  ctx.peers = malloc(IPCOOKIE_CACHE_SIZE * sizeof(*ctx.peers));
+  ctx.seq = malloc(BENCH_SEQ_SIZE * sizeof(*ctx.seq));
+  if (!ctx.peers || !ctx.seq) {
+    die_perror("bench malloc");
+  }
+  for (i = 0; i < IPCOOKIE_CACHE_SIZE; i++) {
+    bench_peer_address(&ctx.peers[i], i);
+  }
+  ipcookie_set_stateless(&ctx.ipck->state, &ctx.good_cookie, &ctx.peers[0]);
+  memcpy(ctx.bad_cookie, ctx.good_cookie, sizeof(ctx.bad_cookie));
+  ctx.bad_cookie[0] ^= 1;
+
+  bench_counters_open();
+  printf("%-40s %12s %14s", "case", "ns/op", "ops/s");
+  bench_counters_header();
+  printf("\n");
+
+  if (bench_selected("verify_stateless/curr", filter)) {
+    bench_run("verify_stateless/curr", bench_verify_curr, &ctx, min_seconds);
+  }
+  if (bench_selected("verify_stateless/nomatch", filter)) {
+    bench_run("verify_stateless/nomatch", bench_verify_nomatch, &ctx, min_seconds);
+  }
+  if (bench_selected("set_stateless", filter)) {
+    bench_run("set_stateless", bench_set_stateless, &ctx, min_seconds);
+  }
+
+  bench_seq_uniform(ctx.seq, IPCOOKIE_CACHE_SIZE);
+  if (bench_selected("policy_lookup/empty", filter)) {
+    bench_run("policy_lookup/empty", bench_policy_lookup, &ctx, min_seconds);
+  }
+  bench_policy_fill(&ctx, BENCH_POLICY_RULES);
+  if (bench_selected("policy_lookup/64s", filter)) {
+    bench_run("policy_lookup/64s", bench_policy_lookup, &ctx, min_seconds);
+  }
+  /* the cases below are without the policy */
+  ipcookie_policy_load(&ctx.ipck->policy, NULL, 0);
+  ipcookie_budget_init(&ctx.ipck->budget, &ctx.ipck->state,
+                       IPCOOKIE_BUDGET_DEFAULT_PREFIX_PPS, IPCOOKIE_BUDGET_DEFAULT_PREFIX_BURST,
+                       IPCOOKIE_BUDGET_DEFAULT_GLOBAL_PPS, IPCOOKIE_BUDGET_DEFAULT_GLOBAL_BURST,
+                       IPCOOKIE_BUDGET_DEFAULT_AMP_FACTOR, IPCOOKIE_BUDGET_DEFAULT_AMP_CAP);
+  if (bench_selected("budget_admit", filter)) {
+    bench_run("budget_admit", bench_budget_admit, &ctx, min_seconds);
+  }
+
+  for (i = 0; i < sizeof(fill_pct)/sizeof(fill_pct[0]); i++) {
+    int n = IPCOOKIE_CACHE_SIZE * fill_pct[i] / 100;
+    bench_cache_fill(&ctx, n);
+
+    bench_seq_uniform(ctx.seq, n);
+    snprintf(name, sizeof(name), "cache_find/hit/fill%d/uniform", fill_pct[i]);
+    if (bench_selected(name, filter)) {
+      bench_run(name, bench_cache_find_hit, &ctx, min_seconds);
+    }
+    snprintf(name, sizeof(name), "cache_find/miss/fill%d", fill_pct[i]);
+    if (bench_selected(name, filter)) {
+      bench_run(name, bench_cache_find_miss, &ctx, min_seconds);
+    }
+    snprintf(name, sizeof(name), "outbound_cookie/fill%d/uniform", fill_pct[i]);
+    if (bench_selected(name, filter)) {
+      bench_run(name, bench_outbound_cookie, &ctx, min_seconds);
+    }
+    bench_seq_zipf(ctx.seq, n, zipf_s);
+    snprintf(name, sizeof(name), "outbound_cookie/fill%d/zipf%.2f", fill_pct[i], zipf_s);
+    if (bench_selected(name, filter)) {
+      bench_run(name, bench_outbound_cookie, &ctx, min_seconds);
+    }
+  }
+  if (bench_selected("cache_collisions", filter)) {
+    bench_cache_collisions(&ctx);
+  }
+  return 0;
+}
@@ -0,0 +1,484 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+
+/********************************************************************
+
+cookiectl: the operator's view into the /ipcookies shared memory.
+
+  cookiectl stats [<interval> [<count>]]
+
+     Without the interval, print the totals of the counters.
+     With the interval (in seconds), print the totals once and then
+     the per-second rates over each interval, count times (forever
+     if not given). The first line is the page size backing the
+     shared memory, then the NUMA nodes and the node each shard of
+     the cache is bound to (and, in the parentheses, where it is).
+     In the single writer mode (cookied -w) or with the cold tier
+     (cookied -c), cmds_dropped tells how many of the commands of
+     the shims did not fit in the command ring.
+
+  cookiectl events [-f]
+
+     Print the records from the event log, oldest first, and then
+     the number of the events dropped because the log was full.
+     With -f, keep waiting for the new ones. The printed records
+     are consumed, so only run one of these at a time.
+
+  cookiectl top [spoof|nomatch] [128|64|48]
+
+     Print the heavy hitters: our addresses used as the spoofed
+     source (spoof, the default), or the sources of the packets with
+     the wrong cookie (nomatch), at the given prefix length (128 by
+     default). The count is within the given error of the truth,
+     the estimate is from the count-min sketch. The counts are
+     halved every minute.
+
+  cookiectl hist
+
+     Print the p50/p99/p99.9 latencies of the hot paths, in
+     nanoseconds, since the shared memory was created. Needs
+     everything built with "make HISTOGRAMS=1".
+
+  cookiectl layout
+
+     Print the layout of the shared memory: the version, the feature
+     bits, and the offset, size and format version of each section.
+
+  cookiectl policy load <file>
+  cookiectl policy show
+  cookiectl policy lookup <address>...
+
+     Load the per-prefix policy from the file, replacing the one in
+     use (see ipcookies_policy.h), show how much of the table it
+     takes, or tell the policy for the given addresses. The file has
+     a rule per line, e.g.:
+
+       2001:db8::/32        use
+       2001:db8:1::/48      try-later 6
+       2001:db8:1:2::/64    never exempt
+       fd00::/8             exempt      # the trusted ones
+
+********************************************************************/
+
+typedef int (*cookiectl_cmd_fn_t)(ipcookie_view_t *ipck, int argc, char *argv[]);
+
+typedef struct cookiectl_cmd {
+  char *name;
+  cookiectl_cmd_fn_t fn;
+  char *help;
+} cookiectl_cmd_t;
+
+static double cookiectl_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void cookiectl_stats_snapshot(ipcookie_view_t *ipck, uint64_t *values) {
+  int i;
+  for (i = 0; i < IPCOOKIE_STAT_COUNT; i++) {
+    values[i] = ipcookie_stat_sum(ipck->stats, i);
+  }
+}
+
+/* Where the cache shards are meant to be, and where they are */
+static void cookiectl_stats_numa(ipcookie_view_t *ipck) {
+  int32_t location[IPCOOKIE_CACHE_SHARDS];
+  char name[32];
+  char placement[32];
+  int s;
+
+  ipcookie_numa_shard_location(ipck->cache, location);
+  printf("%-24s %20u\n", "numa_nodes", ipck->numa->nodes);
+  for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+    snprintf(name, sizeof(name), "cache_shard%d_node", s);
+    if (ipck->numa->shard_node[s] >= 0) {
+      snprintf(placement, sizeof(placement), "%d", ipck->numa->shard_node[s]);
+    } else {
+      snprintf(placement, sizeof(placement), "unbound");
+    }
+    if (location[s] >= 0) {
+      snprintf(placement + strlen(placement), sizeof(placement) - strlen(placement), " (on %d)", location[s]);
+    }
+    printf("%-24s %20s\n", name, placement);
+  }
+}
+
+static int cookiectl_stats(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  char *names[] = IPCOOKIE_STAT_NAMES;
+  char *page_modes[] = IPCOOKIE_PAGE_MODE_NAMES;
+  uint64_t prev[IPCOOKIE_STAT_COUNT];
+  uint64_t curr[IPCOOKIE_STAT_COUNT];
+  double interval = argc > 0 ? atof(argv[0]) : 0;
+  long count = argc > 1 ? atol(argv[1]) : -1;
+  double t_prev, t_curr;
+  int i;
+
+  cookiectl_stats_snapshot(ipck, prev);
+  t_prev = cookiectl_now();
+  printf("%-24s %20llu (%s)\n", "page_size", (unsigned long long)ipck->stats->page_size,
+         ipck->stats->page_mode < sizeof(page_modes) / sizeof(page_modes[0]) ?
+         page_modes[ipck->stats->page_mode] : "unknown");
+  if (ipck->numa) {
+    cookiectl_stats_numa(ipck);
+  }
+  if (ipck->cmds) {
+    printf("%-24s %20llu\n", "cmds_dropped",
+           (unsigned long long)__atomic_load_n(&ipck->cmds->dropped, __ATOMIC_RELAXED));
+  }
+  for (i = 0; i < IPCOOKIE_STAT_COUNT; i++) {
+    printf("%-24s %20llu\n", names[i], (unsigned long long)prev[i]);
+  }
+  if (interval <= 0) {
+    return 0;
+  }
+  while (count < 0 || count-- > 0) {
+    usleep(interval * 1e6);
+    cookiectl_stats_snapshot(ipck, curr);
+    t_curr = cookiectl_now();
+    printf("\n");
+    for (i = 0; i < IPCOOKIE_STAT_COUNT; i++) {
+      printf("%-24s %20llu %14.1f/s\n", names[i], (unsigned long long)curr[i],
+             (curr[i] - prev[i]) / (t_curr - t_prev));
+    }
+    fflush(stdout);
+    memcpy(prev, curr, sizeof(prev));
+    t_prev = t_curr;
+  }
+  return 0;
+}
+
+static void cookiectl_events_print(ipcookie_event_t *ev) {
+  char *names[] = IPCOOKIE_EVENT_NAMES;
+  char peer[INET6_ADDRSTRLEN];
+  char tbuf[32];
+  time_t sec = ev->timestamp_ns / 1000000000LL;
+  struct tm tm;
+  int i;
+
+  localtime_r(&sec, &tm);
+  strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+  inet_ntop(AF_INET6, &ev->peer, peer, sizeof(peer));
+  printf("%s.%06lld %-18s %-40s arg %3d cookie ", tbuf,
+         (long long)(ev->timestamp_ns % 1000000000LL) / 1000,
+         ev->type < IPCOOKIE_EVENT_COUNT ? names[ev->type] : "unknown", peer, ev->arg);
+  for (i = 0; i < sizeof(ev->cookie); i++) {
+    printf("%02x", ev->cookie[i]);
+  }
+  printf("\n");
+}
+
+static int cookiectl_events(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  int follow = argc > 0 && !strcmp(argv[0], "-f");
+  uint64_t dropped = __atomic_load_n(&ipck->events->dropped, __ATOMIC_RELAXED);
+  ipcookie_event_t ev;
+
+  do {
+    while (ipcookie_event_read(ipck->events, &ev)) {
+      cookiectl_events_print(&ev);
+    }
+    if (__atomic_load_n(&ipck->events->dropped, __ATOMIC_RELAXED) != dropped) {
+      dropped = __atomic_load_n(&ipck->events->dropped, __ATOMIC_RELAXED);
+      printf("dropped %llu events in total\n", (unsigned long long)dropped);
+    }
+    fflush(stdout);
+    if (follow) {
+      usleep(100000);
+    }
+  } while (follow);
+  printf("dropped %llu events in total\n", (unsigned long long)dropped);
+  return 0;
+}
+
+static int cookiectl_top(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  char *source_names[] = IPCOOKIE_HH_SOURCE_NAMES;
+  int plens[] = IPCOOKIE_HH_PLENS;
+  ipcookie_hh_entry_t entries[IPCOOKIE_HH_TOPK];
+  char prefix[INET6_ADDRSTRLEN + sizeof("/128")];
+  int source = IPCOOKIE_HH_SPOOF;
+  int plen = IPCOOKIE_HH_PLEN_128;
+  int i, n;
+
+  if (argc > 0) {
+    for (source = 0; source < IPCOOKIE_HH_SOURCE_COUNT; source++) {
+      if (!strcmp(argv[0], source_names[source])) {
+        break;
+      }
+    }
+    if (source == IPCOOKIE_HH_SOURCE_COUNT) {
+      fprintf(stderr, "Unknown source %s\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc > 1) {
+    for (plen = 0; plen < IPCOOKIE_HH_PLEN_COUNT; plen++) {
+      if (atoi(argv[1]) == plens[plen]) {
+        break;
+      }
+    }
+    if (plen == IPCOOKIE_HH_PLEN_COUNT) {
+      fprintf(stderr, "Unsupported prefix length %s\n", argv[1]);
+      return 1;
+    }
+  }
+
+  n = ipcookie_hh_topk(ipck->hh, source, plen, entries);
+  printf("%-44s %10s %10s %10s\n", "prefix", "count", "error", "estimate");
+  for (i = 0; i < n; i++) {
+    inet_ntop(AF_INET6, &entries[i].prefix, prefix, sizeof(prefix));
+    sprintf(prefix + strlen(prefix), "/%d", plens[plen]);
+    printf("%-44s %10u %10u %10u\n", prefix, entries[i].count, entries[i].error,
+           ipcookie_hh_estimate(ipck->hh, source, plen, &entries[i].prefix));
+  }
+  return 0;
+}
+
+#ifdef IPCOOKIES_HISTOGRAMS
+
+/* The timestamp ticks per nanosecond, measured against the monotonic clock */
+static double cookiectl_hist_ticks_per_ns(void) {
+  double t0 = cookiectl_now();
+  uint64_t ticks0 = ipcookie_hist_now();
+  usleep(100000);
+  return (ipcookie_hist_now() - ticks0) / ((cookiectl_now() - t0) * 1e9);
+}
+
+/* The highest value of the bucket where the given fraction of the samples is reached */
+static double cookiectl_hist_percentile(uint64_t *counts, uint64_t total, double fraction) {
+  uint64_t target = (uint64_t)(fraction * total + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  for (i = 0; i < IPCOOKIE_HIST_BUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen > 0 && seen >= target) {
+      break;
+    }
+  }
+  return ipcookie_hist_bucket_value(i + 1) - 1;
+}
+
+static int cookiectl_hist(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  char *names[] = IPCOOKIE_HIST_NAMES;
+  uint64_t counts[IPCOOKIE_HIST_BUCKETS];
+  double ticks_per_ns;
+  int h, i, b;
+
+  if (!ipck->hists) {
+    fprintf(stderr, "cookied runs without the histograms, rebuild it with \"make HISTOGRAMS=1\"\n");
+    return 1;
+  }
+  ticks_per_ns = cookiectl_hist_ticks_per_ns();
+
+  printf("%-24s %12s %10s %10s %10s %10s\n", "", "count", "p50", "p99", "p99.9", "max");
+  for (h = 0; h < IPCOOKIE_HIST_COUNT; h++) {
+    uint64_t total = 0;
+    int max_bucket = 0;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < IPCOOKIE_HIST_MAX_THREADS; i++) {
+      for (b = 0; b < IPCOOKIE_HIST_BUCKETS; b++) {
+        counts[b] += __atomic_load_n(&ipck->hists->slots[i].counts[h][b], __ATOMIC_RELAXED);
+      }
+    }
+    for (b = 0; b < IPCOOKIE_HIST_BUCKETS; b++) {
+      total += counts[b];
+      if (counts[b]) {
+        max_bucket = b;
+      }
+    }
+    if (total == 0) {
+      printf("%-24s %12d %10s %10s %10s %10s\n", names[h], 0, "-", "-", "-", "-");
+      continue;
+    }
+    printf("%-24s %12llu %10.0f %10.0f %10.0f %10.0f\n", names[h], (unsigned long long)total,
+           cookiectl_hist_percentile(counts, total, 0.50) / ticks_per_ns,
+           cookiectl_hist_percentile(counts, total, 0.99) / ticks_per_ns,
+           cookiectl_hist_percentile(counts, total, 0.999) / ticks_per_ns,
+           (ipcookie_hist_bucket_value(max_bucket + 1) - 1) / ticks_per_ns);
+  }
+  return 0;
+}
+
+#else
+
+static int cookiectl_hist(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  fprintf(stderr, "Built without the histograms, rebuild everything with \"make HISTOGRAMS=1\"\n");
+  return 1;
+}
+
+#endif
+
+static int cookiectl_layout(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  char *names[] = IPCOOKIE_SECTION_NAMES;
+  ipcookie_segment_hdr_t *hdr = ipck->segment;
+  ipcookie_segment_layout_t *layout;
+  int i;
+
+  printf("version %u size %llu initialized %u\n", hdr->version,
+         (unsigned long long)hdr->size, hdr->initialized);
+  if (hdr->magic != IPCOOKIE_SEGMENT_MAGIC || hdr->version < 2) {
+    printf("no section table\n");
+    return 0;
+  }
+  layout = (void *)((uint8_t *)hdr + hdr->layout_offset);
+  printf("incompat_features 0x%llx compat_features 0x%llx generation %u\n",
+         (unsigned long long)layout->incompat_features,
+         (unsigned long long)layout->compat_features, layout->generation);
+  printf("%-10s %12s %12s %8s\n", "section", "offset", "size", "version");
+  for (i = 0; i < layout->section_count && i < IPCOOKIE_SECTION_MAX; i++) {
+    if (layout->sections[i].offset) {
+      printf("%-10s %12llu %12llu %8u\n", i < IPCOOKIE_SECTION_COUNT ? names[i] : "unknown",
+             (unsigned long long)layout->sections[i].offset,
+             (unsigned long long)layout->sections[i].size, layout->sections[i].version);
+    }
+  }
+  return 0;
+}
+
+static void cookiectl_policy_print(uint32_t policy) {
+  char *actions[] = IPCOOKIE_POLICY_ACTION_NAMES;
+  uint32_t action = IPCOOKIE_POLICY_ACTION(policy);
+
+  printf("%s", action < IPCOOKIE_POLICY_ACTION_COUNT ? actions[action] : "unknown");
+  if (action == IPCOOKIE_POLICY_TRY_LATER) {
+    printf(" %u", IPCOOKIE_POLICY_LIFETIME_LOG2(policy));
+  }
+  if (policy & IPCOOKIE_POLICY_EXEMPT) {
+    printf(" exempt");
+  }
+  printf("\n");
+}
+
+static int cookiectl_policy_load(ipcookie_view_t *ipck, char *path) {
+  ipcookie_policy_rule_t *rules = NULL;
+  int n_rules = 0, room = 0;
+  int line_no = 0;
+  char line[256];
+  FILE *f = fopen(path, "r");
+
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    line_no++;
+    if (n_rules == room) {
+      room = room ? 2 * room : 64;
+      if (!(rules = realloc(rules, room * sizeof(*rules)))) {
+        die_perror("cookiectl realloc");
+      }
+    }
+    switch (ipcookie_policy_parse(line, &rules[n_rules])) {
+      case 1:
+        n_rules++;
+        break;
+      case -1:
+        fprintf(stderr, "%s:%d: can not make sense of: %s", path, line_no, line);
+        fclose(f);
+        free(rules);
+        return 1;
+    }
+  }
+  fclose(f);
+  if (ipcookie_policy_load(ipck->policy, rules, n_rules) == -1) {
+    perror("cookiectl: the policy is not loaded");
+    free(rules);
+    return 1;
+  }
+  free(rules);
+  printf("loaded %d rules, %u nodes of %d\n", n_rules,
+         ipck->policy->tables[ipck->policy->active & 1].nodes, IPCOOKIE_POLICY_NODES);
+  return 0;
+}
+
+static int cookiectl_policy(ipcookie_view_t *ipck, int argc, char *argv[]) {
+  ipcookie_policy_table_t *t;
+  struct in6_addr addr;
+  int i;
+
+  if (!ipck->policy) {
+    fprintf(stderr, "cookied runs without the policy, it needs to be upgraded\n");
+    return 1;
+  }
+  if (argc == 2 && !strcmp(argv[0], "load")) {
+    return cookiectl_policy_load(ipck, argv[1]);
+  }
+  if (argc == 1 && !strcmp(argv[0], "show")) {
+    t = &ipck->policy->tables[__atomic_load_n(&ipck->policy->active, __ATOMIC_ACQUIRE) & 1];
+    printf("%-24s %20llu\n", "loads", (unsigned long long)ipck->policy->loads);
+    printf("%-24s %20u\n", "rules", t->rules);
+    printf("%-24s %20u of %d\n", "nodes", t->nodes, IPCOOKIE_POLICY_NODES);
+    return 0;
+  }
+  if (argc > 1 && !strcmp(argv[0], "lookup")) {
+    for (i = 1; i < argc; i++) {
+      if (inet_pton(AF_INET6, argv[i], &addr) != 1) {
+        fprintf(stderr, "Not an IPv6 address: %s\n", argv[i]);
+        return 1;
+      }
+      printf("%-40s ", argv[i]);
+      cookiectl_policy_print(ipcookie_policy_lookup(ipck->policy, &addr));
+    }
+    return 0;
+  }
+  fprintf(stderr, "Usage: cookiectl policy load <file> | show | lookup <address>...\n");
+  return 1;
+}
+
+static cookiectl_cmd_t cookiectl_cmds[] = {
+  { "stats", cookiectl_stats, "[<interval> [<count>]]" },
+  { "events", cookiectl_events, "[-f]" },
+  { "top", cookiectl_top, "[spoof|nomatch] [128|64|48]" },
+  { "hist", cookiectl_hist, "" },
+  { "layout", cookiectl_layout, "" },
+  { "policy", cookiectl_policy, "load <file> | show | lookup <address>..." },
+  { NULL, NULL, NULL }
+};
+
+static void usage(char *argv0) {
+  cookiectl_cmd_t *cmd;
+  fprintf(stderr, "Usage:\n");
+  for (cmd = cookiectl_cmds; cmd->name; cmd++) {
+    fprintf(stderr, "  %s %s %s\n", argv0, cmd->name, cmd->help);
+  }
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  cookiectl_cmd_t *cmd;
+
+  if (argc < 2) {
+    usage(argv[0]);
+  }
+  for (cmd = cookiectl_cmds; cmd->name; cmd++) {
+    if (!strcmp(cmd->name, argv[1])) {
+      ipcookie_view_t *ipck = mmap_ipcookies();
+      if (!ipck) {
+        return 1;
+      }
+      if (!ipcookies_segment_is_initialized(ipck)) {
+        fprintf(stderr, "cookiectl: the shared memory is not initialized by cookied (yet)\n");
+      }
+      return cmd->fn(ipck, argc - 2, argv + 2);
+    }
+  }
+  usage(argv[0]);
+  return 1;
+}
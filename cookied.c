@@ -15,30 +15,112 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include "ipcookies.h"
+#include "ipcookies_bpf.h"
+#include "ipcookies_probes.h"
+#include "ipcookies_prf.h"
+#include "ipcookies_snapshot.h"
+#include "ipcookies_handover.h"
+#include "ipcookies_cold.h"
 
+/* How often (in milliseconds) we wake up to do the housekeeping */
+#define COOKIED_HOUSEKEEPING_INTERVAL_MS 1000
 
+/* How often (in milliseconds) we take the commands of the shims in the single writer mode */
+#define COOKIED_CMDS_INTERVAL_MS 10
+
+/* How often (in seconds) we save the snapshot, if asked to */
+#define COOKIED_SNAPSHOT_INTERVAL 60
+
+/* How often (in seconds) we refresh the clock offset in the BPF state map, if asked to */
+#define COOKIED_BPF_SYNC_INTERVAL 1
+
+/* The pinned BPF peer map used by tc_ipcookies.c, if any */
+static int peer_map_fd = -1;
+
+/* The cold tier of the cache (-c), if any */
+static ipcookie_cold_t cold;
+static ipcookie_cold_t *cold_tier = NULL;
+
+/* Set by SIGTERM/SIGINT, to save the snapshot and exit from the main loop */
+static volatile sig_atomic_t exit_requested = 0;
+
+static void cookied_exit_signal(int sig) {
+  exit_requested = 1;
+}
+
+
+
+/* A new entry in the cache, for cookied's own use: the evicted one goes to the cold tier */
+static ipcookie_entry_t *cache_allocate(ipcookie_full_state_t *ipck, struct in6_addr *peer) {
+  ipcookie_cache_slot_t evicted;
+  ipcookie_entry_t *ce = ipcookie_cache_entry_allocate(&ipck->cache, peer, &evicted);
+
+  if (ipcookie_cache_slot_in_use(&evicted)) {
+    ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_CACHE_EVICTIONS);
+    if (cold_tier) {
+      ipcookie_cold_put(cold_tier, ipcookie_cache_slot_peer(&evicted), &evicted.entry);
+      ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_COLD_DEMOTIONS);
+    }
+  }
+  if (ce) {
+    ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_CACHE_ALLOCATIONS);
+  }
+  return ce;
+}
 
 void process_icmp_set_cookie(ipcookie_full_state_t *ipck, void *buf, struct sockaddr_in6 icmp_src_addr) {
   struct icmp6_hdr *icmp = (void *)buf;
   struct icmp6_ipcookies *icmp_ipck = (void *)(icmp+1);
   ipcookie_entry_t *ce = ipcookie_cache_entry_find_by_address(&ipck->cache, &icmp_src_addr.sin6_addr);
+  ipcookie_entry_t cold_entry;
+  ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_CACHE_LOOKUPS);
+  if(!ce) {
+    ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_CACHE_MISSES);
+  }
+  if (!ce && cold_tier && ipcookie_cold_take(cold_tier, &icmp_src_addr.sin6_addr, &cold_entry)) {
+    /* the peer is answering what it got from us before the eviction */
+    ce = cache_allocate(ipck, &icmp_src_addr.sin6_addr);
+    if (ce) {
+      *ce = cold_entry;
+      ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_COLD_PROMOTIONS);
+    }
+  }
   if(ce) {
     if(!memcmp(ce->ipcookie, icmp_ipck->echoed_cookie, sizeof(ce->ipcookie))) {
       /* The echoed cookie has matched. We can update the entry. */
       memcpy(ce->ipcookie, icmp_ipck->requested_cookie, sizeof(ce->ipcookie));
       ipcookie_entry_update_mtime(ce);
       ipcookie_entry_set_lifetime_log2(ce, icmp->icmp6_ipck_lt_log2 & ICMP6_IPCK_LT_LOG2_MASK);
+      /* We heard back, so the next renew period starts afresh */
+      ipcookie_entry_clear_expecting_setcookie(ce);
+      IPCOOKIE_PROBE2(setcookie_accepted, icmp_src_addr.sin6_addr.s6_addr,
+                      icmp->icmp6_ipck_lt_log2 & ICMP6_IPCK_LT_LOG2_MASK);
     } else {
       /* 
        * The echoed cookie has not matched. Either it is a rollover time 
        * and this is the second SET-COOKIE in the train and we already updated,
        * or someone is trying to spoof the SET-COOKIE. Silently ignore.
        */
+      IPCOOKIE_PROBE2(setcookie_ignored, icmp_src_addr.sin6_addr.s6_addr,
+                      IPCOOKIE_PROBE_IGNORED_ECHO_MISMATCH);
+      ipcookie_event_log(&ipck->events, IPCOOKIE_EVENT_SETCOOKIE_IGNORED, 0,
+                         &icmp_src_addr.sin6_addr, &icmp_ipck->echoed_cookie);
     }
+  } else if ((peer_map_fd != -1) &&
+             ipcookies_bpf_peer_set_cookie(peer_map_fd, &icmp_src_addr.sin6_addr,
+                                           &icmp_ipck->echoed_cookie, &icmp_ipck->requested_cookie,
+                                           icmp->icmp6_ipck_lt_log2 & ICMP6_IPCK_LT_LOG2_MASK)) {
+    /* The entry was in the tc egress peer map, and got updated there if the echo matched */
   } else {
     /* Could not find cookie entry, so need to send back SETCOOKIE-NOT-EXPECTED */
+    IPCOOKIE_PROBE2(setcookie_ignored, icmp_src_addr.sin6_addr.s6_addr,
+                    IPCOOKIE_PROBE_IGNORED_NO_ENTRY);
+    ipcookie_event_log(&ipck->events, IPCOOKIE_EVENT_NOT_EXPECTED_SENT, 0,
+                       &icmp_src_addr.sin6_addr, &icmp_ipck->requested_cookie);
     ipcookies_icmp_send(ICMP6_IC_SETCOOKIE_NOT_EXPECTED, &icmp_ipck->requested_cookie, NULL, &icmp_src_addr.sin6_addr);
   }
 }
@@ -48,17 +130,74 @@ void process_icmp_setcookie_not_expected(ipcookie_full_state_t *ipck, void *buf,
   struct icmp6_ipcookies *icmp_ipck = (void *)(icmp+1);
   int cookie_ok = ipcookie_verify_stateless(&ipck->state, &icmp_ipck->echoed_cookie, &icmp_src_addr.sin6_addr);
   if (cookie_ok) {
-    printf("cookied: received a valid setcookie_not_expected");
-    if (AF_INET6 == icmp_src_addr.sin6_family) {
-        char src[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &icmp_src_addr.sin6_addr, src, INET6_ADDRSTRLEN);
-        printf(" from %s\n", src);
+    ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_SPOOF_EVENTS);
+    IPCOOKIE_PROBE2(spoof, icmp_src_addr.sin6_addr.s6_addr, cookie_ok);
+    /* see "cookiectl events" */
+    ipcookie_event_log(&ipck->events, IPCOOKIE_EVENT_SPOOF, cookie_ok,
+                       &icmp_src_addr.sin6_addr, &icmp_ipck->echoed_cookie);
+    /* the sender got our SET-COOKIE for a packet it never sent: its address is the one spoofed */
+    ipcookie_hh_add(&ipck->hh, IPCOOKIE_HH_SPOOF, &icmp_src_addr.sin6_addr);
+  }
+}
+
+/* The commands of the shims, for the single writer mode and the cold tier, see ipcookies_cmds.h */
+void apply_cmds(ipcookie_full_state_t *ipck) {
+  ipcookie_cmd_t cmd;
+  ipcookie_entry_t *ce;
+  ipcookie_entry_t cold_entry;
+  int n;
+
+  for (n = 0; n < IPCOOKIE_CMDS_SIZE && ipcookie_cmd_read(&ipck->cmds, &cmd); n++) {
+    ce = ipcookie_cache_entry_find_by_address(&ipck->cache, &cmd.peer);
+    if (cmd.type == IPCOOKIE_CMD_UPDATE) {
+      if (!ce || memcmp(ce, &cmd.observed, sizeof(*ce))) {
+        /* it has changed since, someone else got there first */
+        continue;
+      }
+      if (!ipcookie_entry_isset_disable_cookies(ce) && ipcookie_entry_isset_disable_cookies(&cmd.entry)) {
+        ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_FALLBACKS_ENTERED);
+        ipcookie_event_log(&ipck->events, IPCOOKIE_EVENT_FALLBACK,
+                           cmd.entry.flags_and_lifetime_log2, &cmd.peer, cmd.entry.ipcookie);
+      }
+    } else if (cmd.type == IPCOOKIE_CMD_ALLOCATE) {
+      if (ce || !(ce = cache_allocate(ipck, &cmd.peer))) {
+        continue;
+      }
+      if (cold_tier && ipcookie_cold_take(cold_tier, &cmd.peer, &cold_entry)) {
+        ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_COLD_PROMOTIONS);
+        cmd.entry = cold_entry;
+      }
+    } else if (cmd.type == IPCOOKIE_CMD_DEMOTE) {
+      /* unless it is back in the cache already, which then has the newer one */
+      if (!ce && cold_tier) {
+        ipcookie_cold_put(cold_tier, &cmd.peer, &cmd.entry);
+        ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_COLD_DEMOTIONS);
+      }
+      continue;
+    } else if (cmd.type == IPCOOKIE_CMD_PROMOTE) {
+      if (!cold_tier || !ipcookie_cold_take(cold_tier, &cmd.peer, &cold_entry)) {
+        continue;
+      }
+      if (!ce) {
+        /* evicted again meanwhile */
+        ipcookie_cold_put(cold_tier, &cmd.peer, &cold_entry);
+        continue;
+      }
+      if (memcmp(ce, &cmd.observed, sizeof(*ce))) {
+        /* it has moved on since, e.g. with a SET-COOKIE, and is newer */
+        continue;
+      }
+      ipcookie_stat_inc(&ipck->stats, IPCOOKIE_STAT_COLD_PROMOTIONS);
+      cmd.entry = cold_entry;
+    } else {
+      continue;
     }
-    printf(".\n");
+    *ce = cmd.entry;
   }
 }
 
 void receive_icmp(ipcookie_full_state_t *ipck, int icmp_sock) {
+  IPCOOKIE_HIST_START(t_start);
   uint8_t buf[IPCOOKIES_PACKET_BUF_SIZE];
   struct icmp6_hdr *icmp = (void *)buf;
   struct icmp6_ipcookies *icmp_ipck = (void *)(icmp+1);
@@ -81,22 +220,319 @@ void receive_icmp(ipcookie_full_state_t *ipck, int icmp_sock) {
       }
     }
   }
+  IPCOOKIE_HIST_RECORD(&ipck->hists, IPCOOKIE_HIST_RECEIVE_ICMP, t_start);
 }
 
 
+/* "<pps>[/<burst>]", the burst being a second's worth by default */
+static int parse_rate(char *arg, uint32_t *ret_pps, uint32_t *ret_burst) {
+  char *end;
+
+  *ret_pps = strtoul(arg, &end, 10);
+  *ret_burst = *ret_pps;
+  if (*end == '/') {
+    arg = end + 1;
+    *ret_burst = strtoul(arg, &end, 10);
+  }
+  return (end == arg || *end) ? -1 : 0;
+}
+
+void usage(char *argv0) {
+  fprintf(stderr, "Usage: %s [-x <pinned state map>] [-f pass|drop|redirect]\n"
+                  "       [-p <pinned peer map>] [-u] [-s <snapshot file>]\n"
+                  "       [-H <handover socket>] [-w] [-c <cold tier file> [-C <records>]]\n"
+                  "       [-a <pps per /64>[/<burst>]] [-A <pps overall>[/<burst>]]\n"
+                  "       [-F <amplification factor>[/<cap bytes>]]\n", argv0);
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
   int icmp_sock = -1;
   ipcookie_full_state_t *ipck = NULL;
+  char *state_map_path = NULL;
+  int state_map_fd = -1;
+  uint32_t xdp_fail_action = IPCOOKIE_XDP_FAIL_PASS;
+  uint32_t tc_default_use_ipcookies = 0;
+  char *peer_map_path = NULL;
+  struct icmp6_filter filter;
+  struct pollfd pfd[2];
+  struct sigaction sa;
+  char *snapshot_path = NULL;
+  char *handover_path = NULL;
+  int handover_fd = -1;
+  int handed_over = 0;
+  int handed_over_shm = 0;
+  int rekeyed = 0;
+  int handed_shm_fd = -1;
+  int single_writer = 0;
+  char *cold_path = NULL;
+  uint64_t cold_records = IPCOOKIE_COLD_DEFAULT_RECORDS;
+  uint32_t prefix_pps = IPCOOKIE_BUDGET_DEFAULT_PREFIX_PPS;
+  uint32_t prefix_burst = IPCOOKIE_BUDGET_DEFAULT_PREFIX_BURST;
+  uint32_t global_pps = IPCOOKIE_BUDGET_DEFAULT_GLOBAL_PPS;
+  uint32_t global_burst = IPCOOKIE_BUDGET_DEFAULT_GLOBAL_BURST;
+  uint32_t amp_factor = IPCOOKIE_BUDGET_DEFAULT_AMP_FACTOR;
+  uint32_t amp_cap = IPCOOKIE_BUDGET_DEFAULT_AMP_CAP;
+  int shm_fd = -1;
+  size_t shm_len;
+  uint32_t reset;
+  int shm_fresh = 0;
+  time_t last_snapshot;
+  time_t last_decay;
+  time_t last_bpf_sync = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "x:f:p:us:H:wc:C:a:A:F:")) != -1) {
+    switch (opt) {
+      case 'x':
+        state_map_path = optarg;
+        break;
+      case 'f':
+        if (!strcmp(optarg, "pass")) {
+          xdp_fail_action = IPCOOKIE_XDP_FAIL_PASS;
+        } else if (!strcmp(optarg, "drop")) {
+          xdp_fail_action = IPCOOKIE_XDP_FAIL_DROP;
+        } else if (!strcmp(optarg, "redirect")) {
+          xdp_fail_action = IPCOOKIE_XDP_FAIL_REDIRECT;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'p':
+        peer_map_path = optarg;
+        break;
+      case 'u':
+        tc_default_use_ipcookies = 1;
+        break;
+      case 's':
+        snapshot_path = optarg;
+        break;
+      case 'H':
+        handover_path = optarg;
+        break;
+      case 'w':
+        single_writer = 1;
+        break;
+      case 'c':
+        cold_path = optarg;
+        break;
+      case 'C':
+        cold_records = strtoull(optarg, NULL, 0);
+        if (!cold_records) {
+          usage(argv[0]);
+        }
+        break;
+      case 'a':
+        if (parse_rate(optarg, &prefix_pps, &prefix_burst) == -1) {
+          usage(argv[0]);
+        }
+        break;
+      case 'A':
+        if (parse_rate(optarg, &global_pps, &global_burst) == -1) {
+          usage(argv[0]);
+        }
+        break;
+      case 'F':
+        if (parse_rate(optarg, &amp_factor, &amp_cap) == -1) {
+          usage(argv[0]);
+        }
+        if (!strchr(optarg, '/')) {
+          amp_cap = IPCOOKIE_BUDGET_DEFAULT_AMP_CAP;
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  shm_fd = open_ipcookies_shm(&shm_fresh);
+  if (shm_fd == -1) {
+    die_perror("ipcookies shared memory");
+  }
+  ipck = mmap_ipcookies_fd(shm_fd, &shm_len);
+  if (!ipck) {
+    die_perror("ipcookies mmap");
+  }
+  /*
+   * Before the handover, so the running instance carries on if we can
+   * not: the attached readers must not see their sections move. Locked,
+   * no new reader attaches until the segment is set up.
+   */
+  if (ipcookies_segment_lock(shm_fd) == -1 && (reset = ipcookies_segment_changes(ipck, shm_len))) {
+    fprintf(stderr, "cookied: the shared memory is in use with another layout (the sections 0x%x differ), "
+                    "stop its users first or run the cookied of its layout\n", reset);
+    exit(1);
+  }
+
+  if (handover_path) {
+    if (ipcookies_handover_request(handover_path, &icmp_sock, &handed_shm_fd) == 0) {
+      struct stat ours, theirs;
+      handed_over = 1;
+      printf("cookied: took over from the running instance\n");
+      /* the one we have opened by the name, unless the environments differ */
+      handed_over_shm = fstat(shm_fd, &ours) == 0 && fstat(handed_shm_fd, &theirs) == 0 &&
+                        ours.st_dev == theirs.st_dev && ours.st_ino == theirs.st_ino;
+      if (!handed_over_shm) {
+        fprintf(stderr, "cookied: the running instance had another shared memory, starting afresh with ours\n");
+      }
+      close(handed_shm_fd);
+    } else if (errno != ENOENT && errno != ECONNREFUSED) {
+      die_perror("cookied handover");
+    }
+  }
+
+  if (!handed_over) {
+    icmp_sock = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+    if (icmp_sock == -1) {
+      die_perror("icmp socket");
+    }
+    ICMP6_FILTER_SETBLOCKALL(&filter);
+    ICMP6_FILTER_SETPASS(ICMP6_IPCOOKIES, &filter);
+    if (setsockopt(icmp_sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)) == -1) {
+      die_perror("icmp filter");
+    }
+  }
+
+  reset = ipcookies_segment_prepare(ipck, shm_len, shm_fresh);
+  if (reset == IPCOOKIE_SECTIONS_ALL) {
+    printf("cookied: initialized the new shared memory segment\n");
+  } else if (reset) {
+    printf("cookied: migrated the shared memory layout, cleared the sections 0x%x\n", reset);
+  }
+  if (!handed_over_shm || (reset & (1 << IPCOOKIE_SECTION_STATE))) {
+    /* otherwise the state is live, and stays as it is */
+    int restored = -1;
+    rekeyed = 1;
+    ipcookie_numa_invalidate(&ipck->numa);
+    if (snapshot_path) {
+      restored = ipcookie_snapshot_load(ipck, snapshot_path);
+      if (restored >= 0) {
+        printf("cookied: restored %d cache entries from %s\n", restored, snapshot_path);
+      } else if (errno != ENOENT) {
+        fprintf(stderr, "cookied: ignoring the snapshot %s: %s\n", snapshot_path, strerror(errno));
+      }
+    }
+    if (restored < 0) {
+      ipcookie_state_init(&ipck->state);
+      ipcookie_cache_init(&ipck->cache, &ipck->state);
+    }
+    /* the sketches get keyed anew below, the old counts would be noise */
+    memset(&ipck->hh, 0, sizeof(ipck->hh));
+  } else if (reset & (1 << IPCOOKIE_SECTION_CACHE)) {
+    ipcookie_cache_init(&ipck->cache, &ipck->state);
+  }
+  ipcookies_shm_backing(shm_fd, &ipck->stats.page_mode, &ipck->stats.page_size);
+  /* the part of the secret not used by the PRF keys the heavy hitter sketches */
+  ipcookie_hh_init(&ipck->hh, ipck->state.ipcookie_secret + IPCOOKIE_PRF_KEY_SIZE);
+  ipcookie_numa_place(ipck);
+  if (rekeyed || (reset & (1 << IPCOOKIE_SECTION_BUDGET))) {
+    ipcookie_budget_init(&ipck->budget, &ipck->state, prefix_pps, prefix_burst, global_pps, global_burst,
+                         amp_factor, amp_cap);
+  } else {
+    ipcookie_budget_set_limits(&ipck->budget, prefix_pps, prefix_burst, global_pps, global_burst,
+                               amp_factor, amp_cap);
+  }
+  if (single_writer) {
+    /* the shims which would write the cache themselves can not attach from now on, the attached ones switch */
+    ipck->layout.incompat_features |= IPCOOKIE_FEATURE_SINGLE_WRITER;
+  }
+  if (cold_path) {
+    if (!ipcookie_cache_slot_peer(&ipck->cache.slots[0])) {
+      fprintf(stderr, "cookied: the cold tier needs the addresses, which the compact cache does not keep\n");
+      exit(1);
+    }
+    if (ipcookie_cold_open(&cold, cold_path, cold_records) == -1) {
+      die_perror("cookied cold tier");
+    }
+    cold_tier = &cold;
+    printf("cookied: %llu entries in the cold tier %s\n", (unsigned long long)cold.hdr->records, cold_path);
+    /* the shims tell us about the evictions and the misses from now on (the attached ones on their slow path) */
+    ipck->layout.compat_features |= IPCOOKIE_FEATURE_COLD_TIER;
+  }
+  ipcookies_segment_set_initialized(ipck);
+  ipcookies_segment_unlock(shm_fd);
+  last_decay = time(NULL);
+  last_snapshot = time(NULL);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = cookied_exit_signal;
+  sigemptyset(&sa.sa_mask);
+  /* no SA_RESTART: the poll() below needs to return */
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
 
-  icmp_sock = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-  if (icmp_sock == -1) {
-    die_perror("icmp socket");
+  if (state_map_path) {
+    state_map_fd = ipcookies_bpf_obj_get(state_map_path);
+    if (state_map_fd == -1) {
+      die_perror("bpf state map");
+    }
+  }
+  if (peer_map_path) {
+    peer_map_fd = ipcookies_bpf_obj_get(peer_map_path);
+    if (peer_map_fd == -1) {
+      die_perror("bpf peer map");
+    }
   }
 
-  ipck = mmap_ipcookies();
-  
-  memset(ipck, 0, sizeof(*ipck));
-  while(1) {
-    receive_icmp(ipck, icmp_sock);
+  if (handover_path) {
+    handover_fd = ipcookies_handover_listen(handover_path);
+    if (handover_fd == -1) {
+      die_perror("cookied handover socket");
+    }
+  }
+
+  pfd[0].fd = icmp_sock;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = handover_fd;
+  pfd[1].events = POLLIN;
+  while(!exit_requested) {
+    if (single_writer || cold_tier) {
+      apply_cmds(ipck);
+    }
+    if (state_map_fd != -1 && time(NULL) - last_bpf_sync >= COOKIED_BPF_SYNC_INTERVAL) {
+      /*
+       * The state itself only changes before the loop, so the first pass
+       * copies it; the later ones only follow the steps of the realtime clock.
+       */
+      if (ipcookies_bpf_state_sync(state_map_fd, &ipck->state, xdp_fail_action,
+                                   tc_default_use_ipcookies) == -1) {
+        perror("bpf state map update");
+      }
+      last_bpf_sync = time(NULL);
+    }
+    if (snapshot_path && time(NULL) - last_snapshot >= COOKIED_SNAPSHOT_INTERVAL) {
+      if (ipcookie_snapshot_save(ipck, snapshot_path) == -1) {
+        perror("cookied: snapshot save");
+      }
+      last_snapshot = time(NULL);
+    }
+    if (time(NULL) - last_decay >= IPCOOKIE_HH_DECAY_INTERVAL) {
+      ipcookie_hh_decay(&ipck->hh);
+      last_decay = time(NULL);
+    }
+    if (poll(pfd, 2, (single_writer || cold_tier) ? COOKIED_CMDS_INTERVAL_MS : COOKIED_HOUSEKEEPING_INTERVAL_MS) > 0) {
+      if (pfd[0].revents & POLLIN) {
+        receive_icmp(ipck, icmp_sock);
+      }
+      if ((pfd[1].revents & POLLIN) && ipcookies_handover_serve(handover_fd, icmp_sock, shm_fd)) {
+        /* the successor has it all now, including what is still queued on the socket */
+        printf("cookied: handed over to the new instance\n");
+        if (cold_tier) {
+          ipcookie_cold_close(cold_tier);
+        }
+        return 0;
+      }
+    }
+  }
+  if (single_writer || cold_tier) {
+    apply_cmds(ipck);
+  }
+  if (cold_tier) {
+    ipcookie_cold_close(cold_tier);
+  }
+  if (snapshot_path && ipcookie_snapshot_save(ipck, snapshot_path) == -1) {
+    perror("cookied: snapshot save");
+    return 1;
   }
+  return 0;
 }
@@ -15,6 +15,13 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 
 #include "ipcookies.h"
 
@@ -33,7 +40,11 @@ void ipcookies_icmp_send(uint8_t code, ipcookie_t *echoed_cookie,
   ipcookie_t zero_cookie = { 0 };
 
   if (icmp_sock < 0) {
+    struct icmp6_filter filter;
     icmp_sock = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+    /* This one is for sending only, do not let the received ICMPs pile up on it */
+    ICMP6_FILTER_SETBLOCKALL(&filter);
+    setsockopt(icmp_sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
   }
   if (icmp_sock > 0) {
     /* FIXME: recalculate the checksum here */
@@ -42,6 +53,7 @@ void ipcookies_icmp_send(uint8_t code, ipcookie_t *echoed_cookie,
     memcpy(icmp_ipck->echoed_cookie, echoed_cookie ? echoed_cookie : &zero_cookie, sizeof(icmp_ipck->echoed_cookie));
     memcpy(icmp_ipck->requested_cookie, requested_cookie ? requested_cookie : &zero_cookie, sizeof(icmp_ipck->requested_cookie));
 
+    memset(&sa_dst, 0, sizeof(sa_dst));
     sa_dst.sin6_family = AF_INET6;
     sa_dst.sin6_addr = *icmp_dst_addr;
     sendto(icmp_sock, buf, IPCOOKIES_ICMP_SIZE, 0, (struct sockaddr *)&sa_dst, sizeof(sa_dst));
@@ -123,6 +135,16 @@ ipcookie_ts_check_t check_ipcookie_entry_timestamp(ipcookie_entry_t *ce) {
   }
 }
 
+time_t ipcookie_entry_valid_until(ipcookie_entry_t *ce, time_t now) {
+  time_t ts = expand_timestamp(now, ce->mtime_hi8, ce->mtime_lo16);
+  time_t lifetime = (1 << ipcookie_entry_get_lifetime_log2(ce));
+
+  if (1<<IPCOOKIE_LIFETIME_LOG2_INFINITE == lifetime) {
+    return IPCOOKIE_TIME_INFINITE;
+  }
+  return ts + lifetime;
+}
+
 void ipcookie_entry_set_lifetime_log2(ipcookie_entry_t *ce, int new_lifetime_log2) {
   if( (new_lifetime_log2 < 256) && (new_lifetime_log2 >= 0) ) {
     ce->flags_and_lifetime_log2 &= ~IPCOOKIE_ENTRY_MASK_LIFETIME_LOG2;
@@ -137,23 +159,521 @@ void ipcookie_entry_mtime_backdate_by_lifetime_log2(ipcookie_entry_t *ce) {
 
 
 
-ipcookie_full_state_t *mmap_ipcookies(void) {
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define IPCOOKIES_THP_SIZE_PATH "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define IPCOOKIES_THP_SHMEM_PATH "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+#define IPCOOKIES_THP_DEFAULT_SIZE (2 * 1024 * 1024)
+
+static int ipcookies_want_thp(void) {
+  char *huge = getenv(IPCOOKIES_HUGEPAGES_ENV);
+  return huge && !strcmp(huge, "thp");
+}
+
+static uint64_t ipcookies_thp_size(void) {
+  uint64_t size = 0;
+  FILE *f = fopen(IPCOOKIES_THP_SIZE_PATH, "r");
+  if (f) {
+    if (fscanf(f, "%llu", (unsigned long long *)&size) != 1) {
+      size = 0;
+    }
+    fclose(f);
+  }
+  return size ? size : IPCOOKIES_THP_DEFAULT_SIZE;
+}
+
+/* Whether the kernel would use THP for the shared memory we madvise() */
+static int ipcookies_thp_shmem_enabled(void) {
+  char buf[128] = "";
+  FILE *f = fopen(IPCOOKIES_THP_SHMEM_PATH, "r");
+  if (!f) {
+    return 0;
+  }
+  if (!fgets(buf, sizeof(buf), f)) {
+    buf[0] = 0;
+  }
+  fclose(f);
+  return !strstr(buf, "[never]") && !strstr(buf, "[deny]");
+}
+
+void ipcookies_shm_backing(int fd, uint32_t *ret_page_mode, uint64_t *ret_page_size) {
+#ifdef __linux__
+  struct statfs sfs;
+  if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+    *ret_page_mode = IPCOOKIE_PAGES_HUGETLBFS;
+    *ret_page_size = sfs.f_bsize;
+    return;
+  }
+#endif
+  if (ipcookies_want_thp()) {
+    *ret_page_mode = IPCOOKIE_PAGES_THP;
+    *ret_page_size = ipcookies_thp_shmem_enabled() ? ipcookies_thp_size() : sysconf(_SC_PAGESIZE);
+    return;
+  }
+  *ret_page_mode = IPCOOKIE_PAGES_SMALL;
+  *ret_page_size = sysconf(_SC_PAGESIZE);
+}
+
+/* The size of the mapping, the whole number of the (huge) pages */
+static size_t ipcookies_shm_size(int fd) {
+  uint32_t page_mode;
+  uint64_t page_size;
+  ipcookies_shm_backing(fd, &page_mode, &page_size);
+  return (sizeof(ipcookie_full_state_t) + page_size - 1) & ~(page_size - 1);
+}
+
+void *ipcookies_mmap_aligned(size_t len, size_t align, int prot, int flags, int fd) {
+  uint8_t *reserve, *aligned;
+
+  /* reserve the room for the alignment, then map over the aligned part of it */
+  reserve = mmap(NULL, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserve == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  aligned = (uint8_t *)(((uintptr_t)reserve + align - 1) & ~(uintptr_t)(align - 1));
+  if (mmap(aligned, len, prot, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(reserve, len + align);
+    return MAP_FAILED;
+  }
+  if (aligned > reserve) {
+    munmap(reserve, aligned - reserve);
+  }
+  munmap(aligned + len, reserve + len + align - (aligned + len));
+  return aligned;
+}
+
+/* The hugetlbfs file, if asked for and if there are enough huge pages to map it */
+static int open_ipcookies_hugetlbfs(char *dir, int *ret_fresh) {
+  char path[PATH_MAX];
+  struct stat st;
+  size_t len;
+  void *probe;
   int fd;
-  ipcookie_full_state_t *ipck = NULL;
 
+#ifdef __linux__
+  struct statfs sfs;
+  if (statfs(dir, &sfs) == -1 || sfs.f_type != HUGETLBFS_MAGIC) {
+    fprintf(stderr, "ipcookies: %s is not a hugetlbfs mount, falling back to the small pages\n", dir);
+    return -1;
+  }
+#endif
+  snprintf(path, sizeof(path), "%s/ipcookies", dir);
+  /* not inherited over exec(), the mapping is not either, and the lock goes with it */
+  fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    perror("ipcookies hugetlbfs open, falling back to the small pages");
+    return -1;
+  }
+  len = ipcookies_shm_size(fd);
+  if (ret_fresh) {
+    *ret_fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+  }
+  if (ftruncate(fd, len) == -1 ||
+      (probe = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    perror("ipcookies hugetlbfs, falling back to the small pages");
+    close(fd);
+    return -1;
+  }
+  munmap(probe, len);
+  return fd;
+}
+
+/* Big enough for our layout; *ret_fresh tells if it was empty, i.e. all zeroes once grown */
+static int ipcookies_shm_grow(int fd, int *ret_fresh) {
+  struct stat st;
+  int have_size = fstat(fd, &st) == 0;
+
+  if (ret_fresh) {
+    *ret_fresh = have_size && st.st_size == 0;
+  }
+  /* never shrink it, someone with the bigger pages or layout may have it mapped */
+  if (have_size && st.st_size >= ipcookies_shm_size(fd)) {
+    return 0;
+  }
+  /* mapping it anyway would only get us the SIGBUS later */
+  return ftruncate(fd, ipcookies_shm_size(fd));
+}
+
+int open_ipcookies_shm(int *ret_fresh) {
+  char *huge = getenv(IPCOOKIES_HUGEPAGES_ENV);
+  int fd;
+
+  if (huge && huge[0] == '/') {
+    fd = open_ipcookies_hugetlbfs(huge, ret_fresh);
+    if (fd != -1) {
+      return fd;
+    }
+  }
   fd = shm_open("/ipcookies", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
   if (fd == -1) {
-    die_perror("ipcookies shm_open");
+    return -1;
+  }
+  if (ipcookies_shm_grow(fd, ret_fresh) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* The whole segment: it may be bigger than our layout, if someone else's is */
+static void *ipcookies_map_fd(int fd, size_t *ret_len) {
+  void *ipck = NULL;
+  size_t len = ipcookies_shm_size(fd);
+  uint32_t page_mode;
+  uint64_t page_size;
+  struct stat st;
+
+  if (fstat(fd, &st) == 0 && st.st_size > len) {
+    len = st.st_size;
   }
-  if (ftruncate(fd, sizeof(ipcookie_full_state_t)) == -1) {
-    // die_perror("ipcookies ftruncate");
-    perror("ipcookies ftruncate");
+  ipcookies_shm_backing(fd, &page_mode, &page_size);
+  if (page_mode == IPCOOKIE_PAGES_THP) {
+    ipck = ipcookies_mmap_aligned(len, ipcookies_thp_size(),
+             PROT_READ | PROT_WRITE, MAP_SHARED, fd);
+#ifdef MADV_HUGEPAGE
+    if (ipck != MAP_FAILED) {
+      madvise(ipck, len, MADV_HUGEPAGE);
+    }
+#endif
+  } else {
+    ipck = mmap(NULL, len,
+         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   }
-  ipck = mmap(NULL, sizeof(*ipck),
-       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (ipck == MAP_FAILED) {
-    die_perror("ipcookies mmap");
+    return NULL;
   }
-  close(fd);
+  *ret_len = len;
   return ipck;
 }
+
+ipcookie_full_state_t *mmap_ipcookies_fd(int fd, size_t *ret_len) {
+  /* e.g. created by a reader of a smaller layout */
+  if (ipcookies_shm_grow(fd, NULL) == -1) {
+    return NULL;
+  }
+  return ipcookies_map_fd(fd, ret_len);
+}
+
+int ipcookies_segment_lock(int fd) {
+  int res;
+
+  do {
+    res = flock(fd, LOCK_EX | LOCK_NB);
+  } while (res == -1 && errno == EINTR);
+  return res;
+}
+
+void ipcookies_segment_unlock(int fd) {
+  flock(fd, LOCK_UN);
+}
+
+/* The layout of this build */
+static void ipcookies_segment_layout_native(ipcookie_segment_layout_t *layout) {
+  uint32_t versions[] = IPCOOKIE_SECTION_VERSIONS;
+
+  memset(layout, 0, sizeof(*layout));
+  layout->incompat_features = IPCOOKIE_INCOMPAT_FEATURES;
+  layout->compat_features = IPCOOKIE_COMPAT_FEATURES;
+  layout->section_count = IPCOOKIE_SECTION_COUNT;
+#define IPCOOKIE_NATIVE_SECTION(id, member) do { \
+    layout->sections[id].offset = offsetof(ipcookie_full_state_t, member); \
+    layout->sections[id].size = sizeof(((ipcookie_full_state_t *)0)->member); \
+    layout->sections[id].version = versions[id]; \
+  } while (0)
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_STATE, state);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_CACHE, cache);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_STATS, stats);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_EVENTS, events);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_HH, hh);
+#ifdef IPCOOKIES_HISTOGRAMS
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_HISTS, hists);
+#endif
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_NUMA, numa);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_CMDS, cmds);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_POLICY, policy);
+  IPCOOKIE_NATIVE_SECTION(IPCOOKIE_SECTION_BUDGET, budget);
+#undef IPCOOKIE_NATIVE_SECTION
+}
+
+/*
+ * The version 1 layout, which had no table, as it was then (on the
+ * LP64 ABIs): the histograms, being the last, were there if the size
+ * says so.
+ */
+static const ipcookie_segment_section_t ipcookies_segment_v1_sections[] = {
+  { 32, 68, 1 },              /* state */
+  { 128, 2129984, 1 },        /* cache */
+  { 2130112, 32832, 1 },      /* stats */
+  { 2162944, 262336, 1 },     /* events */
+  { 2425280, 398272, 1 },     /* hh */
+};
+#define IPCOOKIE_SEGMENT_V1_HISTS_OFFSET 2823552
+
+/* The layout the segment at base has, or -1 if it has none (yet) */
+static int ipcookies_segment_layout_read(void *base, size_t len, ipcookie_segment_layout_t *layout) {
+  ipcookie_segment_hdr_t *hdr = base;
+
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != IPCOOKIE_SEGMENT_MAGIC) {
+    return -1;
+  }
+  if (hdr->version == 1) {
+    /* no table to check it against, but the size has to fit the sections and the mapping */
+    if (hdr->size < IPCOOKIE_SEGMENT_V1_HISTS_OFFSET || hdr->size > len) {
+      return -1;
+    }
+    memset(layout, 0, sizeof(*layout));
+    layout->section_count = IPCOOKIE_SECTION_HISTS + 1;
+    memcpy(layout->sections, ipcookies_segment_v1_sections, sizeof(ipcookies_segment_v1_sections));
+    if (hdr->size > IPCOOKIE_SEGMENT_V1_HISTS_OFFSET) {
+      layout->compat_features = IPCOOKIE_FEATURE_HISTOGRAMS;
+      layout->sections[IPCOOKIE_SECTION_HISTS].offset = IPCOOKIE_SEGMENT_V1_HISTS_OFFSET;
+      layout->sections[IPCOOKIE_SECTION_HISTS].size = hdr->size - IPCOOKIE_SEGMENT_V1_HISTS_OFFSET;
+      layout->sections[IPCOOKIE_SECTION_HISTS].version = 1;
+    }
+    return 0;
+  }
+  if (hdr->version != IPCOOKIE_SEGMENT_VERSION || hdr->layout_offset < sizeof(*hdr) ||
+      hdr->layout_offset + sizeof(*layout) > len) {
+    return -1;
+  }
+  memcpy(layout, (uint8_t *)base + hdr->layout_offset, sizeof(*layout));
+  if (layout->section_count > IPCOOKIE_SECTION_MAX) {
+    return -1;
+  }
+  memset(&layout->sections[layout->section_count], 0,
+         (IPCOOKIE_SECTION_MAX - layout->section_count) * sizeof(layout->sections[0]));
+  return 0;
+}
+
+/* The sections of ours which are not where and as the old layout has them */
+static uint32_t ipcookies_segment_diff(ipcookie_segment_layout_t *old, ipcookie_segment_layout_t *native) {
+  uint32_t changed = 0;
+  int i;
+
+  for (i = 0; i < IPCOOKIE_SECTION_COUNT; i++) {
+    ipcookie_segment_section_t *s = &native->sections[i];
+    if (s->offset && memcmp(s, &old->sections[i], sizeof(*s))) {
+      changed |= 1 << i;
+    }
+  }
+  return changed;
+}
+
+uint32_t ipcookies_segment_changes(void *base, size_t len) {
+  ipcookie_segment_layout_t old, native;
+
+  ipcookies_segment_layout_native(&native);
+  if (ipcookies_segment_layout_read(base, len, &old) == -1) {
+    return 0;
+  }
+  return ipcookies_segment_diff(&old, &native);
+}
+
+uint32_t ipcookies_segment_prepare(ipcookie_full_state_t *ipck, size_t len, int fresh) {
+  ipcookie_segment_hdr_t *hdr = &ipck->segment;
+  ipcookie_segment_layout_t old, native;
+  uint32_t reset = 0;
+  int i;
+
+  ipcookies_segment_layout_native(&native);
+  /* the mapping covers the layout of whoever had it before, be it bigger than ours */
+  if (ipcookies_segment_layout_read(ipck, len, &old) == -1) {
+    /* nothing we can make sense of is cleared, the slow path; the new one is all zeroes already */
+    if (!fresh) {
+      memset(ipck, 0, sizeof(*ipck));
+    }
+    reset = IPCOOKIE_SECTIONS_ALL;
+  } else {
+    __atomic_store_n(&hdr->initialized, 0, __ATOMIC_RELEASE);
+    reset = ipcookies_segment_diff(&old, &native);
+    for (i = 0; i < IPCOOKIE_SECTION_COUNT; i++) {
+      if (reset & (1 << i)) {
+        memset((uint8_t *)ipck + native.sections[i].offset, 0, native.sections[i].size);
+      }
+    }
+  }
+  /* the readers attached follow the new features once set_initialized bumps it */
+  native.generation = reset == IPCOOKIE_SECTIONS_ALL ? 0 : old.generation;
+  ipck->layout = native;
+  hdr->size = sizeof(*ipck);
+  hdr->layout_offset = offsetof(ipcookie_full_state_t, layout);
+  __atomic_store_n(&hdr->version, IPCOOKIE_SEGMENT_VERSION, __ATOMIC_RELEASE);
+  __atomic_store_n(&hdr->magic, IPCOOKIE_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+  return reset;
+}
+
+void ipcookies_segment_set_initialized(ipcookie_full_state_t *ipck) {
+  /* the features are final now, see ipcookies_view_refresh() */
+  __atomic_add_fetch(&ipck->layout.generation, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ipck->segment.initialized, 1, __ATOMIC_RELEASE);
+}
+
+/* Take on the features, or -1 if the single writer mode can not be followed */
+static int ipcookies_view_set_features(ipcookie_view_t *view, uint64_t incompat_features,
+                                       uint64_t compat_features) {
+  ipcookie_cmds_t *cmds = NULL;
+
+  if ((incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) || (compat_features & IPCOOKIE_FEATURE_COLD_TIER)) {
+    cmds = view->cmds_section;
+  }
+  if (!cmds && (incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER)) {
+    return -1;
+  }
+  __atomic_store_n(&view->cmds, cmds, __ATOMIC_RELAXED);
+  __atomic_store_n(&view->compat_features, compat_features, __ATOMIC_RELAXED);
+  __atomic_store_n(&view->incompat_features, incompat_features, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int ipcookies_view_init(ipcookie_view_t *view, void *base, size_t len) {
+  char *names[] = IPCOOKIE_SECTION_NAMES;
+  ipcookie_segment_layout_t layout, native;
+  void **sections[IPCOOKIE_SECTION_COUNT] = {
+    (void **)&view->state, (void **)&view->cache, (void **)&view->stats,
+    (void **)&view->events, (void **)&view->hh, (void **)&view->hists, (void **)&view->numa,
+    (void **)&view->cmds, (void **)&view->policy,
+    (void **)&view->budget
+  };
+  int have_layout;
+  int i;
+
+  ipcookies_segment_layout_native(&native);
+  have_layout = ipcookies_segment_layout_read(base, len, &layout) == 0;
+  if (!have_layout) {
+    /* cookied is yet to set it up, presumably the same way as we would */
+    layout = native;
+  }
+  if (layout.incompat_features & ~IPCOOKIE_INCOMPAT_FEATURES_KNOWN) {
+    fprintf(stderr, "ipcookies: the shared memory has the features 0x%llx unknown to this build\n",
+            (unsigned long long)(layout.incompat_features & ~IPCOOKIE_INCOMPAT_FEATURES_KNOWN));
+    return -1;
+  }
+  memset(view, 0, sizeof(*view));
+  view->segment = base;
+  for (i = 0; i < IPCOOKIE_SECTION_COUNT; i++) {
+    ipcookie_segment_section_t *s = &layout.sections[i];
+    if (native.sections[i].offset && s->offset &&
+        s->version == native.sections[i].version && s->size == native.sections[i].size &&
+        s->offset + s->size <= len) {
+      *sections[i] = (uint8_t *)base + s->offset;
+    } else if (!(IPCOOKIE_SECTIONS_OPTIONAL & (1 << i))) {
+      fprintf(stderr, "ipcookies: the %s section of the shared memory is not usable by this build\n",
+              names[i]);
+      return -1;
+    }
+  }
+  view->fd = -1;
+  view->cmds_section = view->cmds;
+  if (!have_layout || view->segment->version >= 2) {
+    /* the live table; if the segment is not set up yet, it will be where ours is */
+    view->layout = (void *)((uint8_t *)base + (have_layout ? view->segment->layout_offset :
+                                               offsetof(ipcookie_full_state_t, layout)));
+    view->generation = layout.generation;
+  }
+  if (ipcookies_view_set_features(view, layout.incompat_features, layout.compat_features) == -1) {
+    fprintf(stderr, "ipcookies: the single writer mode needs the cmds section of the shared memory\n");
+    return -1;
+  }
+  return 0;
+}
+
+int ipcookies_segment_is_initialized(ipcookie_view_t *view) {
+  return view->segment->magic == IPCOOKIE_SEGMENT_MAGIC &&
+         __atomic_load_n(&view->segment->initialized, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * In the single writer mode, make the cache read-only for us: the
+ * (huge) pages wholly within it, the rest of them are shared with
+ * the sections we do write. And writable again, out of it.
+ */
+static void ipcookies_protect_cache(int fd, ipcookie_view_t *view, int prot) {
+  uint32_t page_mode;
+  uint64_t page_size;
+  uintptr_t from, to;
+
+  ipcookies_shm_backing(fd, &page_mode, &page_size);
+  from = ((uintptr_t)view->cache + page_size - 1) & ~(uintptr_t)(page_size - 1);
+  to = ((uintptr_t)view->cache + sizeof(*view->cache)) & ~(uintptr_t)(page_size - 1);
+  if (to > from && mprotect((void *)from, to - from, prot) == -1) {
+    perror("ipcookies: mprotect of the cache");
+  }
+}
+
+void ipcookies_view_refresh(ipcookie_view_t *view) {
+  uint64_t incompat_features, compat_features;
+  uint32_t generation;
+
+  if (!view->layout) {
+    return;
+  }
+  generation = __atomic_load_n(&view->layout->generation, __ATOMIC_ACQUIRE);
+  if (generation == __atomic_load_n(&view->generation, __ATOMIC_RELAXED)) {
+    return;
+  }
+  incompat_features = __atomic_load_n(&view->layout->incompat_features, __ATOMIC_RELAXED);
+  compat_features = __atomic_load_n(&view->layout->compat_features, __ATOMIC_RELAXED);
+  if ((incompat_features & ~IPCOOKIE_INCOMPAT_FEATURES_KNOWN) ||
+      ((incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) && !view->cmds_section)) {
+    fprintf(stderr, "ipcookies: cookied has restarted with the features 0x%llx this build can not follow, "
+                    "carrying on as before\n", (unsigned long long)incompat_features);
+  } else {
+    if ((view->incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) &&
+        !(incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) && view->fd != -1) {
+      /* writable before any thread sees the mode in which it writes */
+      ipcookies_protect_cache(view->fd, view, PROT_READ | PROT_WRITE);
+    }
+    /*
+     * Not made read-only on the way into the single writer mode: the
+     * other threads may be past their check of the mode, about to write
+     */
+    ipcookies_view_set_features(view, incompat_features, compat_features);
+  }
+  __atomic_store_n(&view->generation, generation, __ATOMIC_RELEASE);
+}
+
+ipcookie_view_t *mmap_ipcookies(void) {
+  int fd = open_ipcookies_shm(NULL);
+  ipcookie_view_t *view = NULL;
+  void *base = NULL;
+  size_t len = 0;
+  int res;
+
+  if (fd == -1) {
+    perror("ipcookies: shared memory");
+    return NULL;
+  }
+  /*
+   * Shared, for as long as we are attached: cookied does not change the
+   * layout under it, and holds it exclusive while it sets the segment up
+   */
+  do {
+    res = flock(fd, LOCK_SH);
+  } while (res == -1 && errno == EINTR);
+  if (res == -1) {
+    perror("ipcookies: shared memory lock");
+  } else if (!(base = ipcookies_map_fd(fd, &len))) {
+    perror("ipcookies: shared memory mmap");
+  } else if (!(view = malloc(sizeof(*view))) || ipcookies_view_init(view, base, len) == -1) {
+    fprintf(stderr, "ipcookies: can not use the shared memory, is cookied of a compatible version?\n");
+    free(view);
+    view = NULL;
+  }
+  if (!view) {
+    if (base) {
+      munmap(base, len);
+    }
+    close(fd);
+    return NULL;
+  }
+  if (view->incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) {
+    ipcookies_protect_cache(fd, view, PROT_READ);
+  }
+  /* the lock goes with the descriptor, which stays open */
+  view->fd = fd;
+  return view;
+}
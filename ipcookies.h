@@ -40,8 +40,11 @@ and also to allow the verification of the control messages.
 
 ********************************************************************/
 
+/*
+ * The peer address the entry is for is kept by the cache apart from
+ * the entry (see ipcookies_cache.h), so the entry is 16 bytes.
+ */
 typedef struct ipcookie_entry {
-  struct in6_addr peer;    /* Which peer this is for */
   uint16_t mtime_lo16;     /* Low bits of timestamp when this entry was
                               last modified (aka when we saw the previous SET-COOKIE) */
   uint8_t mtime_hi8;       /* high 8 bits of timestamp  */
@@ -65,12 +68,202 @@ void ipcookie_entry_clear_expecting_setcookie(ipcookie_entry_t *ce);
 int ipcookie_entry_isset_expecting_setcookie(ipcookie_entry_t *ce);
 
 #include "ipcookies_cache.h"
+#include "ipcookies_numa.h"
+
+/********************************************************************
+
+Finally, the operational counters, the event log, the heavy hitters,
+optionally the latency histograms, the command ring of the single
+writer mode, the per-prefix policy, and the budgets of the sources
+without a cookie are kept in the same shared memory:
+
+********************************************************************/
+
+#include "ipcookies_stats.h"
+#include "ipcookies_events.h"
+#include "ipcookies_cmds.h"
+#include "ipcookies_hh.h"
+#include "ipcookies_hist.h"
+#include "ipcookies_policy.h"
+#include "ipcookies_budget.h"
+
+/********************************************************************
+
+The shared memory starts with the header which tells whether it is
+in use and by which layout: a segment fresh from ftruncate() is all
+zeroes and has no magic, and is left as it is; one without the magic
+but not fresh (e.g. of something else) gets cleared. Either way, a fresh
+start of cookied only needs a new state and the O(1) reset of the
+cache, see ipcookies_segment_prepare().
+
+"initialized" is set once cookied has the state and the cache ready,
+and cleared while it is setting them up.
+
+The layout itself is described by the section table at layout_offset
+(at the end of ipcookie_full_state_t, so the sections stay where the
+version 1 layout, which had no table, had them). Each section has
+its offset, size and the version of its format; the readers (the
+shims, cookiectl) find their sections through the table via
+ipcookies_view_init(), and only need the sections they use to be of
+the format they know - so the layout can grow, and the sections can
+move or change, without restarting everyone in lockstep.
+
+cookied, when it starts with the shared memory of another layout,
+migrates it in place: the sections which are in the same place and
+of the same format in both are kept, the rest is cleared, and the
+table is rewritten. It only does so with no reader attached: the
+readers hold a shared flock() on the shared memory for as long as they
+are attached, and cookied, holding it exclusively while it sets the
+segment up, refuses to start on a layout that would change under the
+readers (see ipcookies_segment_lock()); they need to go first, or the
+cookied of the current layout has to be run. So a reader never sees
+its sections move. A reader which attaches to a layout it can not use
+gets no cookies, rather than misreading the memory, see
+mmap_ipcookies(). A reader that attaches before any cookied set the
+segment up takes it to be of its own layout.
+
+The feature bits: a reader must not attach if the segment has an
+incompatible feature it does not know about (e.g. the shims not
+allowed to write into the cache, see ipcookies_cmds.h), and may ignore the
+compatible ones (which only tell what is there, e.g. the histograms).
+A cookied restarting with the same layout may set the features
+differently (e.g. with or without -w), so the readers already attached
+re-read them on their slow path once the generation in the table has
+changed, see ipcookies_view_refresh().
+
+********************************************************************/
+
+#define IPCOOKIE_SEGMENT_MAGIC 0x49504b4f4f4b4945ULL   /* "IPKOOKIE" */
+#define IPCOOKIE_SEGMENT_VERSION 2
+
+typedef struct ipcookie_segment_hdr {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t initialized;
+  uint64_t size;           /* sizeof(ipcookie_full_state_t) */
+  uint64_t layout_offset;  /* of the ipcookie_segment_layout_t, zero in version 1 */
+} ipcookie_segment_hdr_t;
+
+typedef enum {
+  IPCOOKIE_SECTION_STATE,
+  IPCOOKIE_SECTION_CACHE,
+  IPCOOKIE_SECTION_STATS,
+  IPCOOKIE_SECTION_EVENTS,
+  IPCOOKIE_SECTION_HH,
+  IPCOOKIE_SECTION_HISTS,
+  IPCOOKIE_SECTION_NUMA,
+  IPCOOKIE_SECTION_CMDS,
+  IPCOOKIE_SECTION_POLICY,
+  IPCOOKIE_SECTION_BUDGET,
+  IPCOOKIE_SECTION_COUNT
+} ipcookie_section_id_t;
+
+#define IPCOOKIE_SECTION_NAMES { "state", "cache", "stats", "events", "hh", "hists", "numa", "cmds", "policy", "budget" }
+
+/* The format versions of the sections in this build, bump on any change */
+#define IPCOOKIE_SECTION_VERSIONS { 1, IPCOOKIE_CACHE_SECTION_VERSION, 3, 1, 1, 2, 1, 2, 1, 2 }
+
+/* The sections a reader can do without */
+#define IPCOOKIE_SECTIONS_OPTIONAL ((1 << IPCOOKIE_SECTION_HISTS) | (1 << IPCOOKIE_SECTION_NUMA) | \
+                                    (1 << IPCOOKIE_SECTION_CMDS) | (1 << IPCOOKIE_SECTION_POLICY) | \
+                                    (1 << IPCOOKIE_SECTION_BUDGET))
+#define IPCOOKIE_SECTIONS_ALL ((1 << IPCOOKIE_SECTION_COUNT) - 1)
+
+/* The room in the table, for the sections of the future layouts */
+#define IPCOOKIE_SECTION_MAX 16
+
+#define IPCOOKIE_FEATURE_HISTOGRAMS (1ULL << 0)      /* compatible: the hists section is there */
+#define IPCOOKIE_FEATURE_NUMA (1ULL << 1)            /* compatible: the numa section is there */
+#define IPCOOKIE_FEATURE_COLD_TIER (1ULL << 2)       /* compatible: cookied takes the evictions and the misses */
+#define IPCOOKIE_FEATURE_SINGLE_WRITER (1ULL << 0)   /* incompatible: the shims must not write the cache */
+
+/*
+ * The incompatible features this build knows about, and those it
+ * always sets (cookied -w adds IPCOOKIE_FEATURE_SINGLE_WRITER, and
+ * cookied -c the compatible IPCOOKIE_FEATURE_COLD_TIER)
+ */
+#define IPCOOKIE_INCOMPAT_FEATURES_KNOWN IPCOOKIE_FEATURE_SINGLE_WRITER
+#define IPCOOKIE_INCOMPAT_FEATURES 0ULL
+
+#ifdef IPCOOKIES_HISTOGRAMS
+#define IPCOOKIE_COMPAT_FEATURES (IPCOOKIE_FEATURE_HISTOGRAMS | IPCOOKIE_FEATURE_NUMA)
+#else
+#define IPCOOKIE_COMPAT_FEATURES IPCOOKIE_FEATURE_NUMA
+#endif
+
+typedef struct ipcookie_segment_section {
+  uint64_t offset;     /* from the start of the segment, zero if the section is absent */
+  uint64_t size;
+  uint32_t version;
+  uint32_t padding;
+} ipcookie_segment_section_t;
+
+typedef struct ipcookie_segment_layout {
+  uint64_t incompat_features;
+  uint64_t compat_features;
+  uint32_t section_count;
+  uint32_t generation;   /* bumped by every cookied once it has set the features */
+  ipcookie_segment_section_t sections[IPCOOKIE_SECTION_MAX];
+} ipcookie_segment_layout_t;
 
 typedef struct ipcookie_full_state {
+  ipcookie_segment_hdr_t segment;
   ipcookie_state_t state;
   ipcookie_cache_t cache;
+  ipcookie_stats_t stats;
+  ipcookie_events_t events;
+  ipcookie_hh_t hh;
+#ifdef IPCOOKIES_HISTOGRAMS
+  ipcookie_hists_t hists;
+#endif
+  ipcookie_numa_t numa;
+  ipcookie_cmds_t cmds;
+  ipcookie_policy_t policy;
+  ipcookie_budget_t budget;
+  /* last, so the sections above stay where version 1 had them */
+  ipcookie_segment_layout_t layout;
 } ipcookie_full_state_t;
 
+/*
+ * What the readers use: the sections of the shared memory as found
+ * through its section table. This is what mmap_ipcookies() returns,
+ * and what the shim functions take as "ipck". hists is NULL if
+ * the segment has none or this build does not use them. cmds is NULL
+ * unless cookied takes the commands of the shims (ipcookies_cmds.h),
+ * for the single writer mode - in which mmap_ipcookies() maps the
+ * cache read-only - or for the cold tier. policy is NULL if the segment has
+ * none, which is the same as the empty one, and budget likewise, which
+ * admits nothing. The features are those
+ * of the segment's section table.
+ */
+typedef struct ipcookie_view {
+  ipcookie_segment_hdr_t *segment;
+  ipcookie_state_t *state;
+  ipcookie_cache_t *cache;
+  ipcookie_stats_t *stats;
+  ipcookie_events_t *events;
+  ipcookie_hh_t *hh;
+#ifdef IPCOOKIES_HISTOGRAMS
+  ipcookie_hists_t *hists;
+#else
+  void *hists;
+#endif
+  ipcookie_numa_t *numa;
+  ipcookie_cmds_t *cmds;
+  ipcookie_policy_t *policy;
+  ipcookie_budget_t *budget;
+  uint64_t incompat_features;
+  uint64_t compat_features;
+  /* the live table and its generation when the features were read; NULL for version 1 */
+  ipcookie_segment_layout_t *layout;
+  uint32_t generation;
+  ipcookie_cmds_t *cmds_section;   /* cmds, whether in use or not */
+  int fd;                          /* kept open by mmap_ipcookies(), -1 otherwise */
+} ipcookie_view_t;
+
+/* The state to use: the replica on this thread's NUMA node, if there is one */
+ipcookie_state_t *ipcookies_view_state(ipcookie_view_t *view);
+
 
 
 /********************************************************************
@@ -190,6 +383,14 @@ typedef enum {
 } ipcookie_ts_check_t;
 
 ipcookie_ts_check_t check_ipcookie_entry_timestamp(ipcookie_entry_t *ce);
+/*
+ * The first second in which the entry is no longer IPCOOKIE_TS_STILL_VALID,
+ * IPCOOKIE_TIME_INFINITE for the infinite lifetime
+ */
+#define IPCOOKIE_TIME_INFINITE ((time_t)(~0ULL >> (65 - 8 * sizeof(time_t))))
+time_t ipcookie_entry_valid_until(ipcookie_entry_t *ce, time_t now);
+/* Expand the 24-bit mtime into the full one, taking it to be no later than now */
+time_t expand_timestamp(time_t now, uint8_t hi8, uint16_t lo16);
 
 /********************************************************************
 
@@ -306,6 +507,15 @@ Requested Cookie: Valid for SET-COOKIE, this is the value the sender
 
 ********************************************************************/
 
+/********************************************************************
+
+The cookie is carried to the peer within the Destination Options
+header, the format of the option is described in the below header:
+
+********************************************************************/
+
+#include "ipcookies_option.h"
+
 typedef struct icmp6_ipcookies {
   ipcookie_t echoed_cookie;
   ipcookie_t requested_cookie;
@@ -326,7 +536,89 @@ typedef struct icmp6_ipcookies {
 
 
 
-ipcookie_full_state_t *mmap_ipcookies(void);
+/*
+ * For the readers: map the shared memory and attach to it, see
+ * ipcookie_view_t. Returns NULL (and says why on stderr) if it can
+ * not, e.g. the layout is not one this build can use; the shim
+ * functions take the NULL as no cookies at all.
+ */
+ipcookie_view_t *mmap_ipcookies(void);
+/*
+ * For cookied, which keeps the descriptor and uses the layout of its own
+ * build; *ret_fresh (if not NULL) tells whether the shared memory was
+ * empty, e.g. just created, and so is all zeroes. Both return -1 / NULL
+ * with errno set on failure.
+ */
+int open_ipcookies_shm(int *ret_fresh);
+ipcookie_full_state_t *mmap_ipcookies_fd(int fd, size_t *ret_len);
+
+/*
+ * For cookied: lock the segment exclusively, which keeps the readers
+ * from attaching until the unlock. Returns -1 (EWOULDBLOCK) if there
+ * are readers attached, which then must not see the layout change.
+ */
+int ipcookies_segment_lock(int fd);
+void ipcookies_segment_unlock(int fd);
+
+/*
+ * The mask of the sections of the segment mapped at base which are not
+ * laid out as this build has them, i.e. which ipcookies_segment_prepare()
+ * would have to clear; zero if the segment has no layout yet.
+ */
+uint32_t ipcookies_segment_changes(void *base, size_t len);
+
+/*
+ * Make the segment mapped at ipck, len bytes long (at least our
+ * sizeof(ipcookie_full_state_t)), usable by this build, migrating it
+ * from whatever layout it has, and clear "initialized". Returns the mask of
+ * the sections (1 << ipcookie_section_id_t) it had to clear,
+ * IPCOOKIE_SECTIONS_ALL if the segment was new; the caller resets
+ * the state and the cache regardless, unless it took them over live.
+ * A fresh segment (see open_ipcookies_shm()) is all zeroes already,
+ * so it is not cleared again, and its pages are not touched.
+ */
+uint32_t ipcookies_segment_prepare(ipcookie_full_state_t *ipck, size_t len, int fresh);
+void ipcookies_segment_set_initialized(ipcookie_full_state_t *ipck);
+
+/*
+ * Fill in the view of the segment mapped at base, len bytes long.
+ * Returns -1 (and says why on stderr) if this build can not use it.
+ * A segment nobody has set up yet is taken to be of our layout.
+ */
+int ipcookies_view_init(ipcookie_view_t *view, void *base, size_t len);
+
+/*
+ * Follow the features of a restarted cookied: if the generation of the
+ * table has changed, take on its features (switching the single writer
+ * mode and the cold tier on or off) - unless they are ones this build
+ * can not follow, then it stays as it is and says so on stderr. Meant
+ * for the slow path, it is a load of the generation otherwise.
+ */
+void ipcookies_view_refresh(ipcookie_view_t *view);
+int ipcookies_segment_is_initialized(ipcookie_view_t *view);
+
+/*
+ * The environment variable IPCOOKIES_HUGEPAGES selects the backing of
+ * the shared memory, and needs to be the same for all its users:
+ *
+ *   unset or empty      - the usual 4K pages of /dev/shm
+ *   "thp"               - the huge page aligned mapping of /dev/shm,
+ *                         with MADV_HUGEPAGE; only effective if the
+ *                         kernel allows THP for shmem (see
+ *                         /sys/kernel/mm/transparent_hugepage/shmem_enabled)
+ *   "/path/to/hugetlbfs" - the "ipcookies" file on that hugetlbfs
+ *                         mount; falls back to /dev/shm if there
+ *                         are not enough huge pages
+ *
+ * The mode and the page size actually in effect are returned
+ * by ipcookies_shm_backing() for the given descriptor.
+ */
+#define IPCOOKIES_HUGEPAGES_ENV "IPCOOKIES_HUGEPAGES"
+
+void ipcookies_shm_backing(int fd, uint32_t *ret_page_mode, uint64_t *ret_page_size);
+
+/* mmap() at the address aligned to align (a power of two) */
+void *ipcookies_mmap_aligned(size_t len, size_t align, int prot, int flags, int fd);
 void die_perror(char *msg);
 
 void ipcookies_icmp_send(uint8_t code, ipcookie_t *echoed_cookie,
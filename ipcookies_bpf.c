@@ -0,0 +1,129 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+#include "ipcookies_bpf.h"
+
+#ifdef __linux__
+
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+static int ipcookies_bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int ipcookies_bpf_obj_get(const char *path) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.pathname = (uint64_t)(unsigned long)path;
+  return ipcookies_bpf(BPF_OBJ_GET, &attr);
+}
+
+int ipcookies_bpf_map_lookup(int map_fd, const void *key, void *value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)key;
+  attr.value = (uint64_t)(unsigned long)value;
+  return ipcookies_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+int ipcookies_bpf_map_update(int map_fd, const void *key, const void *value, uint64_t flags) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)key;
+  attr.value = (uint64_t)(unsigned long)value;
+  attr.flags = flags;
+  return ipcookies_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int ipcookies_bpf_map_delete(int map_fd, const void *key) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)key;
+  return ipcookies_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+#else
+
+/* No BPF outside Linux, the callers just see the failure. */
+
+#define BPF_EXIST 2
+
+int ipcookies_bpf_obj_get(const char *path) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int ipcookies_bpf_map_lookup(int map_fd, const void *key, void *value) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int ipcookies_bpf_map_update(int map_fd, const void *key, const void *value, uint64_t flags) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int ipcookies_bpf_map_delete(int map_fd, const void *key) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+int ipcookies_bpf_state_sync(int map_fd, ipcookie_state_t *state, uint32_t xdp_fail_action,
+                             uint32_t tc_default_use_ipcookies) {
+  ipcookie_bpf_state_t bpf_state;
+  uint32_t key = 0;
+  struct timespec rt, mono;
+
+  memset(&bpf_state, 0, sizeof(bpf_state));
+  bpf_state.state = *state;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  bpf_state.realtime_offset_ns = (rt.tv_sec - mono.tv_sec) * 1000000000LL +
+                                 (rt.tv_nsec - mono.tv_nsec);
+  bpf_state.xdp_fail_action = xdp_fail_action;
+  bpf_state.tc_default_use_ipcookies = tc_default_use_ipcookies;
+  return ipcookies_bpf_map_update(map_fd, &key, &bpf_state, 0);
+}
+
+int ipcookies_bpf_peer_set_cookie(int map_fd, struct in6_addr *peer, ipcookie_t *echoed_cookie,
+                                  ipcookie_t *requested_cookie, uint8_t lifetime_log2) {
+  ipcookie_bpf_peer_t bp;
+  time_t now = time(NULL);
+
+  if (ipcookies_bpf_map_lookup(map_fd, peer, &bp) == -1) {
+    return 0;
+  }
+  if (!memcmp(bp.ipcookie, echoed_cookie, sizeof(bp.ipcookie))) {
+    memcpy(bp.ipcookie, requested_cookie, sizeof(bp.ipcookie));
+    bp.mtime_lo16 = 0xffff & now;
+    bp.mtime_hi8 = 0xff & (now >> 16);
+    bp.flags_and_lifetime_log2 &= ~(IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2 |
+                                    IPCOOKIE_BPF_PEER_FLAG_EXPECTING_SETCOOKIE);
+    bp.flags_and_lifetime_log2 |= lifetime_log2 & IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2;
+    /* BPF_EXIST: if the LRU has evicted it meanwhile, so be it */
+    ipcookies_bpf_map_update(map_fd, peer, &bp, BPF_EXIST);
+  }
+  return 1;
+}
@@ -0,0 +1,114 @@
+#ifndef IPCOOKIES_BPF_H
+#define IPCOOKIES_BPF_H
+
+/********************************************************************
+
+The in-kernel (BPF) part of the cookie processing.
+
+The BPF programs can not look into the /ipcookies shared memory,
+so cookied mirrors the pieces they need into the BPF maps, pinned
+in the BPF filesystem by the loader:
+
+IPCOOKIES_BPF_STATE_MAP_PATH:
+           a single-element array holding ipcookie_bpf_state_t,
+           that is the stateless ipcookie_state_t plus whatever
+           the BPF side needs to compute the same epochs as
+           ipcookie_verify_stateless().
+
+The BPF programs have no access to the wall clock, only to the
+monotonic one, so cookied also maintains the offset between the two
+(realtime_offset_ns) and refreshes it periodically.
+
+IPCOOKIES_BPF_PEER_MAP_PATH:
+           an LRU hash keyed by the peer address, holding the
+           ipcookie_bpf_peer_t - the in-kernel equivalent of the
+           ipcookie_cache_t, used by the tc egress program
+           (tc_ipcookies.c) to insert the cookies. cookied updates
+           it from the received SET-COOKIE messages.
+
+********************************************************************/
+
+#define IPCOOKIES_BPF_STATE_MAP_PATH "/sys/fs/bpf/ipcookies_state_map"
+#define IPCOOKIES_BPF_PEER_MAP_PATH "/sys/fs/bpf/ipcookies_peer_map"
+#define IPCOOKIES_BPF_PEER_MAP_SIZE 65536
+
+/*
+ * What the XDP program does with the packets carrying a cookie
+ * which fails the verification against both CURRENT and PREVIOUS:
+ *
+ * IPCOOKIE_XDP_FAIL_PASS: hand it to the stack, so the shim in the
+ *                         application sends the SET-COOKIE.
+ * IPCOOKIE_XDP_FAIL_DROP: drop it on the floor.
+ * IPCOOKIE_XDP_FAIL_REDIRECT: redirect it into the XSK map, for
+ *                         a dedicated SET-COOKIE generator.
+ */
+
+typedef enum {
+  IPCOOKIE_XDP_FAIL_PASS = 0,
+  IPCOOKIE_XDP_FAIL_DROP,
+  IPCOOKIE_XDP_FAIL_REDIRECT
+} ipcookie_xdp_fail_action_t;
+
+typedef struct ipcookie_bpf_state {
+  ipcookie_state_t state;
+  uint8_t padding[4];
+  int64_t realtime_offset_ns;  /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+  uint32_t xdp_fail_action;    /* ipcookie_xdp_fail_action_t */
+  uint32_t tc_default_use_ipcookies; /* default_use_ipcookies for the new peers */
+} ipcookie_bpf_state_t;
+
+/*
+ * The value in the peer map: this is the ipcookie_entry_t
+ * without the peer address, which is the key. The flags are
+ * the same bits as the IPCOOKIE_ENTRY_FLAG_* in ipcookies.c.
+ */
+
+typedef struct ipcookie_bpf_peer {
+  uint16_t mtime_lo16;
+  uint8_t mtime_hi8;
+  uint8_t flags_and_lifetime_log2;
+  ipcookie_t ipcookie;
+} ipcookie_bpf_peer_t;
+
+#define IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2       0x0F
+#define IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES     0x10
+#define IPCOOKIE_BPF_PEER_FLAG_EXPECTING_SETCOOKIE 0x20
+
+#ifndef __bpf__
+
+/*
+ * Thin wrappers around the bpf(2) syscall, so we do not need libbpf
+ * in the userspace. All return -1 and set errno on failure.
+ */
+
+int ipcookies_bpf_obj_get(const char *path);
+int ipcookies_bpf_map_lookup(int map_fd, const void *key, void *value);
+int ipcookies_bpf_map_update(int map_fd, const void *key, const void *value, uint64_t flags);
+int ipcookies_bpf_map_delete(int map_fd, const void *key);
+
+/*
+ * Push the current stateless state into the pinned state map.
+ */
+
+int ipcookies_bpf_state_sync(int map_fd, ipcookie_state_t *state, uint32_t xdp_fail_action,
+                             uint32_t tc_default_use_ipcookies);
+
+/*
+ * The equivalent of process_icmp_set_cookie() for the peer map:
+ * if the peer is there and the echoed cookie matches, update
+ * the cookie, the mtime and the lifetime. Returns 1 if the
+ * entry existed (regardless of the match), 0 if it did not.
+ */
+
+int ipcookies_bpf_peer_set_cookie(int map_fd, struct in6_addr *peer, ipcookie_t *echoed_cookie,
+                                  ipcookie_t *requested_cookie, uint8_t lifetime_log2);
+
+#else
+
+static __always_inline int64_t ipcookies_bpf_now(ipcookie_bpf_state_t *bst) {
+  return (bpf_ktime_get_ns() + bst->realtime_offset_ns) / 1000000000ULL;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,211 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+#include "ipcookies_prf.h"
+
+/* The timestamp the hash seed is derived with, never the one of a cookie */
+#define IPCOOKIE_BUDGET_SEED_TIMESTAMP 0xFFFFFFFFFFFFFFFEULL
+
+static void ipcookie_budget_rate_set(ipcookie_budget_rate_t *rate, uint32_t pps, uint32_t burst) {
+  rate->interval_ns = pps ? 1000000000ULL / pps : 0;
+  /* the TAT may run ahead by the whole burst but the packet at hand */
+  rate->tolerance_ns = rate->interval_ns * (burst > 1 ? burst - 1 : 0);
+}
+
+void ipcookie_budget_set_limits(ipcookie_budget_t *budget,
+                                uint32_t prefix_pps, uint32_t prefix_burst,
+                                uint32_t global_pps, uint32_t global_burst,
+                                uint32_t amp_factor, uint32_t amp_cap) {
+  ipcookie_budget_rate_set(&budget->prefix_rate, prefix_pps, prefix_burst);
+  ipcookie_budget_rate_set(&budget->global_rate, global_pps, global_burst);
+  budget->amp_factor = amp_factor;
+  budget->amp_cap = amp_cap;
+}
+
+void ipcookie_budget_init(ipcookie_budget_t *budget, ipcookie_state_t *state,
+                          uint32_t prefix_pps, uint32_t prefix_burst,
+                          uint32_t global_pps, uint32_t global_burst,
+                          uint32_t amp_factor, uint32_t amp_cap) {
+  uint8_t zero_peer[16] = { 0 };
+  uint8_t seed[12];
+
+  ipcookie_prf(state->ipcookie_secret, zero_peer, IPCOOKIE_BUDGET_SEED_TIMESTAMP, seed);
+  memset(budget->hash_seed, 0, sizeof(budget->hash_seed));
+  memcpy(budget->hash_seed, seed, sizeof(seed));
+  ipcookie_budget_set_limits(budget, prefix_pps, prefix_burst, global_pps, global_burst, amp_factor, amp_cap);
+  budget->global_tat = 0;
+  memset(budget->slots, 0, sizeof(budget->slots));
+}
+
+static uint64_t ipcookie_budget_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t ipcookie_budget_mix(uint64_t x) {
+  /* the splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/* The set the prefix of src belongs to */
+static ipcookie_budget_slot_t *ipcookie_budget_set(ipcookie_budget_t *budget, struct in6_addr *src,
+                                                   uint64_t *ret_prefix) {
+  uint64_t h;
+
+  memcpy(ret_prefix, src->s6_addr, sizeof(*ret_prefix));
+  h = ipcookie_budget_mix(ipcookie_budget_mix(*ret_prefix ^ budget->hash_seed[0]) ^ budget->hash_seed[1]);
+  return budget->slots[h % IPCOOKIE_BUDGET_SETS];
+}
+
+/* The slot the prefix has in its set, if any */
+static ipcookie_budget_slot_t *ipcookie_budget_find(ipcookie_budget_slot_t *set, uint64_t prefix) {
+  int w;
+
+  for (w = 0; w < IPCOOKIE_BUDGET_WAYS; w++) {
+    if (__atomic_load_n(&set[w].prefix, __ATOMIC_RELAXED) == prefix) {
+      return &set[w];
+    }
+  }
+  return NULL;
+}
+
+/* The slot the prefix has, or takes */
+static ipcookie_budget_slot_t *ipcookie_budget_slot(ipcookie_budget_t *budget, struct in6_addr *src) {
+  uint64_t prefix;
+  ipcookie_budget_slot_t *set = ipcookie_budget_set(budget, src, &prefix);
+  ipcookie_budget_slot_t *victim = ipcookie_budget_find(set, prefix);
+  uint64_t victim_tat = ~0ULL;
+  uint64_t old_prefix, tat;
+  int w;
+
+  if (victim) {
+    return victim;
+  }
+  victim = &set[0];
+  for (w = 0; w < IPCOOKIE_BUDGET_WAYS; w++) {
+    tat = __atomic_load_n(&set[w].tat, __ATOMIC_RELAXED);
+    if (tat < victim_tat) {
+      victim = &set[w];
+      victim_tat = tat;
+    }
+  }
+  old_prefix = __atomic_load_n(&victim->prefix, __ATOMIC_RELAXED);
+  if (__atomic_compare_exchange_n(&victim->prefix, &old_prefix, prefix, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&victim->tat, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->credit, 0, __ATOMIC_RELAXED);
+  }
+  return victim;
+}
+
+/* Take the packets' worth from the bucket, if it has it all */
+static int ipcookie_budget_take(uint64_t *tat_p, ipcookie_budget_rate_t *rate, uint64_t now, uint32_t packets) {
+  uint64_t tat = __atomic_load_n(tat_p, __ATOMIC_RELAXED);
+  uint64_t new_tat;
+
+  do {
+    /* as if they came one by one: the last one has to fit */
+    if (tat + rate->interval_ns * (packets - 1) > now + rate->tolerance_ns) {
+      return 0;
+    }
+    new_tat = (tat > now ? tat : now) + rate->interval_ns * packets;
+  } while (!__atomic_compare_exchange_n(tat_p, &tat, new_tat, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+int ipcookie_budget_admit(ipcookie_budget_t *budget, struct in6_addr *src, uint32_t packets) {
+  uint64_t *tat_p;
+  uint64_t now;
+
+  if (!budget || !budget->prefix_rate.interval_ns || !budget->global_rate.interval_ns || !packets) {
+    return 0;
+  }
+  now = ipcookie_budget_now();
+  /* the overall one is only touched by the packets within the budget of their prefix... */
+  tat_p = &ipcookie_budget_slot(budget, src)->tat;
+  if (!ipcookie_budget_take(tat_p, &budget->prefix_rate, now, packets)) {
+    return 0;
+  }
+  if (!ipcookie_budget_take(&budget->global_tat, &budget->global_rate, now, packets)) {
+    /* ...and the prefix does not pay for what the others have used up */
+    __atomic_fetch_sub(tat_p, budget->prefix_rate.interval_ns * packets, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+/* What of the response fits in avail bytes, and how many of them it takes */
+static ipcookie_amp_verdict_t ipcookie_budget_fit(uint64_t avail, size_t response_bytes, size_t min_bytes,
+                                                  uint64_t *ret_spent) {
+  if (response_bytes <= avail) {
+    *ret_spent = response_bytes;
+    return IPCOOKIE_AMP_OK;
+  }
+  if (avail > 0 && avail >= min_bytes) {
+    *ret_spent = avail;
+    return IPCOOKIE_AMP_TRUNCATE;
+  }
+  *ret_spent = 0;
+  return IPCOOKIE_AMP_REFUSE;
+}
+
+ipcookie_amp_verdict_t ipcookie_budget_respond(ipcookie_budget_t *budget, struct in6_addr *src,
+                                               size_t received_bytes, size_t response_bytes,
+                                               size_t min_bytes, size_t *ret_allowed) {
+  ipcookie_amp_verdict_t verdict;
+  ipcookie_budget_slot_t *set, *slot;
+  uint64_t prefix;
+  uint64_t *credit_p, credit, earned, avail, spent;
+
+  if (!budget || !budget->amp_factor) {
+    *ret_allowed = response_bytes;
+    return IPCOOKIE_AMP_OK;
+  }
+  earned = received_bytes < budget->amp_cap ? (uint64_t)received_bytes * budget->amp_factor : budget->amp_cap;
+  if (earned > budget->amp_cap) {
+    earned = budget->amp_cap;
+  }
+  set = ipcookie_budget_set(budget, src, &prefix);
+  slot = ipcookie_budget_find(set, prefix);
+  if (!slot) {
+    /*
+     * The admission of the request has put its prefix in the table; one
+     * which is not there (any more) does not take the slot of another
+     * prefix, credit and TAT and all, but gets no more than the request
+     * itself has earned either.
+     */
+    verdict = ipcookie_budget_fit(earned, response_bytes, min_bytes, &spent);
+    *ret_allowed = spent;
+    return verdict;
+  }
+  credit_p = &slot->credit;
+  credit = __atomic_load_n(credit_p, __ATOMIC_RELAXED);
+  do {
+    avail = credit + earned < budget->amp_cap ? credit + earned : budget->amp_cap;
+    verdict = ipcookie_budget_fit(avail, response_bytes, min_bytes, &spent);
+  } while (!__atomic_compare_exchange_n(credit_p, &credit, avail - spent, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  *ret_allowed = spent;
+  return verdict;
+}
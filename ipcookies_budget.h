@@ -0,0 +1,133 @@
+/********************************************************************
+
+The budgets of the unverified sources: how many of the packets
+without a cookie get in.
+
+Such a packet may well come from a peer which does not do the cookies
+(yet), so refusing them all would cut those off; letting them all in
+would leave the door open to the spoofed floods. The shim thus admits
+a bounded rate of them per source /64, and an overall bounded rate,
+and answers the rest with a SET-COOKIE, as a wrong cookie.
+
+Each rate is a token bucket, kept as the generic cell rate algorithm
+does: as the single "theoretical arrival time" (TAT) in nanoseconds of
+CLOCK_MONOTONIC, which is the same for all the processes. A packet
+fits if the TAT is not further ahead of now than the burst allows,
+and moves the TAT by the interval between the packets of the rate;
+a TAT in the past is as good as a full bucket. Taking a token is thus
+a compare-and-swap of one word, with no locks, so all the shims
+share the same budgets.
+
+The /64 buckets are in a set-associative table, IPCOOKIE_BUDGET_WAYS
+per set, the set picked by a hash keyed from the secret. A prefix not
+in its set takes the slot of the one with the oldest TAT, and starts
+with the full bucket; that also means the flood from more prefixes
+than the table holds gets the burst of each - the overall bucket is
+what bounds it then. The two shims which take the same slot for the
+different prefixes at the same time share it for a moment.
+
+cookied sets the rates (-a and -A), zero for none admitted; the
+shared memory without this section admits none either. A cookied
+restarted on the live state only sets them anew: the table is keyed
+from the secret, so it only starts empty with a new secret (or a
+cleared section), and a restart does not hand every source its burst
+back.
+
+The packet rate is the wrong unit for the amplification though: what
+hurts is the small request with the big response. So each /64 also
+has the byte credit: the application tells, for each response to an
+unverified source, how big the request was and how big the response
+would be (ipcookies_shim_inbound_response()). The request adds the
+amplification factor times its size to the credit, up to the cap,
+and the response takes from it: if it fits, it goes out as it is;
+if at least min_bytes of it fit, it goes out truncated to what does
+(e.g. with the DNS TC bit, which makes the peer retry over TCP);
+otherwise it does not go out at all. The credit is one word, updated
+with a compare-and-swap like the TAT, and it goes with the slot: a
+prefix which lost its slot starts again with none. A response only
+looks its prefix up: the request got it the slot as it was admitted,
+and if another prefix has taken the slot since, the response does not
+evict anyone either, but only gets what its own request has earned
+(the factor times its size, up to the cap), with no credit kept.
+
+cookied sets the factor and the cap (-F), zero for no accounting, in
+which case, as without the section, every response is fine.
+
+********************************************************************/
+
+#define IPCOOKIE_BUDGET_SETS 16384
+#define IPCOOKIE_BUDGET_WAYS 4
+
+#define IPCOOKIE_BUDGET_DEFAULT_PREFIX_PPS 10
+#define IPCOOKIE_BUDGET_DEFAULT_PREFIX_BURST 20
+#define IPCOOKIE_BUDGET_DEFAULT_GLOBAL_PPS 10000
+#define IPCOOKIE_BUDGET_DEFAULT_GLOBAL_BURST 20000
+#define IPCOOKIE_BUDGET_DEFAULT_AMP_FACTOR 3
+#define IPCOOKIE_BUDGET_DEFAULT_AMP_CAP 65536
+
+/* What to do with the response, see ipcookies_shim_inbound_response() */
+typedef enum {
+  IPCOOKIE_AMP_OK = 0,
+  IPCOOKIE_AMP_TRUNCATE,
+  IPCOOKIE_AMP_REFUSE
+} ipcookie_amp_verdict_t;
+
+typedef struct ipcookie_budget_slot {
+  uint64_t prefix;       /* the upper half of the address, zero for a free slot */
+  uint64_t tat;
+  uint64_t credit;       /* the bytes it may still be sent */
+  uint64_t padding;
+} ipcookie_budget_slot_t;
+
+/* A rate, as the interval between the packets and how far the TAT may run ahead */
+typedef struct ipcookie_budget_rate {
+  uint64_t interval_ns;  /* zero if none admitted */
+  uint64_t tolerance_ns;
+} ipcookie_budget_rate_t;
+
+typedef struct ipcookie_budget {
+  uint64_t hash_seed[2];
+  ipcookie_budget_rate_t prefix_rate;
+  ipcookie_budget_rate_t global_rate;
+  uint32_t amp_factor;   /* zero if the responses are not accounted */
+  uint32_t amp_cap;
+  uint64_t global_tat __attribute__((aligned(64)));
+  ipcookie_budget_slot_t slots[IPCOOKIE_BUDGET_SETS][IPCOOKIE_BUDGET_WAYS] __attribute__((aligned(64)));
+} ipcookie_budget_t;
+
+/*
+ * cookied: set the rates (in the packets per second, and the packets
+ * in a burst) and the amplification factor and cap, key the hash from
+ * the state's secret, and start with the full buckets and no credit.
+ */
+void ipcookie_budget_init(ipcookie_budget_t *budget, ipcookie_state_t *state,
+                          uint32_t prefix_pps, uint32_t prefix_burst,
+                          uint32_t global_pps, uint32_t global_burst,
+                          uint32_t amp_factor, uint32_t amp_cap);
+
+/*
+ * cookied, restarted on the live state: only set the rates and the
+ * amplification settings, keeping the key, the buckets and the credits.
+ */
+void ipcookie_budget_set_limits(ipcookie_budget_t *budget,
+                                uint32_t prefix_pps, uint32_t prefix_burst,
+                                uint32_t global_pps, uint32_t global_burst,
+                                uint32_t amp_factor, uint32_t amp_cap);
+
+/*
+ * Returns 1 if the packets from src without a cookie fit in the budgets
+ * (and takes from them), 0 if not (and takes from neither). A GRO
+ * buffer takes as many as it has segments, all or none, so one larger
+ * than the burst never fits.
+ */
+int ipcookie_budget_admit(ipcookie_budget_t *budget, struct in6_addr *src, uint32_t packets);
+
+/*
+ * Credit the request of received_bytes from src, and take the response
+ * from the credit; ret_allowed gets how much of it may go out. A src
+ * whose prefix has no slot (any more) gets at most what the request
+ * itself earns.
+ */
+ipcookie_amp_verdict_t ipcookie_budget_respond(ipcookie_budget_t *budget, struct in6_addr *src,
+                                               size_t received_bytes, size_t response_bytes,
+                                               size_t min_bytes, size_t *ret_allowed);
@@ -17,30 +17,207 @@
 #include <fcntl.h>
 
 #include "ipcookies.h"
+#include "ipcookies_prf.h"
 
-/*
- * Very naive linear algorithms here, just for experimentation.
- */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The PRF input which derives the hash seed from the secret: no real peer uses it */
+#define IPCOOKIE_CACHE_SEED_TIMESTAMP 0xFFFFFFFFFFFFFFFFULL
+
+void ipcookie_cache_init(ipcookie_cache_t *ipck, ipcookie_state_t *state) {
+  uint8_t zero_peer[16] = { 0 };
+  uint8_t seed[12];
+  uint32_t gen = ipck->generation + 1;
+
+  ipcookie_prf(state->ipcookie_secret, zero_peer, IPCOOKIE_CACHE_SEED_TIMESTAMP, seed);
+  memset(ipck->hash_seed, 0, sizeof(ipck->hash_seed));
+  memcpy(ipck->hash_seed, seed, sizeof(seed));
+  if (gen == 0 || gen == IPCOOKIE_CACHE_GENERATION_CLEARING) {
+    gen = 1;
+  }
+  __atomic_store_n(&ipck->generation, gen, __ATOMIC_RELEASE);
+}
+
+static uint64_t ipcookie_cache_mix(uint64_t x) {
+  /* the splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t ipcookie_cache_hash(ipcookie_cache_t *ipck, struct in6_addr *peer) {
+  uint64_t hi, lo;
+  memcpy(&hi, peer->s6_addr, sizeof(hi));
+  memcpy(&lo, peer->s6_addr + 8, sizeof(lo));
+  return ipcookie_cache_mix(ipcookie_cache_mix(hi ^ ipck->hash_seed[0]) ^ lo ^ ipck->hash_seed[1]);
+}
+
+/* The bucket, and the fingerprint (never zero) of the hash within it */
+static uint32_t ipcookie_cache_bucket_index(uint64_t h, uint8_t *ret_fp) {
+  /* the top byte is independent of the bucket index taken from the bottom */
+  *ret_fp = (h >> 56) % 255 + 1;
+  return h % IPCOOKIE_CACHE_BUCKETS;
+}
+
+#ifdef IPCOOKIES_COMPACT_CACHE
+#define IPCOOKIE_CACHE_SLOT_IS(slot, peer, h) ((slot)->key == (h))
+#define IPCOOKIE_CACHE_SLOT_SET(slot, peer, h) ((slot)->key = (h))
+#else
+#define IPCOOKIE_CACHE_SLOT_IS(slot, peer, h) (!memcmp(&(slot)->peer, (peer), sizeof(*(peer))))
+#define IPCOOKIE_CACHE_SLOT_SET(slot, peer, h) ((slot)->peer = *(peer))
+#endif
+
+/* The bitmask of the slots of the bucket whose fingerprint is fp */
+static uint32_t ipcookie_cache_match(ipcookie_cache_tags_t *tags, uint8_t fp) {
+#ifdef __SSE2__
+  __m128i fps = _mm_load_si128((__m128i *)tags->fingerprints);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(fps, _mm_set1_epi8(fp)));
+#else
+  uint32_t mask = 0;
+  int i;
+  for (i = 0; i < IPCOOKIE_CACHE_BUCKET_SIZE; i++) {
+    mask |= (uint32_t)(tags->fingerprints[i] == fp) << i;
+  }
+  return mask;
+#endif
+}
+
+static int ipcookie_cache_bucket_valid(ipcookie_cache_t *ipck, uint32_t b) {
+  return __atomic_load_n(&ipck->tags[b].generation, __ATOMIC_ACQUIRE) ==
+         __atomic_load_n(&ipck->generation, __ATOMIC_RELAXED);
+}
+
+/* Make the bucket valid for the current generation, clearing it if it was stale */
+static void ipcookie_cache_bucket_validate(ipcookie_cache_t *ipck, uint32_t b) {
+  uint32_t gen = __atomic_load_n(&ipck->generation, __ATOMIC_RELAXED);
+  uint32_t bucket_gen;
+  uint32_t spins = 0;
+
+  while ((bucket_gen = __atomic_load_n(&ipck->tags[b].generation, __ATOMIC_ACQUIRE)) != gen) {
+    if (bucket_gen != IPCOOKIE_CACHE_GENERATION_CLEARING &&
+        __atomic_compare_exchange_n(&ipck->tags[b].generation, &bucket_gen,
+                                    IPCOOKIE_CACHE_GENERATION_CLEARING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      /* the free slots are told by the fingerprints alone */
+      memset(ipck->tags[b].fingerprints, 0, sizeof(ipck->tags[b].fingerprints));
+      __atomic_store_n(&ipck->tags[b].generation, gen, __ATOMIC_RELEASE);
+      return;
+    }
+    /* someone else is clearing it, which takes no time - unless they died doing so */
+    if (bucket_gen == IPCOOKIE_CACHE_GENERATION_CLEARING && ++spins >= IPCOOKIE_CACHE_CLEARING_SPINS) {
+      memset(ipck->tags[b].fingerprints, 0, sizeof(ipck->tags[b].fingerprints));
+      __atomic_compare_exchange_n(&ipck->tags[b].generation, &bucket_gen, gen, 0,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+      spins = 0;
+    }
+  }
+}
 
 ipcookie_entry_t *ipcookie_cache_entry_find_by_address(ipcookie_cache_t *ipck, struct in6_addr *peer) {
-  ipcookie_entry_t *ce;
-  ipcookie_entry_t *ce_end = ipck->entries + IPCOOKIE_CACHE_SIZE;
-  for(ce = ipck->entries; ce < ce_end; ce++) {
-    if(!memcmp(&ce->peer, peer, sizeof(*peer))) {
-      return ce;
+  uint64_t h = ipcookie_cache_hash(ipck, peer);
+  uint8_t fp;
+  uint32_t b = ipcookie_cache_bucket_index(h, &fp);
+  uint32_t base = b * IPCOOKIE_CACHE_BUCKET_SIZE;
+  uint32_t mask;
+
+  if (!ipcookie_cache_bucket_valid(ipck, b)) {
+    return NULL;
+  }
+  for (mask = ipcookie_cache_match(&ipck->tags[b], fp); mask; mask &= mask - 1) {
+    uint32_t i = base + __builtin_ctz(mask);
+    if (IPCOOKIE_CACHE_SLOT_IS(&ipck->slots[i], peer, h)) {
+      return &ipck->slots[i].entry;
     }
   }
   return NULL;
 }
 
-ipcookie_entry_t *ipcookie_cache_entry_allocate(ipcookie_cache_t *ipck, struct in6_addr *peer) {
-  ipcookie_entry_t *ce;
-  ipcookie_entry_t *ce_end = ipck->entries + IPCOOKIE_CACHE_SIZE;
-  for(ce = ipck->entries; ce < ce_end; ce++) {
-    if(IN6_IS_ADDR_UNSPECIFIED(&ce->peer)) {
-      return ce;
+/* The slot for the peer with the hash h */
+static ipcookie_cache_slot_t *ipcookie_cache_slot_allocate(ipcookie_cache_t *ipck, struct in6_addr *peer, uint64_t h,
+                                                           ipcookie_cache_slot_t *ret_evicted) {
+  uint8_t fp;
+  uint32_t b = ipcookie_cache_bucket_index(h, &fp);
+  uint32_t base = b * IPCOOKIE_CACHE_BUCKET_SIZE;
+  uint32_t free_slots;
+  uint32_t i, slot = 0;
+  time_t now = time(NULL);
+  time_t oldest_mtime = 0;
+
+  if (ret_evicted) {
+    memset(ret_evicted, 0, sizeof(*ret_evicted));
+  }
+  ipcookie_cache_bucket_validate(ipck, b);
+  free_slots = ipcookie_cache_match(&ipck->tags[b], 0);
+  if (free_slots) {
+    slot = __builtin_ctz(free_slots);
+  } else {
+    /* the bucket is full, the one not touched for the longest goes */
+    for (i = 0; i < IPCOOKIE_CACHE_BUCKET_SIZE; i++) {
+      ipcookie_entry_t *ce = &ipck->slots[base + i].entry;
+      time_t mtime = expand_timestamp(now, ce->mtime_hi8, ce->mtime_lo16);
+      if (i == 0 || mtime < oldest_mtime) {
+        slot = i;
+        oldest_mtime = mtime;
+      }
+    }
+    if (ret_evicted) {
+      *ret_evicted = ipck->slots[base + slot];
     }
+    /* nobody is to match the old peer against the new address */
+    __atomic_store_n(&ipck->tags[b].fingerprints[slot], 0, __ATOMIC_RELAXED);
   }
-  return NULL;
+  memset(&ipck->slots[base + slot].entry, 0, sizeof(ipck->slots[0].entry));
+  IPCOOKIE_CACHE_SLOT_SET(&ipck->slots[base + slot], peer, h);
+  __atomic_store_n(&ipck->tags[b].fingerprints[slot], fp, __ATOMIC_RELEASE);
+  return &ipck->slots[base + slot];
+}
+
+ipcookie_entry_t *ipcookie_cache_entry_allocate(ipcookie_cache_t *ipck, struct in6_addr *peer,
+                                                ipcookie_cache_slot_t *ret_evicted) {
+  return &ipcookie_cache_slot_allocate(ipck, peer, ipcookie_cache_hash(ipck, peer), ret_evicted)->entry;
+}
+
+ipcookie_entry_t *ipcookie_cache_slot_restore(ipcookie_cache_t *ipck, ipcookie_cache_slot_t *slot,
+                                              ipcookie_cache_slot_t *ret_evicted) {
+#ifdef IPCOOKIES_COMPACT_CACHE
+  ipcookie_cache_slot_t *s = ipcookie_cache_slot_allocate(ipck, NULL, slot->key, ret_evicted);
+#else
+  ipcookie_cache_slot_t *s = ipcookie_cache_slot_allocate(ipck, &slot->peer,
+                                                          ipcookie_cache_hash(ipck, &slot->peer), ret_evicted);
+#endif
+  s->entry = slot->entry;
+  return &s->entry;
 }
 
+int ipcookie_cache_entry_is_for(ipcookie_cache_t *ipck, ipcookie_entry_t *ce, struct in6_addr *peer) {
+#ifdef IPCOOKIES_COMPACT_CACHE
+  return ipcookie_cache_entry_slot(ipck, ce)->key == ipcookie_cache_hash(ipck, peer);
+#else
+  return !memcmp(&ipcookie_cache_entry_slot(ipck, ce)->peer, peer, sizeof(*peer));
+#endif
+}
+
+ipcookie_entry_t *ipcookie_cache_entry_next(ipcookie_cache_t *ipck, ipcookie_entry_t *ce) {
+  uint32_t i = 0;
+
+  if (ce) {
+    i = (ipcookie_cache_slot_t *)((uint8_t *)ce - __builtin_offsetof(ipcookie_cache_slot_t, entry)) - ipck->slots + 1;
+  }
+
+  for (; i < IPCOOKIE_CACHE_SIZE; i++) {
+    uint32_t b = i / IPCOOKIE_CACHE_BUCKET_SIZE;
+    if (!ipcookie_cache_bucket_valid(ipck, b)) {
+      i = (b + 1) * IPCOOKIE_CACHE_BUCKET_SIZE - 1;
+      continue;
+    }
+    if (ipck->tags[b].fingerprints[i % IPCOOKIE_CACHE_BUCKET_SIZE]) {
+      return &ipck->slots[i].entry;
+    }
+  }
+  return NULL;
+}
@@ -1,13 +1,135 @@
+/********************************************************************
+
+The cache is a hash table of IPCOOKIE_CACHE_BUCKETS buckets, each
+holding IPCOOKIE_CACHE_BUCKET_SIZE entries. The bucket of a peer is
+picked by a hash keyed with a seed derived from the secret, so the
+remote side can not aim at one bucket. A new peer landing in a full
+bucket evicts the entry which has not been touched the longest.
+
+The keys are kept apart from the rest: per bucket, the tags - one
+byte of the hash of each peer in it (the fingerprint, zero for a free
+slot) and the generation of the bucket - are packed into half of a
+cache line, and the slots with the full addresses and the entries are
+in a separate array. The lookup compares the fingerprint against the
+whole bucket at once (with SSE2 where there is one), and only looks
+at the addresses where the fingerprint matches, which for a peer not
+in the cache is one time in 16: a miss thus mostly costs the single
+cache line with the tags, and a hit that plus the line of its slot.
+The address stays next to its entry, as a hit needs both anyway.
+
+With IPCOOKIES_COMPACT_CACHE ("make COMPACT_CACHE=1"), the slots keep
+the 64-bit keyed hash of the address in place of the address, which
+makes them 24 bytes rather than 32, so 4/3 as many peers fit in the
+same memory and the cache lines. Two peers only get mixed up if their
+hashes are equal in all 64 bits, which within a bucket (that already
+has the 12 low bits in common) is one time in 2^52 per slot looked
+at; the one mixed up sends the other's cookie, which the server
+refuses with a SET-COOKIE, as for any stale cookie. bench_ipcookies
+reports the rate it sees. The compact cache can not tell the address
+of an entry, so it can not demote into the cold tier. All the users
+of the shared memory must agree on it; the cache section version
+tells them apart.
+
+The buckets are valid lazily: each carries the generation it was
+last (re)initialized in, and a bucket from an older generation is
+empty, no matter what is in it. ipcookie_cache_init() thus empties
+the whole cache in O(1), just by moving to the next generation, and
+the memory of a bucket is not touched until a peer needs it - the
+first writer to the stale bucket clears it. A writer which finds
+the bucket being cleared for longer than IPCOOKIE_CACHE_CLEARING_SPINS
+checks takes it for a clearer that has died midway and clears it
+itself; if the clearer was merely slow, the entries added to the
+bucket in between are lost, which the cache can afford.
+
+********************************************************************/
+
 #define IPCOOKIE_CACHE_SIZE 65536
+#define IPCOOKIE_CACHE_BUCKET_SIZE 16
+#define IPCOOKIE_CACHE_BUCKETS (IPCOOKIE_CACHE_SIZE / IPCOOKIE_CACHE_BUCKET_SIZE)
+
+/* A bucket being cleared by someone right now */
+#define IPCOOKIE_CACHE_GENERATION_CLEARING 0xFFFFFFFF
+
+/* How long we wait for someone else to clear a bucket before we do it ourselves */
+#define IPCOOKIE_CACHE_CLEARING_SPINS 1000000
+
+typedef struct ipcookie_cache_tags {
+  uint8_t fingerprints[IPCOOKIE_CACHE_BUCKET_SIZE];   /* zero for the free slots */
+  uint32_t generation;
+  uint32_t padding[3];
+} __attribute__((aligned(32))) ipcookie_cache_tags_t;
+
+#ifdef IPCOOKIES_COMPACT_CACHE
+
+/* The hash of the address, and the entry for it */
+typedef struct ipcookie_cache_slot {
+  uint64_t key;
+  ipcookie_entry_t entry;
+} ipcookie_cache_slot_t;
+
+#define IPCOOKIE_CACHE_SECTION_VERSION 3
+
+#else
+
+/* The address and the entry for it, in half of a cache line */
+typedef struct ipcookie_cache_slot {
+  struct in6_addr peer;
+  ipcookie_entry_t entry;
+} __attribute__((aligned(32))) ipcookie_cache_slot_t;
+
+#define IPCOOKIE_CACHE_SECTION_VERSION 2
+
+#endif
 
 typedef struct ipcookie_cache_struct {
-  uint16_t entry_count;
-  uint8_t padding[14];
-  struct ipcookie_entry entries[IPCOOKIE_CACHE_SIZE];
+  uint32_t generation;   /* never 0 nor IPCOOKIE_CACHE_GENERATION_CLEARING once initialized */
+  uint32_t padding;
+  uint64_t hash_seed[2];
+  ipcookie_cache_tags_t tags[IPCOOKIE_CACHE_BUCKETS] __attribute__((aligned(64)));
+  /* slot i of bucket b is at the index b * IPCOOKIE_CACHE_BUCKET_SIZE + i */
+  ipcookie_cache_slot_t slots[IPCOOKIE_CACHE_SIZE] __attribute__((aligned(64)));
 } ipcookie_cache_t;
 
+/* Empty the cache, and key its hash from the state's secret */
+void ipcookie_cache_init(ipcookie_cache_t *ipck, ipcookie_state_t *state);
+
 ipcookie_entry_t *ipcookie_cache_entry_find_by_address(ipcookie_cache_t *ipck, struct in6_addr *peer);
-ipcookie_entry_t *ipcookie_cache_entry_allocate(ipcookie_cache_t *ipck, struct in6_addr *peer);
+/*
+ * ret_evicted, if not NULL, gets the slot of the other peer's entry
+ * which had to go to make the room, all zeroes if none had to
+ */
+ipcookie_entry_t *ipcookie_cache_entry_allocate(ipcookie_cache_t *ipck, struct in6_addr *peer,
+                                                ipcookie_cache_slot_t *ret_evicted);
+
+/* Put the saved slot back in (e.g. from a snapshot), as the above */
+ipcookie_entry_t *ipcookie_cache_slot_restore(ipcookie_cache_t *ipck, ipcookie_cache_slot_t *slot,
+                                              ipcookie_cache_slot_t *ret_evicted);
+
+/* Walk all the entries in use: start with NULL, end when NULL is returned */
+ipcookie_entry_t *ipcookie_cache_entry_next(ipcookie_cache_t *ipck, ipcookie_entry_t *ce);
+
+/* The slot of the entry */
+static inline ipcookie_cache_slot_t *ipcookie_cache_entry_slot(ipcookie_cache_t *ipck, ipcookie_entry_t *ce) {
+  return (ipcookie_cache_slot_t *)((uint8_t *)ce - __builtin_offsetof(ipcookie_cache_slot_t, entry));
+}
 
+/* Whether the entry is (still) the one of the peer */
+int ipcookie_cache_entry_is_for(ipcookie_cache_t *ipck, ipcookie_entry_t *ce, struct in6_addr *peer);
 
+/* Whether the slot holds an entry, e.g. whether one was evicted */
+static inline int ipcookie_cache_slot_in_use(ipcookie_cache_slot_t *slot) {
+#ifdef IPCOOKIES_COMPACT_CACHE
+  return slot->key != 0;
+#else
+  return !IN6_IS_ADDR_UNSPECIFIED(&slot->peer);
+#endif
+}
 
+/* The address of the peer of the slot, NULL if the cache does not keep the addresses */
+static inline struct in6_addr *ipcookie_cache_slot_peer(ipcookie_cache_slot_t *slot) {
+#ifdef IPCOOKIES_COMPACT_CACHE
+  return NULL;
+#else
+  return &slot->peer;
+#endif
+}
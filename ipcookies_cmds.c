@@ -0,0 +1,113 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+
+#define IPCOOKIE_CMDS_MASK (IPCOOKIE_CMDS_SIZE - 1)
+
+void ipcookie_cmd_post(ipcookie_cmds_t *cmds, ipcookie_cmd_type_t type, struct in6_addr *peer,
+                       ipcookie_entry_t *observed, ipcookie_entry_t *entry) {
+  uint64_t pos = __atomic_load_n(&cmds->head, __ATOMIC_RELAXED);
+  ipcookie_cmd_t *cmd;
+  uint64_t unpublished;
+
+  for (;;) {
+    uint64_t idx = pos & IPCOOKIE_CMDS_MASK;
+    int64_t diff;
+    cmd = &cmds->ring[idx];
+    diff = (int64_t)(__atomic_load_n(&cmd->seq, __ATOMIC_ACQUIRE) + idx - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&cmds->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* cookied is behind: the next packet of the peer will ask again */
+      __atomic_fetch_add(&cmds->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&cmds->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  cmd->type = type;
+  cmd->peer = *peer;
+  if (observed) {
+    cmd->observed = *observed;
+  } else {
+    memset(&cmd->observed, 0, sizeof(cmd->observed));
+  }
+  if (entry) {
+    cmd->entry = *entry;
+  } else {
+    memset(&cmd->entry, 0, sizeof(cmd->entry));
+  }
+  unpublished = pos - (pos & IPCOOKIE_CMDS_MASK);
+  if (!__atomic_compare_exchange_n(&cmd->seq, &unpublished, pos + 1 - (pos & IPCOOKIE_CMDS_MASK), 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    /* cookied took us for gone and skipped the slot */
+    __atomic_fetch_add(&cmds->dropped, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* The slot at pos is not published: skip it if its shim looks gone, as in ipcookies_events.c */
+static int ipcookie_cmd_skip_stalled(ipcookie_cmds_t *cmds, ipcookie_cmd_t *cmd, uint64_t pos, uint64_t seq) {
+  struct timespec ts;
+  uint64_t now_ms;
+
+  if (__atomic_load_n(&cmds->head, __ATOMIC_RELAXED) - pos < IPCOOKIE_CMDS_STALL_LAG) {
+    cmds->stalled_pos = 0;
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now_ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+  if (cmds->stalled_pos != pos + 1) {
+    cmds->stalled_pos = pos + 1;
+    cmds->stalled_since_ms = now_ms;
+    return 0;
+  }
+  if (now_ms - cmds->stalled_since_ms < IPCOOKIE_CMDS_STALL_MS ||
+      !__atomic_compare_exchange_n(&cmd->seq, &seq, pos + IPCOOKIE_CMDS_SIZE - (pos & IPCOOKIE_CMDS_MASK), 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  cmds->stalled_pos = 0;
+  __atomic_fetch_add(&cmds->dropped, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&cmds->tail, pos + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+int ipcookie_cmd_read(ipcookie_cmds_t *cmds, ipcookie_cmd_t *ret_cmd) {
+  uint64_t pos, idx, seq;
+  ipcookie_cmd_t *cmd;
+
+  do {
+    pos = __atomic_load_n(&cmds->tail, __ATOMIC_RELAXED);
+    idx = pos & IPCOOKIE_CMDS_MASK;
+    cmd = &cmds->ring[idx];
+    seq = __atomic_load_n(&cmd->seq, __ATOMIC_ACQUIRE);
+  } while (seq + idx != pos + 1 && ipcookie_cmd_skip_stalled(cmds, cmd, pos, seq));
+  if (seq + idx != pos + 1) {
+    return 0;
+  }
+  cmds->stalled_pos = 0;
+  *ret_cmd = *cmd;
+  __atomic_store_n(&cmd->seq, pos + IPCOOKIE_CMDS_SIZE - idx, __ATOMIC_RELEASE);
+  __atomic_store_n(&cmds->tail, pos + 1, __ATOMIC_RELAXED);
+  return 1;
+}
@@ -0,0 +1,83 @@
+/********************************************************************
+
+The command ring from the shims to cookied, for the single writer
+mode (cookied -w) and for the cold tier of the cache (cookied -c, see
+ipcookies_cold.h).
+
+In that mode the shims map the cache read-only, and never change
+the entries themselves: whatever the outbound path would have done
+to an entry - creating it, or a transition of its state - is worked
+out on a copy, and posted to cookied as the entry the shim saw and
+the entry it is to become. cookied is the only writer of the cache:
+it applies a change only if the entry is still the one the shim saw,
+so of the shims racing to do the same transition, one wins and the
+rest are dropped; for the creation the same goes for the peer not
+being in the cache yet.
+
+The shims attached when cookied restarts into or out of the mode
+switch on their next slow path (see ipcookies_view_refresh()); the
+ones switching into it keep their mapping of the cache writable, as
+another of their threads may be just about to write to it.
+
+Until cookied gets to it, the shim goes on with its copy, so the
+packets of a peer keep going out as they would have; the copy is the
+same on every packet, as the stateless cookie is, so posting it again
+does no harm.
+
+With the cold tier, the shims also post here the entries they evict
+from the cache (for cookied to demote them into the cold tier), and
+the new entries they make for the peers not in the cache (for cookied
+to replace with the one from the cold tier, if there is one there and
+the new entry is still as the shim made it); in the single writer mode
+cookied does both on its own, as it makes and evicts the entries.
+
+The ring is the same lock-free bounded MPSC queue as the event log
+(see ipcookies_events.h): the shims never wait for cookied, a full
+ring drops the command (counted in "dropped"), and as nothing changed
+in the cache, the next packet of the peer posts it again. Likewise
+cookied skips the slot of a shim which has died before publishing it,
+after IPCOOKIE_CMDS_STALL_MS with the head IPCOOKIE_CMDS_STALL_LAG
+past it; a garbled command does no harm either, as it only applies
+to the entry it has observed.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_CMD_NONE = 0,
+  IPCOOKIE_CMD_UPDATE,      /* the entry was "observed", make it "entry" */
+  IPCOOKIE_CMD_ALLOCATE,    /* the peer was not in the cache, add it with "entry" */
+  IPCOOKIE_CMD_DEMOTE,      /* "entry" was evicted from the cache */
+  IPCOOKIE_CMD_PROMOTE,     /* the peer missed the cache, and got the new "observed" */
+} ipcookie_cmd_type_t;
+
+/* Must be a power of two */
+#define IPCOOKIE_CMDS_SIZE 65536
+
+typedef struct ipcookie_cmd {
+  uint64_t seq;             /* minus the slot index, as in the event log */
+  uint16_t type;            /* ipcookie_cmd_type_t */
+  uint8_t padding[6];
+  struct in6_addr peer;
+  ipcookie_entry_t observed;
+  ipcookie_entry_t entry;
+} __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE))) ipcookie_cmd_t;
+
+#define IPCOOKIE_CMDS_STALL_LAG 8
+#define IPCOOKIE_CMDS_STALL_MS 1000
+
+typedef struct ipcookie_cmds {
+  uint64_t head __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  uint64_t tail __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  /* cookied's, as in the event log */
+  uint64_t stalled_pos;
+  uint64_t stalled_since_ms;
+  uint64_t dropped __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  ipcookie_cmd_t ring[IPCOOKIE_CMDS_SIZE];
+} ipcookie_cmds_t;
+
+/* Never blocks; observed may be NULL, and entry too for IPCOOKIE_CMD_PROMOTE */
+void ipcookie_cmd_post(ipcookie_cmds_t *cmds, ipcookie_cmd_type_t type, struct in6_addr *peer,
+                       ipcookie_entry_t *observed, ipcookie_entry_t *entry);
+
+/* For cookied: returns 1 and fills the command if there was one, 0 otherwise */
+int ipcookie_cmd_read(ipcookie_cmds_t *cmds, ipcookie_cmd_t *ret_cmd);
@@ -0,0 +1,169 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+#include "ipcookies.h"
+#include "ipcookies_cold.h"
+
+static uint64_t ipcookie_cold_mix(uint64_t x) {
+  /* the splitmix64 finalizer, as the cache uses */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static ipcookie_cold_record_t *ipcookie_cold_bucket(ipcookie_cold_t *cold, struct in6_addr *peer) {
+  uint64_t hi, lo, h;
+  memcpy(&hi, peer->s6_addr, sizeof(hi));
+  memcpy(&lo, peer->s6_addr + 8, sizeof(lo));
+  h = ipcookie_cold_mix(ipcookie_cold_mix(hi ^ cold->hdr->hash_seed[0]) ^ lo ^ cold->hdr->hash_seed[1]);
+  return &cold->records[(h & (cold->hdr->bucket_count - 1)) * IPCOOKIE_COLD_BUCKET_SIZE];
+}
+
+static int ipcookie_cold_init(ipcookie_cold_hdr_t *hdr, uint64_t bucket_count) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  if (read(fd, hdr->hash_seed, sizeof(hdr->hash_seed)) != sizeof(hdr->hash_seed)) {
+    close(fd);
+    errno = EIO;
+    return -1;
+  }
+  close(fd);
+  memcpy(hdr->magic, IPCOOKIE_COLD_MAGIC, sizeof(hdr->magic));
+  hdr->version = IPCOOKIE_COLD_VERSION;
+  hdr->record_size = sizeof(ipcookie_cold_record_t);
+  hdr->bucket_count = bucket_count;
+  hdr->records = 0;
+  return 0;
+}
+
+int ipcookie_cold_open(ipcookie_cold_t *cold, char *path, uint64_t records) {
+  uint64_t bucket_count = 1;
+  ipcookie_cold_hdr_t hdr;
+  struct stat st;
+  int fd;
+
+  while (bucket_count * IPCOOKIE_COLD_BUCKET_SIZE < records) {
+    bucket_count <<= 1;
+  }
+  fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1) {
+    goto fail;
+  }
+  if (st.st_size >= sizeof(hdr) && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+      !memcmp(hdr.magic, IPCOOKIE_COLD_MAGIC, sizeof(hdr.magic))) {
+    if (hdr.version != IPCOOKIE_COLD_VERSION || hdr.record_size != sizeof(ipcookie_cold_record_t) ||
+        !hdr.bucket_count || (hdr.bucket_count & (hdr.bucket_count - 1)) ||
+        st.st_size < sizeof(hdr) + hdr.bucket_count * IPCOOKIE_COLD_BUCKET_SIZE * sizeof(ipcookie_cold_record_t)) {
+      /* not ours to throw away */
+      errno = EINVAL;
+      goto fail;
+    }
+    bucket_count = hdr.bucket_count;
+  } else if (st.st_size != 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  cold->len = sizeof(hdr) + bucket_count * IPCOOKIE_COLD_BUCKET_SIZE * sizeof(ipcookie_cold_record_t);
+  /* sparse: the disk only gets the buckets in use */
+  if (st.st_size == 0 && ftruncate(fd, cold->len) == -1) {
+    goto fail;
+  }
+  cold->hdr = mmap(NULL, cold->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cold->hdr == MAP_FAILED) {
+    goto fail;
+  }
+  close(fd);
+  cold->records = (ipcookie_cold_record_t *)(cold->hdr + 1);
+  if (st.st_size == 0 && ipcookie_cold_init(cold->hdr, bucket_count) == -1) {
+    int err = errno;
+    munmap(cold->hdr, cold->len);
+    unlink(path);
+    errno = err;
+    return -1;
+  }
+  return 0;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+void ipcookie_cold_close(ipcookie_cold_t *cold) {
+  msync(cold->hdr, cold->len, MS_SYNC);
+  munmap(cold->hdr, cold->len);
+  cold->hdr = NULL;
+}
+
+void ipcookie_cold_put(ipcookie_cold_t *cold, struct in6_addr *peer, ipcookie_entry_t *entry) {
+  ipcookie_cold_record_t *bucket = ipcookie_cold_bucket(cold, peer);
+  ipcookie_cold_record_t *victim = NULL;
+  time_t now = time(NULL);
+  time_t oldest_mtime = 0;
+  int i;
+
+  for (i = 0; i < IPCOOKIE_COLD_BUCKET_SIZE; i++) {
+    ipcookie_cold_record_t *r = &bucket[i];
+    time_t mtime;
+    if (!memcmp(&r->peer, peer, sizeof(*peer))) {
+      r->entry = *entry;
+      return;
+    }
+    if (IN6_IS_ADDR_UNSPECIFIED(&r->peer)) {
+      /* a free one beats any to evict, but the peer may still be further on */
+      if (!victim || !IN6_IS_ADDR_UNSPECIFIED(&victim->peer)) {
+        victim = r;
+      }
+      continue;
+    }
+    mtime = expand_timestamp(now, r->entry.mtime_hi8, r->entry.mtime_lo16);
+    if (!victim || (!IN6_IS_ADDR_UNSPECIFIED(&victim->peer) && mtime < oldest_mtime)) {
+      victim = r;
+      oldest_mtime = mtime;
+    }
+  }
+  if (IN6_IS_ADDR_UNSPECIFIED(&victim->peer)) {
+    cold->hdr->records++;
+  }
+  victim->peer = *peer;
+  victim->entry = *entry;
+}
+
+int ipcookie_cold_take(ipcookie_cold_t *cold, struct in6_addr *peer, ipcookie_entry_t *ret_entry) {
+  ipcookie_cold_record_t *bucket = ipcookie_cold_bucket(cold, peer);
+  int i;
+
+  for (i = 0; i < IPCOOKIE_COLD_BUCKET_SIZE; i++) {
+    if (!memcmp(&bucket[i].peer, peer, sizeof(*peer))) {
+      *ret_entry = bucket[i].entry;
+      memset(&bucket[i], 0, sizeof(bucket[i]));
+      cold->hdr->records--;
+      return 1;
+    }
+  }
+  return 0;
+}
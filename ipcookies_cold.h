@@ -0,0 +1,68 @@
+/********************************************************************
+
+The cold tier of the peer cache: for the hosts which talk to far
+more peers than the cache holds, the entries evicted from the cache
+are kept in a file, and brought back when the peer is seen again,
+so the peer does not have to be asked for a new cookie.
+
+The file is a hash table of the fixed-size records - the address and
+the ipcookie_entry_t, 32 bytes, two per cache line - in the buckets of
+IPCOOKIE_COLD_BUCKET_SIZE, keyed with a seed of its own (the file may
+well outlive the secret). It is mapped shared, so the page cache
+does the I/O, and only the buckets in use take the room on the disk.
+A full bucket drops the record with the oldest mtime.
+
+Only cookied uses the file, and the shims never wait for it: they
+tell cookied about the evictions and the misses over the command
+ring (see ipcookies_cmds.h), and cookied, as it gets to them, moves
+the evicted entries into the file (the demotion), and puts the entry
+from the file in place of the new one the shim has just made for the
+peer, if it is still untouched (the promotion). Until then, the peer
+gets the packets with the cookie of a new entry, exactly as without
+the cold tier.
+
+The mtimes are the 24-bit ones, as in the cache: a record not seen
+for longer than that (194 days) comes back with a wrong mtime, which
+at worst makes the peer send us a SET-COOKIE.
+
+********************************************************************/
+
+#define IPCOOKIE_COLD_MAGIC "IPCKCOLD"
+#define IPCOOKIE_COLD_VERSION 1
+#define IPCOOKIE_COLD_BUCKET_SIZE 8
+#define IPCOOKIE_COLD_DEFAULT_RECORDS (16 * 1024 * 1024)
+
+typedef struct ipcookie_cold_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;      /* sizeof(ipcookie_cold_record_t) */
+  uint64_t bucket_count;     /* a power of two */
+  uint64_t hash_seed[2];
+  uint64_t records;          /* in use */
+  uint8_t padding[16];
+} ipcookie_cold_hdr_t;
+
+typedef struct ipcookie_cold_record {
+  struct in6_addr peer;      /* :: for a free record */
+  ipcookie_entry_t entry;
+} ipcookie_cold_record_t;
+
+typedef struct ipcookie_cold {
+  ipcookie_cold_hdr_t *hdr;
+  ipcookie_cold_record_t *records;
+  size_t len;
+} ipcookie_cold_t;
+
+/*
+ * Map the file, creating it with room for about the given number of
+ * the records if it does not exist; an existing one keeps its size.
+ * Returns -1 with errno set on failure.
+ */
+int ipcookie_cold_open(ipcookie_cold_t *cold, char *path, uint64_t records);
+void ipcookie_cold_close(ipcookie_cold_t *cold);
+
+/* Store the entry of the peer, replacing the one it had */
+void ipcookie_cold_put(ipcookie_cold_t *cold, struct in6_addr *peer, ipcookie_entry_t *entry);
+
+/* Returns 1 and moves the entry of the peer out of the file if it has one, 0 otherwise */
+int ipcookie_cold_take(ipcookie_cold_t *cold, struct in6_addr *peer, ipcookie_entry_t *ret_entry);
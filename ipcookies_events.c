@@ -0,0 +1,116 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+
+#define IPCOOKIE_EVENTS_MASK (IPCOOKIE_EVENTS_SIZE - 1)
+
+void ipcookie_event_log(ipcookie_events_t *events, ipcookie_event_type_t type, uint8_t arg,
+                        struct in6_addr *peer, void *cookie) {
+  uint64_t pos = __atomic_load_n(&events->head, __ATOMIC_RELAXED);
+  ipcookie_event_t *ev;
+  struct timespec ts;
+  uint64_t unpublished;
+
+  for (;;) {
+    uint64_t idx = pos & IPCOOKIE_EVENTS_MASK;
+    int64_t diff;
+    ev = &events->ring[idx];
+    diff = (int64_t)(__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) + idx - pos);
+    if (diff == 0) {
+      /* the slot is free for this position, try to claim it */
+      if (__atomic_compare_exchange_n(&events->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* the reader has not got here yet: full */
+      __atomic_fetch_add(&events->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      /* someone else got this position */
+      pos = __atomic_load_n(&events->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ev->timestamp_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  ev->type = type;
+  ev->arg = arg;
+  ev->peer = *peer;
+  if (cookie) {
+    memcpy(ev->cookie, cookie, sizeof(ev->cookie));
+  } else {
+    memset(ev->cookie, 0, sizeof(ev->cookie));
+  }
+  unpublished = pos - (pos & IPCOOKIE_EVENTS_MASK);
+  if (!__atomic_compare_exchange_n(&ev->seq, &unpublished, pos + 1 - (pos & IPCOOKIE_EVENTS_MASK), 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    /* the reader took us for gone and skipped the slot */
+    __atomic_fetch_add(&events->dropped, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* The slot at pos is not published: skip it if its writer looks gone, see ipcookies_events.h */
+static int ipcookie_event_skip_stalled(ipcookie_events_t *events, ipcookie_event_t *ev, uint64_t pos, uint64_t seq) {
+  struct timespec ts;
+  uint64_t now_ms;
+
+  if (__atomic_load_n(&events->head, __ATOMIC_RELAXED) - pos < IPCOOKIE_EVENTS_STALL_LAG) {
+    events->stalled_pos = 0;
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now_ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+  if (events->stalled_pos != pos + 1) {
+    events->stalled_pos = pos + 1;
+    events->stalled_since_ms = now_ms;
+    return 0;
+  }
+  if (now_ms - events->stalled_since_ms < IPCOOKIE_EVENTS_STALL_MS ||
+      !__atomic_compare_exchange_n(&ev->seq, &seq, pos + IPCOOKIE_EVENTS_SIZE - (pos & IPCOOKIE_EVENTS_MASK), 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    /* if the CAS failed, it has just been published */
+    return 0;
+  }
+  events->stalled_pos = 0;
+  __atomic_fetch_add(&events->dropped, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&events->tail, pos + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+int ipcookie_event_read(ipcookie_events_t *events, ipcookie_event_t *ret_event) {
+  uint64_t pos, idx, seq;
+  ipcookie_event_t *ev;
+
+  do {
+    pos = __atomic_load_n(&events->tail, __ATOMIC_RELAXED);
+    idx = pos & IPCOOKIE_EVENTS_MASK;
+    ev = &events->ring[idx];
+    seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+  } while (seq + idx != pos + 1 && ipcookie_event_skip_stalled(events, ev, pos, seq));
+  if (seq + idx != pos + 1) {
+    return 0;
+  }
+  events->stalled_pos = 0;
+  *ret_event = *ev;
+  /* free the slot for the writer one lap ahead */
+  __atomic_store_n(&ev->seq, pos + IPCOOKIE_EVENTS_SIZE - idx, __ATOMIC_RELEASE);
+  __atomic_store_n(&events->tail, pos + 1, __ATOMIC_RELAXED);
+  return 1;
+}
@@ -0,0 +1,80 @@
+/********************************************************************
+
+The event log: the notable events (e.g. the spoof reports), as the
+fixed-size binary records in a ring in the shared memory.
+
+Any number of the writers (cookied and the shims) append to the ring
+without the locks and without ever waiting: if the ring is full,
+the event is dropped and counted in "dropped". A single reader
+(cookiectl events) takes the records out and formats them, so
+the slow part - the formatting and the output - is never done
+by the receive loop.
+
+This is the bounded MPSC queue with a sequence number per slot:
+a writer claims the position with a CAS on the head, fills the slot
+and then publishes it by bumping the slot's sequence; the reader
+consumes the slots in order, stopping at the first one not published
+yet. To make the all-zeroes memory a valid empty ring, the slot keeps
+its sequence relative to its own index.
+
+A writer which dies (or stops) between claiming the slot and publishing
+it would stop the reader there for good, so once the head is at least
+IPCOOKIE_EVENTS_STALL_LAG past the slot and it has stayed unpublished
+for IPCOOKIE_EVENTS_STALL_MS, the reader skips it, counting it as
+dropped. Both the skip and the publishing are a CAS on the slot's
+sequence, so a writer which comes back after the skip loses its event
+rather than the slot; it may still garble the slot's next record, if
+the ring has gone a whole lap meanwhile.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_EVENT_NONE = 0,
+  IPCOOKIE_EVENT_SPOOF,               /* arg: the verification result */
+  IPCOOKIE_EVENT_SETCOOKIE_IGNORED,   /* echoed cookie did not match */
+  IPCOOKIE_EVENT_NOT_EXPECTED_SENT,   /* SET-COOKIE for an unknown peer */
+  IPCOOKIE_EVENT_FALLBACK,            /* arg: flags_and_lifetime_log2 */
+  IPCOOKIE_EVENT_COUNT
+} ipcookie_event_type_t;
+
+#define IPCOOKIE_EVENT_NAMES { \
+  "none",                      \
+  "spoof",                     \
+  "setcookie_ignored",         \
+  "not_expected_sent",         \
+  "fallback",                  \
+}
+
+/* Must be a power of two */
+#define IPCOOKIE_EVENTS_SIZE 4096
+
+typedef struct ipcookie_event {
+  uint64_t seq;                  /* minus the slot index, see above */
+  int64_t timestamp_ns;          /* CLOCK_REALTIME */
+  uint16_t type;                 /* ipcookie_event_type_t */
+  uint8_t arg;
+  uint8_t padding[5];
+  struct in6_addr peer;
+  ipcookie_t cookie;
+  uint8_t padding2[12];
+} __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE))) ipcookie_event_t;
+
+#define IPCOOKIE_EVENTS_STALL_LAG 8
+#define IPCOOKIE_EVENTS_STALL_MS 1000
+
+typedef struct ipcookie_events {
+  uint64_t head __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  uint64_t tail __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  /* the reader's, in the line of the tail: the slot it waits for (plus one, zero if none), since when */
+  uint64_t stalled_pos;
+  uint64_t stalled_since_ms;
+  uint64_t dropped __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  ipcookie_event_t ring[IPCOOKIE_EVENTS_SIZE];
+} ipcookie_events_t;
+
+/* Never blocks; the cookie may be NULL */
+void ipcookie_event_log(ipcookie_events_t *events, ipcookie_event_type_t type, uint8_t arg,
+                        struct in6_addr *peer, void *cookie);
+
+/* For the single reader: returns 1 and fills the event if there was one, 0 otherwise */
+int ipcookie_event_read(ipcookie_events_t *events, ipcookie_event_t *ret_event);
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+#include "shim_ipcookies.h"
+
+/********************************************************************
+
+The load generator for the spoofed-flood tests, and a shim-enabled
+UDP sink to be its target. See scripts/netns_flood.sh for the harness
+which puts them and cookied together across a veth pair.
+
+Generator mode (Linux only, needs CAP_NET_RAW):
+
+  ipcookies_flood -i <ifname> -d <dst mac> -D <dst addr> -m <mode>
+                  [-S <src prefix>] [-k <distinct sources>] [-t <seconds>]
+                  [-p <packets per second>] [-P <udp port>] [-l <payload length>]
+
+It sends the Ethernet frames with forged IPv6 source addresses, taken
+at random from within the /64 of -S (or from -k distinct ones),
+of the following kinds (-m):
+
+  bogus:        UDP datagrams carrying a random (not verifying) cookie
+  valid:        UDP datagrams carrying the valid cookie for the forged
+                source, calculated from the /ipcookies state (so this
+                is only possible with the access to the target's secret)
+  nocookie:     UDP datagrams without the cookie option
+  setcookie:    SET-COOKIE messages with random echoed cookies
+  notexpected:  SETCOOKIE-NOT-EXPECTED messages with random echoed cookies
+
+Sink mode:
+
+  ipcookies_flood -r <udp port>
+
+receives on the port, with UDP_GRO on, runs every buffer through
+ipcookies_shim_inbound_check_msghdr(), and prints the counts of the
+datagrams (segments) and of the buffers they came in every second.
+
+GSO sender mode:
+
+  ipcookies_flood -g <segment size> -D <dst addr> [-n <segments per send>]
+                  [-t <seconds>] [-p <sends per second>] [-P <udp port>]
+
+sends, from an ordinary UDP socket, the super-buffers of n segments
+with UDP_SEGMENT and the cookie attached by
+ipcookies_shim_outbound_msghdr(), as a shim-enabled application would.
+See scripts/netns_gso.sh for the harness with the sink.
+
+********************************************************************/
+
+#define FLOOD_MODE_BOGUS 0
+#define FLOOD_MODE_VALID 1
+#define FLOOD_MODE_NOCOOKIE 2
+#define FLOOD_MODE_SETCOOKIE 3
+#define FLOOD_MODE_NOTEXPECTED 4
+
+#define FLOOD_BATCH 64
+#define FLOOD_FRAME_MAX 1514
+
+static char *flood_mode_names[] = { "bogus", "valid", "nocookie", "setcookie", "notexpected", NULL };
+
+static uint64_t flood_rand_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t flood_rand(void) {
+  /* xorshift64* */
+  flood_rand_state ^= flood_rand_state >> 12;
+  flood_rand_state ^= flood_rand_state << 25;
+  flood_rand_state ^= flood_rand_state >> 27;
+  return flood_rand_state * 2685821657736338717ULL;
+}
+
+static double flood_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(char *argv0) {
+  fprintf(stderr, "Usage: %s -i <ifname> -d <dst mac> -D <dst addr> -m bogus|valid|nocookie|setcookie|notexpected\n"
+                  "          [-S <src prefix>] [-k <distinct sources>] [-t <seconds>] [-p <pps>]\n"
+                  "          [-P <udp port>] [-l <payload length>]\n"
+                  "       %s -r <udp port>\n"
+                  "       %s -g <segment size> -D <dst addr> [-n <segments>] [-t <seconds>] [-p <sends per second>]\n"
+                  "          [-P <udp port>]\n", argv0, argv0, argv0);
+  exit(1);
+}
+
+/********************************************************************
+ The sink.
+ ********************************************************************/
+
+static void flood_sink(int port) {
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  struct sockaddr_in6 sa;
+  void *ipck = mmap_ipcookies();
+  uint64_t counts[IPCOOKIE_ADMITTED + 1] = { 0 };
+  uint64_t datagrams = 0;
+  uint64_t buffers = 0;
+  double next_report = flood_now() + 1;
+  static uint8_t buf[65536];
+  uint8_t control[IPCOOKIES_SHIM_CMSG_SPACE + CMSG_SPACE(sizeof(int))];
+
+  if (!ipck) {
+    /* mmap_ipcookies() has said why */
+    exit(1);
+  }
+  if (fd == -1) {
+    die_perror("sink socket");
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sin6_family = AF_INET6;
+  sa.sin6_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    die_perror("sink bind");
+  }
+  if (ipcookies_shim_udp_socket_init(fd, 1) == -1) {
+    die_perror("sink socket init");
+  }
+  while (1) {
+    struct sockaddr_in6 src;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ssize_t len;
+    int segments;
+    int res;
+
+    if (poll(&pfd, 1, 100) > 0) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &src;
+      msg.msg_namelen = sizeof(src);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      len = recvmsg(fd, &msg, 0);
+      if (len >= 0) {
+        res = ipcookies_shim_inbound_check_msghdr(ipck, &msg, len, &segments);
+        counts[res] += segments;
+        datagrams += segments;
+        buffers++;
+      }
+    }
+    if (flood_now() >= next_report) {
+      printf("sink: datagrams %llu buffers %llu curr %llu prev %llu nomatch %llu admitted %llu\n",
+             (unsigned long long)datagrams, (unsigned long long)buffers,
+             (unsigned long long)counts[IPCOOKIE_MATCH_CURR],
+             (unsigned long long)counts[IPCOOKIE_MATCH_PREV],
+             (unsigned long long)counts[IPCOOKIE_NOMATCH],
+             (unsigned long long)counts[IPCOOKIE_ADMITTED]);
+      fflush(stdout);
+      next_report += 1;
+    }
+  }
+}
+
+/********************************************************************
+ The GSO sender.
+ ********************************************************************/
+
+#define FLOOD_GSO_MAX_SEGMENTS 64
+
+static void flood_gso_send(char *dst, int port, int segment_size, int n_segments, double seconds, double pps) {
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  struct sockaddr_in6 sa;
+  void *ipck = mmap_ipcookies();
+  ipcookie_dstopt_template_t tmpl;
+  static uint8_t buf[65536];
+  uint8_t control[IPCOOKIES_SHIM_CMSG_SPACE + CMSG_SPACE(sizeof(uint16_t))];
+  uint64_t sends = 0, with_cookie = 0;
+  double start, now;
+
+  if (!ipck) {
+    exit(1);
+  }
+  if (fd == -1) {
+    die_perror("gso socket");
+  }
+  if (segment_size <= 0 || n_segments <= 0 || n_segments > FLOOD_GSO_MAX_SEGMENTS ||
+      (size_t)segment_size * n_segments > sizeof(buf)) {
+    usage("ipcookies_flood");
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sin6_family = AF_INET6;
+  sa.sin6_port = htons(port);
+  if (inet_pton(AF_INET6, dst, &sa.sin6_addr) != 1) {
+    usage("ipcookies_flood");
+  }
+  ipcookie_dstopt_template_init(&tmpl, IPPROTO_UDP, NULL, 0);
+  memset(buf, 0xA5, sizeof(buf));
+
+  start = flood_now();
+  while ((now = flood_now()) - start < seconds) {
+    struct iovec iov = { buf, (size_t)segment_size * n_segments };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    uint16_t gso_size = segment_size;
+    int res;
+
+    if (pps > 0 && sends >= pps * (now - start)) {
+      usleep(100);
+      continue;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    msg.msg_controllen = CMSG_SPACE(sizeof(gso_size));
+    res = ipcookies_shim_outbound_msghdr(ipck, 1, &sa.sin6_addr, &tmpl, &msg, sizeof(control));
+    if (res == -1) {
+      die_perror("gso control buffer");
+    }
+    if (sendmsg(fd, &msg, 0) == -1) {
+      die_perror("gso sendmsg");
+    }
+    sends++;
+    with_cookie += res;
+  }
+  printf("gso: sent %llu buffers (%llu with the cookie) of %d segments of %d bytes\n",
+         (unsigned long long)sends, (unsigned long long)with_cookie, n_segments, segment_size);
+}
+
+/********************************************************************
+ The generator.
+ ********************************************************************/
+
+static uint16_t flood_csum_fold(uint32_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+static uint32_t flood_csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i + 1 < len; i += 2) {
+    sum += (p[i] << 8) | p[i+1];
+  }
+  if (len & 1) {
+    sum += p[len-1] << 8;
+  }
+  return sum;
+}
+
+/* The upper layer checksum over the IPv6 pseudo-header */
+
+static uint16_t flood_l4_csum(struct ip6_hdr *ip6, uint8_t proto, uint8_t *l4, size_t l4_len) {
+  uint32_t sum = 0;
+  sum = flood_csum_add(sum, (uint8_t *)&ip6->ip6_src, 32);
+  sum += l4_len;
+  sum += proto;
+  sum = flood_csum_add(sum, l4, l4_len);
+  return htons(flood_csum_fold(sum));
+}
+
+#ifdef __linux__
+
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <linux/if_ether.h>
+
+typedef struct flood_ctx {
+  int mode;
+  uint8_t src_mac[6];
+  uint8_t dst_mac[6];
+  struct in6_addr dst;
+  struct in6_addr src_prefix;
+  uint32_t n_sources;       /* zero: fully random within the /64 */
+  uint16_t port;
+  int payload_len;
+  ipcookie_view_t *ipck;         /* for the valid cookies */
+  ipcookie_dstopt_template_t tmpl;
+} flood_ctx_t;
+
+static void flood_random_bytes(uint8_t *p, size_t len) {
+  while (len) {
+    uint64_t r = flood_rand();
+    size_t n = len < sizeof(r) ? len : sizeof(r);
+    memcpy(p, &r, n);
+    p += n;
+    len -= n;
+  }
+}
+
+static size_t flood_build(flood_ctx_t *ctx, uint8_t *frame) {
+  struct ether_header *eth = (void *)frame;
+  struct ip6_hdr *ip6 = (void *)(eth + 1);
+  uint8_t *l4 = (void *)(ip6 + 1);
+  uint64_t iid;
+  ipcookie_t cookie;
+  size_t l4_len;
+
+  memcpy(eth->ether_dhost, ctx->dst_mac, 6);
+  memcpy(eth->ether_shost, ctx->src_mac, 6);
+  eth->ether_type = htons(ETHERTYPE_IPV6);
+
+  memset(ip6, 0, sizeof(*ip6));
+  ip6->ip6_flow = htonl(6 << 28);
+  ip6->ip6_hlim = 64;
+  ip6->ip6_dst = ctx->dst;
+  ip6->ip6_src = ctx->src_prefix;
+  iid = ctx->n_sources ? 1 + (flood_rand() % ctx->n_sources) : flood_rand();
+  memcpy(&ip6->ip6_src.s6_addr[8], &iid, sizeof(iid));
+
+  if (ctx->mode == FLOOD_MODE_SETCOOKIE || ctx->mode == FLOOD_MODE_NOTEXPECTED) {
+    struct icmp6_hdr *icmp = (void *)l4;
+    struct icmp6_ipcookies *icmp_ipck = (void *)(icmp + 1);
+    memset(icmp, 0, IPCOOKIES_ICMP_SIZE);
+    icmp->icmp6_type = ICMP6_IPCOOKIES;
+    icmp->icmp6_code = (ctx->mode == FLOOD_MODE_SETCOOKIE) ? ICMP6_IC_SET_COOKIE : ICMP6_IC_SETCOOKIE_NOT_EXPECTED;
+    flood_random_bytes(icmp_ipck->echoed_cookie, sizeof(icmp_ipck->echoed_cookie));
+    flood_random_bytes(icmp_ipck->requested_cookie, sizeof(icmp_ipck->requested_cookie));
+    l4_len = IPCOOKIES_ICMP_SIZE;
+    ip6->ip6_nxt = IPPROTO_ICMPV6;
+    ip6->ip6_plen = htons(l4_len);
+    icmp->icmp6_cksum = flood_l4_csum(ip6, IPPROTO_ICMPV6, l4, l4_len);
+  } else {
+    struct udphdr *udp;
+    uint8_t *payload;
+    size_t hdrs_len = 0;
+
+    if (ctx->mode == FLOOD_MODE_NOCOOKIE) {
+      ip6->ip6_nxt = IPPROTO_UDP;
+    } else {
+      if (ctx->mode == FLOOD_MODE_VALID) {
+        ipcookie_set_stateless(ctx->ipck->state, &cookie, &ip6->ip6_src);
+      } else {
+        flood_random_bytes(cookie, sizeof(cookie));
+      }
+      ip6->ip6_nxt = IPPROTO_DSTOPTS;
+      hdrs_len = ipcookie_dstopt_template_write(&ctx->tmpl, l4, cookie);
+    }
+    udp = (void *)(l4 + hdrs_len);
+    payload = (void *)(udp + 1);
+    l4_len = sizeof(*udp) + ctx->payload_len;
+    memset(payload, 0xA5, ctx->payload_len);
+    udp->uh_sport = htons(1024 + (flood_rand() & 0x7fff));
+    udp->uh_dport = htons(ctx->port);
+    udp->uh_ulen = htons(l4_len);
+    udp->uh_sum = 0;
+    udp->uh_sum = flood_l4_csum(ip6, IPPROTO_UDP, (uint8_t *)udp, l4_len);
+    l4_len += hdrs_len;
+    ip6->ip6_plen = htons(l4_len);
+  }
+  return sizeof(*eth) + sizeof(*ip6) + l4_len;
+}
+
+static void flood_generate(flood_ctx_t *ctx, char *ifname, double seconds, double pps) {
+  static uint8_t frames[FLOOD_BATCH][FLOOD_FRAME_MAX];
+  struct mmsghdr msgs[FLOOD_BATCH];
+  struct iovec iovs[FLOOD_BATCH];
+  struct sockaddr_ll sll;
+  int one = 1;
+  uint64_t sent = 0, sent_last = 0;
+  double start, now, next_report;
+  int fd;
+  int i;
+
+  fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (fd == -1) {
+    die_perror("flood packet socket");
+  }
+#ifdef PACKET_QDISC_BYPASS
+  setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#endif
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_ifindex = if_nametoindex(ifname);
+  sll.sll_protocol = htons(ETH_P_IPV6);
+  if (!sll.sll_ifindex) {
+    die_perror("flood interface");
+  }
+  if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+    die_perror("flood bind");
+  }
+
+  start = flood_now();
+  next_report = start + 1;
+  while (1) {
+    int n;
+    now = flood_now();
+    if (now - start >= seconds) {
+      break;
+    }
+    if (pps > 0 && sent >= pps * (now - start)) {
+      continue;
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < FLOOD_BATCH; i++) {
+      iovs[i].iov_base = frames[i];
+      iovs[i].iov_len = flood_build(ctx, frames[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = sendmmsg(fd, msgs, FLOOD_BATCH, 0);
+    if (n > 0) {
+      sent += n;
+    }
+    if (now >= next_report) {
+      fprintf(stderr, "flood: sent %llu, %llu pps\n", (unsigned long long)sent,
+              (unsigned long long)(sent - sent_last));
+      sent_last = sent;
+      next_report += 1;
+    }
+  }
+  printf("flood: mode %s sent %llu packets in %.2f s, %.0f pps\n", flood_mode_names[ctx->mode],
+         (unsigned long long)sent, now - start, sent / (now - start));
+}
+
+static void flood_main(char *ifname, char *dst_mac, char *dst, char *src_prefix, int mode,
+                       uint32_t n_sources, double seconds, double pps, uint16_t port, int payload_len) {
+  flood_ctx_t ctx;
+  char mac_path[128];
+  FILE *f;
+  unsigned int m[6];
+  int i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.mode = mode;
+  ctx.n_sources = n_sources;
+  ctx.port = port;
+  ctx.payload_len = payload_len;
+  if (sscanf(dst_mac, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+    usage("ipcookies_flood");
+  }
+  for (i = 0; i < 6; i++) {
+    ctx.dst_mac[i] = m[i];
+  }
+  snprintf(mac_path, sizeof(mac_path), "/sys/class/net/%s/address", ifname);
+  f = fopen(mac_path, "r");
+  if (!f || fscanf(f, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+    die_perror("flood source mac");
+  }
+  fclose(f);
+  for (i = 0; i < 6; i++) {
+    ctx.src_mac[i] = m[i];
+  }
+  if (inet_pton(AF_INET6, dst, &ctx.dst) != 1 || inet_pton(AF_INET6, src_prefix, &ctx.src_prefix) != 1) {
+    usage("ipcookies_flood");
+  }
+  if (payload_len < 0 || payload_len > FLOOD_FRAME_MAX - 14 - 40 - IPCOOKIE_DSTOPT_TEMPLATE_MAX - 8) {
+    usage("ipcookies_flood");
+  }
+  ipcookie_dstopt_template_init(&ctx.tmpl, IPPROTO_UDP, NULL, 0);
+  if (mode == FLOOD_MODE_VALID) {
+    ctx.ipck = mmap_ipcookies();
+    if (!ctx.ipck) {
+      exit(1);
+    }
+  }
+  flood_rand_state ^= (uint64_t)time(NULL) * 0x100000001B3ULL;
+  flood_generate(&ctx, ifname, seconds, pps);
+}
+
+#else
+
+static void flood_main(char *ifname, char *dst_mac, char *dst, char *src_prefix, int mode,
+                       uint32_t n_sources, double seconds, double pps, uint16_t port, int payload_len) {
+  fprintf(stderr, "the generator mode needs AF_PACKET, which is Linux only\n");
+  exit(1);
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+  char *ifname = NULL;
+  char *dst_mac = NULL;
+  char *dst = NULL;
+  char *src_prefix = "2001:db8:bad::";
+  int mode = -1;
+  uint32_t n_sources = 0;
+  double seconds = 10;
+  double pps = 0;
+  int port = 5353;
+  int payload_len = 64;
+  int sink_port = 0;
+  int gso_size = 0;
+  int gso_segments = 8;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "i:d:D:m:S:k:t:p:P:l:r:g:n:")) != -1) {
+    switch (opt) {
+      case 'i':
+        ifname = optarg;
+        break;
+      case 'd':
+        dst_mac = optarg;
+        break;
+      case 'D':
+        dst = optarg;
+        break;
+      case 'm':
+        for (i = 0; flood_mode_names[i]; i++) {
+          if (!strcmp(optarg, flood_mode_names[i])) {
+            mode = i;
+          }
+        }
+        break;
+      case 'S':
+        src_prefix = optarg;
+        break;
+      case 'k':
+        n_sources = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        seconds = atof(optarg);
+        break;
+      case 'p':
+        pps = atof(optarg);
+        break;
+      case 'P':
+        port = atoi(optarg);
+        break;
+      case 'l':
+        payload_len = atoi(optarg);
+        break;
+      case 'r':
+        sink_port = atoi(optarg);
+        break;
+      case 'g':
+        gso_size = atoi(optarg);
+        break;
+      case 'n':
+        gso_segments = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (sink_port) {
+    flood_sink(sink_port);
+    return 0;
+  }
+  if (gso_size) {
+    if (!dst) {
+      usage(argv[0]);
+    }
+    flood_gso_send(dst, port, gso_size, gso_segments, seconds, pps);
+    return 0;
+  }
+  if (!ifname || !dst_mac || !dst || mode < 0) {
+    usage(argv[0]);
+  }
+  flood_main(ifname, dst_mac, dst, src_prefix, mode, n_sources, seconds, pps, port, payload_len);
+  return 0;
+}
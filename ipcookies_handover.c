@@ -0,0 +1,207 @@
+/* struct ucred */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "ipcookies.h"
+#include "ipcookies_handover.h"
+
+static int ipcookies_handover_addr(char *path, struct sockaddr_un *sun) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sun->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(sun->sun_path, path);
+  return 0;
+}
+
+/* The effective uid of the process at the other end of the connection */
+static int ipcookies_handover_peer_uid(int conn, uid_t *ret_uid) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    return -1;
+  }
+  *ret_uid = cred.uid;
+  return 0;
+#else
+  gid_t gid;
+  return getpeereid(conn, ret_uid, &gid);
+#endif
+}
+
+int ipcookies_handover_listen(char *path) {
+  struct sockaddr_un sun;
+  mode_t old_umask;
+  int res;
+  int fd;
+
+  if (ipcookies_handover_addr(path, &sun) == -1) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  /* whoever had it before us is gone */
+  unlink(path);
+  /* only our own user may connect; the uid of the peer gets checked too, see below */
+  old_umask = umask(077);
+  res = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+  umask(old_umask);
+  /* the poll() may have seen a connection which is gone by the time we accept it */
+  if (res == -1 || listen(fd, 1) == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int ipcookies_handover_serve(int listen_fd, int icmp_sock, int shm_fd) {
+  ipcookies_handover_msg_t msg;
+  struct iovec iov = { &msg, sizeof(msg) };
+  uint8_t control[CMSG_SPACE(2 * sizeof(int))];
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+  struct timeval tv = { IPCOOKIES_HANDOVER_TIMEOUT_MS / 1000, (IPCOOKIES_HANDOVER_TIMEOUT_MS % 1000) * 1000 };
+  uid_t peer_uid;
+  int conn;
+  int fds[2] = { icmp_sock, shm_fd };
+
+  conn = accept(listen_fd, NULL, NULL);
+  if (conn == -1) {
+    return 0;
+  }
+  /* a successor which hangs midway must not stall us: it gets dropped instead */
+  if (fcntl(conn, F_SETFL, 0) == -1 ||
+      setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+      setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+    close(conn);
+    return 0;
+  }
+  if (recv(conn, &msg, sizeof(msg), MSG_WAITALL) != sizeof(msg) ||
+      msg.magic != IPCOOKIES_HANDOVER_MAGIC || msg.version < 1 ||
+      msg.version > IPCOOKIES_HANDOVER_VERSION) {
+    close(conn);
+    return 0;
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  /* the descriptors give the secret and the raw socket away: only to ourselves */
+  if (ipcookies_handover_peer_uid(conn, &peer_uid) == -1 || peer_uid != geteuid()) {
+    msg.status = EACCES;
+  } else if (msg.version < 2 && msg.state_size != sizeof(ipcookie_full_state_t)) {
+    /* those before version 2 could not migrate the layout */
+    msg.status = EPROTO;
+  } else {
+    msg.status = 0;
+    memset(control, 0, sizeof(control));
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  }
+  msg.state_size = sizeof(ipcookie_full_state_t);
+  if (sendmsg(conn, &mh, 0) != sizeof(msg) || msg.status) {
+    close(conn);
+    return 0;
+  }
+  /* our side of the connection gets closed when we exit, which is the signal to go */
+  return 1;
+}
+
+int ipcookies_handover_request(char *path, int *ret_icmp_sock, int *ret_shm_fd) {
+  ipcookies_handover_msg_t msg;
+  struct iovec iov = { &msg, sizeof(msg) };
+  uint8_t control[CMSG_SPACE(2 * sizeof(int))];
+  struct sockaddr_un sun;
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+  int fds[2] = { -1, -1 };
+  int c;
+  int fd;
+
+  if (ipcookies_handover_addr(path, &sun) == -1) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+    goto fail;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.magic = IPCOOKIES_HANDOVER_MAGIC;
+  msg.version = IPCOOKIES_HANDOVER_VERSION;
+  msg.state_size = sizeof(ipcookie_full_state_t);
+  if (send(fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+    goto fail;
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+  if (recvmsg(fd, &mh, MSG_WAITALL) != sizeof(msg)) {
+    errno = EPROTO;
+    goto fail;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+  }
+  if (msg.status || fds[0] == -1 || fds[1] == -1) {
+    errno = msg.status ? msg.status : EPROTO;
+    goto fail;
+  }
+
+  /* wait for the old instance to let go */
+  while (read(fd, &msg, sizeof(msg)) > 0) {
+  }
+  close(fd);
+  *ret_icmp_sock = fds[0];
+  *ret_shm_fd = fds[1];
+  return 0;
+
+fail:
+  c = errno;
+  if (fds[0] != -1) {
+    close(fds[0]);
+  }
+  if (fds[1] != -1) {
+    close(fds[1]);
+  }
+  close(fd);
+  errno = c;
+  return -1;
+}
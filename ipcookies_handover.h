@@ -0,0 +1,70 @@
+/********************************************************************
+
+The handover of the running cookied to its successor (e.g. on the
+upgrade), without a gap in the processing of the ICMP messages.
+
+The running cookied listens on a Unix socket. A new cookied started
+with the same socket path connects to it and asks for the handover;
+the old one, which by then has finished processing whatever it has
+already read from the ICMP socket, passes over the raw ICMPv6 socket
+itself and the descriptor of the shared memory (SCM_RIGHTS), stops
+touching them and exits. Whatever is still queued in the socket gets
+read by the new instance, which continues with the shared memory as
+it is - the secret and all the cache entries stay.
+
+The socket is only accessible to the user cookied runs as, and the
+old instance also checks that the peer runs as the same (effective)
+user before handing anything over; otherwise the request gets EACCES.
+A connection which does not send its request within
+IPCOOKIES_HANDOVER_TIMEOUT_MS is dropped, so the old instance carries
+on processing the ICMP messages.
+
+The new instance waits for the old one to close the connection before
+it starts, so they never run at the same time, and then takes over
+the listening socket path for the next upgrade.
+
+The new instance migrates the shared memory to its own layout if
+that differs (see ipcookies_segment_prepare()), keeping the state and
+the cache unless their format has changed. It only can while no reader
+is attached, and checks that before it asks for the handover, so
+otherwise it gives up and the old instance keeps running; from the
+check until it has the segment set up, the readers which attach wait
+for it. It opens the shared memory by its name, as the readers do, so
+the descriptor handed over only tells whether it is the same one (and
+the state is live) or not (and the state starts anew). The requests of version 1
+came from the instances which could not do that, so for them the
+handover is refused if the layout differs; the old instance then
+keeps running.
+
+********************************************************************/
+
+#define IPCOOKIES_HANDOVER_MAGIC 0x69706b68   /* "ipkh" */
+#define IPCOOKIES_HANDOVER_VERSION 2
+
+/* How long (in milliseconds) the old side waits for the request of the new one */
+#define IPCOOKIES_HANDOVER_TIMEOUT_MS 1000
+
+typedef struct ipcookies_handover_msg {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t state_size;   /* sizeof(ipcookie_full_state_t) */
+  int32_t status;        /* in the reply: 0 if the descriptors follow, errno otherwise */
+  uint32_t padding;
+} ipcookies_handover_msg_t;
+
+/* The old side: create the listening socket, or -1 */
+int ipcookies_handover_listen(char *path);
+
+/*
+ * The old side, when the listening socket is readable: hand over
+ * the descriptors. Returns 1 if they were handed over and the caller
+ * must stop using them and exit, 0 otherwise.
+ */
+int ipcookies_handover_serve(int listen_fd, int icmp_sock, int shm_fd);
+
+/*
+ * The new side: get the descriptors from the running instance.
+ * Returns 0 on success, -1 with errno set otherwise - ENOENT or
+ * ECONNREFUSED meaning there is nobody to take over from.
+ */
+int ipcookies_handover_request(char *path, int *ret_icmp_sock, int *ret_shm_fd);
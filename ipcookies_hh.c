@@ -0,0 +1,156 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+
+static const int ipcookie_hh_plens[IPCOOKIE_HH_PLEN_COUNT] = IPCOOKIE_HH_PLENS;
+
+void ipcookie_hh_init(ipcookie_hh_t *hh, uint8_t *seed_bytes) {
+  memcpy(hh->seed, seed_bytes, sizeof(hh->seed));
+}
+
+static void ipcookie_hh_mask(struct in6_addr *prefix, struct in6_addr *addr, int plen) {
+  memset(prefix, 0, sizeof(*prefix));
+  memcpy(prefix, addr, plen / 8);
+}
+
+static uint64_t ipcookie_hh_mix(uint64_t x) {
+  /* the splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint32_t ipcookie_hh_index(ipcookie_hh_t *hh, int row, struct in6_addr *prefix) {
+  uint64_t hi, lo;
+  memcpy(&hi, prefix->s6_addr, sizeof(hi));
+  memcpy(&lo, prefix->s6_addr + 8, sizeof(lo));
+  return ipcookie_hh_mix(ipcookie_hh_mix(hi ^ hh->seed[row]) + lo) & (IPCOOKIE_HH_WIDTH - 1);
+}
+
+static void ipcookie_hh_topk_update(ipcookie_hh_level_t *lvl, struct in6_addr *prefix) {
+  int i, min_i = 0;
+
+  if (__atomic_exchange_n(&lvl->topk_lock, 1, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  for (i = 0; i < lvl->topk_used; i++) {
+    if (!memcmp(&lvl->topk[i].prefix, prefix, sizeof(*prefix))) {
+      lvl->topk[i].count++;
+      goto unlock;
+    }
+    if (lvl->topk[i].count < lvl->topk[min_i].count) {
+      min_i = i;
+    }
+  }
+  if (lvl->topk_used < IPCOOKIE_HH_TOPK) {
+    i = lvl->topk_used++;
+    lvl->topk[i].prefix = *prefix;
+    lvl->topk[i].count = 1;
+    lvl->topk[i].error = 0;
+  } else {
+    /* space-saving: the newcomer takes over the smallest one, inheriting its count as the error */
+    lvl->topk[min_i].prefix = *prefix;
+    lvl->topk[min_i].error = lvl->topk[min_i].count;
+    lvl->topk[min_i].count++;
+  }
+unlock:
+  __atomic_store_n(&lvl->topk_lock, 0, __ATOMIC_RELEASE);
+}
+
+void ipcookie_hh_add(ipcookie_hh_t *hh, ipcookie_hh_source_t source, struct in6_addr *addr) {
+  struct in6_addr prefix;
+  int p, row;
+
+  for (p = 0; p < IPCOOKIE_HH_PLEN_COUNT; p++) {
+    ipcookie_hh_level_t *lvl = &hh->level[source][p];
+    ipcookie_hh_mask(&prefix, addr, ipcookie_hh_plens[p]);
+    for (row = 0; row < IPCOOKIE_HH_DEPTH; row++) {
+      __atomic_fetch_add(&lvl->cms[row][ipcookie_hh_index(hh, row, &prefix)], 1, __ATOMIC_RELAXED);
+    }
+    ipcookie_hh_topk_update(lvl, &prefix);
+  }
+}
+
+uint32_t ipcookie_hh_estimate(ipcookie_hh_t *hh, ipcookie_hh_source_t source, ipcookie_hh_plen_t plen,
+                              struct in6_addr *prefix) {
+  ipcookie_hh_level_t *lvl = &hh->level[source][plen];
+  uint32_t est = UINT32_MAX;
+  int row;
+
+  for (row = 0; row < IPCOOKIE_HH_DEPTH; row++) {
+    uint32_t c = __atomic_load_n(&lvl->cms[row][ipcookie_hh_index(hh, row, prefix)], __ATOMIC_RELAXED);
+    if (c < est) {
+      est = c;
+    }
+  }
+  return est;
+}
+
+/* The slow path users of the lock wait; if the holder died with it, take it over after a while */
+static void ipcookie_hh_lock(ipcookie_hh_level_t *lvl) {
+  int tries = 10000;
+  while (__atomic_exchange_n(&lvl->topk_lock, 1, __ATOMIC_ACQUIRE) && --tries > 0) {
+    usleep(10);
+  }
+}
+
+void ipcookie_hh_decay(ipcookie_hh_t *hh) {
+  int s, p, row, i;
+
+  for (s = 0; s < IPCOOKIE_HH_SOURCE_COUNT; s++) {
+    for (p = 0; p < IPCOOKIE_HH_PLEN_COUNT; p++) {
+      ipcookie_hh_level_t *lvl = &hh->level[s][p];
+      for (row = 0; row < IPCOOKIE_HH_DEPTH; row++) {
+        for (i = 0; i < IPCOOKIE_HH_WIDTH; i++) {
+          uint32_t c = __atomic_load_n(&lvl->cms[row][i], __ATOMIC_RELAXED);
+          if (c) {
+            __atomic_store_n(&lvl->cms[row][i], c / 2, __ATOMIC_RELAXED);
+          }
+        }
+      }
+      ipcookie_hh_lock(lvl);
+      for (i = 0; i < lvl->topk_used; i++) {
+        lvl->topk[i].count /= 2;
+        lvl->topk[i].error /= 2;
+      }
+      __atomic_store_n(&lvl->topk_lock, 0, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+static int ipcookie_hh_entry_cmp(const void *a, const void *b) {
+  const ipcookie_hh_entry_t *ea = a, *eb = b;
+  return (ea->count < eb->count) - (ea->count > eb->count);
+}
+
+int ipcookie_hh_topk(ipcookie_hh_t *hh, ipcookie_hh_source_t source, ipcookie_hh_plen_t plen,
+                     ipcookie_hh_entry_t *ret_entries) {
+  ipcookie_hh_level_t *lvl = &hh->level[source][plen];
+  int n;
+
+  ipcookie_hh_lock(lvl);
+  n = lvl->topk_used;
+  memcpy(ret_entries, lvl->topk, n * sizeof(*ret_entries));
+  __atomic_store_n(&lvl->topk_lock, 0, __ATOMIC_RELEASE);
+  qsort(ret_entries, n, sizeof(*ret_entries), ipcookie_hh_entry_cmp);
+  return n;
+}
@@ -0,0 +1,83 @@
+/********************************************************************
+
+The heavy hitters: which addresses and prefixes show up the most
+in the spoofing-related events, with the bounded memory.
+
+There are two sources:
+
+  IPCOOKIE_HH_SPOOF    - the remote sources of the valid
+                         SETCOOKIE-NOT-EXPECTED, i.e. the addresses
+                         someone uses as the spoofed source towards
+                         us: they got our SET-COOKIE for the packets
+                         they never sent
+  IPCOOKIE_HH_NOMATCH  - the remote sources of the packets whose
+                         cookie did not verify
+
+and each is kept at the /128, /64 and /48 granularity.
+
+Each level is a count-min sketch, which gives the estimate for any
+prefix (never under, and over by at most a small fraction of the total
+with a high probability), plus a space-saving top-K list which tracks
+the prefixes themselves. The sketch is updated with the atomic adds,
+so any number of processes can feed it; the top-K list is guarded by
+a try-lock, and if it is busy the update of the list is skipped - it
+is a sample at the flood rates anyway, the sketch counts everything.
+
+The hashes of the sketch are keyed with the seeds which cookied sets
+up from the secret, so the flood can not aim at the specific counters.
+
+cookied halves all the counters every IPCOOKIE_HH_DECAY_INTERVAL
+seconds, so the old events fade away. The halving races with the
+concurrent increments and may lose a few of them, which is fine.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_HH_SPOOF = 0,
+  IPCOOKIE_HH_NOMATCH,
+  IPCOOKIE_HH_SOURCE_COUNT
+} ipcookie_hh_source_t;
+
+#define IPCOOKIE_HH_SOURCE_NAMES { "spoof", "nomatch" }
+
+typedef enum {
+  IPCOOKIE_HH_PLEN_128 = 0,
+  IPCOOKIE_HH_PLEN_64,
+  IPCOOKIE_HH_PLEN_48,
+  IPCOOKIE_HH_PLEN_COUNT
+} ipcookie_hh_plen_t;
+
+#define IPCOOKIE_HH_PLENS { 128, 64, 48 }
+
+#define IPCOOKIE_HH_DEPTH 4
+#define IPCOOKIE_HH_WIDTH 4096      /* must be a power of two */
+#define IPCOOKIE_HH_TOPK 32
+#define IPCOOKIE_HH_DECAY_INTERVAL 60
+
+typedef struct ipcookie_hh_entry {
+  struct in6_addr prefix;
+  uint32_t count;
+  uint32_t error;      /* count may be over by this much */
+} ipcookie_hh_entry_t;
+
+typedef struct ipcookie_hh_level {
+  uint32_t cms[IPCOOKIE_HH_DEPTH][IPCOOKIE_HH_WIDTH];
+  uint32_t topk_lock __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE)));
+  uint32_t topk_used;
+  ipcookie_hh_entry_t topk[IPCOOKIE_HH_TOPK];
+} ipcookie_hh_level_t;
+
+typedef struct ipcookie_hh {
+  uint64_t seed[IPCOOKIE_HH_DEPTH];
+  ipcookie_hh_level_t level[IPCOOKIE_HH_SOURCE_COUNT][IPCOOKIE_HH_PLEN_COUNT];
+} ipcookie_hh_t;
+
+void ipcookie_hh_init(ipcookie_hh_t *hh, uint8_t *seed_bytes);
+void ipcookie_hh_add(ipcookie_hh_t *hh, ipcookie_hh_source_t source, struct in6_addr *addr);
+uint32_t ipcookie_hh_estimate(ipcookie_hh_t *hh, ipcookie_hh_source_t source, ipcookie_hh_plen_t plen,
+                              struct in6_addr *prefix);
+void ipcookie_hh_decay(ipcookie_hh_t *hh);
+
+/* Copy out the top-K list, sorted by the count; returns the number of the entries */
+int ipcookie_hh_topk(ipcookie_hh_t *hh, ipcookie_hh_source_t source, ipcookie_hh_plen_t plen,
+                     ipcookie_hh_entry_t *ret_entries);
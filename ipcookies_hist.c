@@ -0,0 +1,109 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "ipcookies.h"
+
+#ifdef IPCOOKIES_HISTOGRAMS
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#define ipcookie_hist_gettid() ((uint32_t)syscall(SYS_gettid))
+/* the TID is gone from that process, rather than reused by another one */
+#define ipcookie_hist_tid_alive(pid, tid) (syscall(SYS_tgkill, (pid), (tid), 0) == 0 || errno != ESRCH)
+#else
+#define ipcookie_hist_gettid() ((uint32_t)getpid())
+#define ipcookie_hist_tid_alive(pid, tid) (kill((pid), 0) == 0 || errno != ESRCH)
+#endif
+
+static __thread ipcookie_hist_slot_t *ipcookie_hist_my_slot;
+static __thread int ipcookie_hist_my_slot_shared;
+static uint64_t ipcookie_hist_my_pidns;
+static int ipcookie_hist_atfork_registered;
+
+static void ipcookie_hist_atfork_child(void) {
+  /* the slot is the parent's thread's, and the child may be in a new PID namespace */
+  ipcookie_hist_my_slot = NULL;
+  ipcookie_hist_my_slot_shared = 0;
+  ipcookie_hist_my_pidns = 0;
+}
+
+static uint64_t ipcookie_hist_pidns(void) {
+  struct stat st;
+
+  if (!ipcookie_hist_my_pidns && stat("/proc/self/ns/pid", &st) == 0) {
+    ipcookie_hist_my_pidns = st.st_ino;
+  }
+  return ipcookie_hist_my_pidns;
+}
+
+static int ipcookie_hist_owner_is_gone(ipcookie_hist_slot_t *slot, uint64_t owner, uint64_t pidns) {
+  if (owner == 0 || owner == IPCOOKIE_HIST_OWNER_CLAIMING) {
+    return 0;
+  }
+  /* the owner namespace is published before the owner, see the claim below */
+  if (!pidns || __atomic_load_n(&slot->owner_pidns, __ATOMIC_RELAXED) != pidns) {
+    return 0;
+  }
+  return !ipcookie_hist_tid_alive((pid_t)(owner >> 32), (pid_t)(uint32_t)owner);
+}
+
+static void ipcookie_hist_claim_slot(ipcookie_hists_t *hists) {
+  uint64_t me = (uint64_t)(uint32_t)getpid() << 32 | ipcookie_hist_gettid();
+  uint64_t pidns = ipcookie_hist_pidns();
+  int i;
+
+  if (!__atomic_exchange_n(&ipcookie_hist_atfork_registered, 1, __ATOMIC_RELAXED)) {
+    pthread_atfork(NULL, NULL, ipcookie_hist_atfork_child);
+  }
+  for (i = 0; i < IPCOOKIE_HIST_MAX_THREADS - 1; i++) {
+    ipcookie_hist_slot_t *slot = &hists->slots[i];
+    uint64_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+    if ((owner == 0 || ipcookie_hist_owner_is_gone(slot, owner, pidns)) &&
+        __atomic_compare_exchange_n(&slot->owner, &owner, IPCOOKIE_HIST_OWNER_CLAIMING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&slot->owner_pidns, pidns, __ATOMIC_RELAXED);
+      __atomic_store_n(&slot->owner, me, __ATOMIC_RELEASE);
+      ipcookie_hist_my_slot = slot;
+      ipcookie_hist_my_slot_shared = 0;
+      return;
+    }
+  }
+  /* all taken, the last one is for everyone */
+  ipcookie_hist_my_slot = &hists->slots[IPCOOKIE_HIST_MAX_THREADS - 1];
+  ipcookie_hist_my_slot_shared = 1;
+}
+
+void ipcookie_hist_record(ipcookie_hists_t *hists, ipcookie_hist_id_t id, uint64_t ticks) {
+  uint64_t *count;
+
+  if (!ipcookie_hist_my_slot) {
+    ipcookie_hist_claim_slot(hists);
+  }
+  count = &ipcookie_hist_my_slot->counts[id][ipcookie_hist_bucket(ticks)];
+  if (ipcookie_hist_my_slot_shared) {
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+  } else {
+    /* we are the only writer, the reader can live with a torn view */
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  }
+}
+
+#endif
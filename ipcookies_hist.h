@@ -0,0 +1,113 @@
+/********************************************************************
+
+The latency histograms of the hot paths, for the tail latencies.
+
+They are only there if built with IPCOOKIES_HISTOGRAMS defined
+("make HISTOGRAMS=1"), otherwise the recording macros below are
+empty and the histograms are not in the shared memory at all -
+which means cookied, cookiectl and all the shims need to be built
+the same way.
+
+The histograms are HDR-style log-linear: each power of two range
+of values is split into 2^IPCOOKIE_HIST_SUB_BITS linear sub-buckets,
+so the relative error is bounded by 1/2^IPCOOKIE_HIST_SUB_BITS
+across the whole 64-bit range. The values are raw timestamp ticks
+(the TSC on x86), the reader converts them into nanoseconds.
+
+Each thread claims its own slot of histograms in the shared memory
+on the first record, so the recording is a plain, uncontended
+increment. The slots of the threads which are gone get reclaimed
+(keeping their counts); if all the slots are taken, the threads
+share the last one, using the atomic increments.
+
+A slot is owned by the PID and the TID of the thread, in the PID
+namespace of the owner: only the slots owned in the same namespace
+can be found gone (the TIDs of another one mean nothing here), and
+the TID has to be gone from that very process, not merely reused.
+The child of a fork() forgets the slot of its parent's thread and
+claims its own.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_HIST_OUTBOUND_COOKIE = 0,
+  IPCOOKIE_HIST_INBOUND_CHECK_COOKIE,
+  IPCOOKIE_HIST_RECEIVE_ICMP,
+  IPCOOKIE_HIST_COUNT
+} ipcookie_hist_id_t;
+
+#define IPCOOKIE_HIST_NAMES { \
+  "outbound_cookie",          \
+  "inbound_check_cookie",     \
+  "receive_icmp",             \
+}
+
+#ifdef IPCOOKIES_HISTOGRAMS
+
+#define IPCOOKIE_HIST_SUB_BITS 4
+#define IPCOOKIE_HIST_SUB_MASK ((1 << IPCOOKIE_HIST_SUB_BITS) - 1)
+#define IPCOOKIE_HIST_BUCKETS (64 << IPCOOKIE_HIST_SUB_BITS)
+#define IPCOOKIE_HIST_MAX_THREADS 64
+
+/* the owner while the slot is being claimed */
+#define IPCOOKIE_HIST_OWNER_CLAIMING UINT64_MAX
+
+typedef struct ipcookie_hist_slot {
+  uint64_t owner;        /* PID << 32 | TID, zero if free */
+  uint64_t owner_pidns;  /* the PID namespace of the owner, zero if unknown */
+  uint8_t padding[IPCOOKIE_CACHE_LINE_SIZE - 2 * sizeof(uint64_t)];
+  uint64_t counts[IPCOOKIE_HIST_COUNT][IPCOOKIE_HIST_BUCKETS];
+} __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE))) ipcookie_hist_slot_t;
+
+typedef struct ipcookie_hists {
+  ipcookie_hist_slot_t slots[IPCOOKIE_HIST_MAX_THREADS];
+} ipcookie_hists_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ipcookie_hist_now(void) {
+  return __rdtsc();
+}
+#else
+static inline uint64_t ipcookie_hist_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static inline int ipcookie_hist_bucket(uint64_t v) {
+  int shift;
+  if (v < (1 << (IPCOOKIE_HIST_SUB_BITS + 1))) {
+    return v;
+  }
+  shift = 63 - __builtin_clzll(v) - IPCOOKIE_HIST_SUB_BITS;
+  return ((shift + 1) << IPCOOKIE_HIST_SUB_BITS) | ((v >> shift) & IPCOOKIE_HIST_SUB_MASK);
+}
+
+/* The lowest value which falls into the bucket */
+static inline uint64_t ipcookie_hist_bucket_value(int bucket) {
+  int shift;
+  if (bucket < (1 << (IPCOOKIE_HIST_SUB_BITS + 1))) {
+    return bucket;
+  }
+  shift = (bucket >> IPCOOKIE_HIST_SUB_BITS) - 1;
+  return ((uint64_t)((bucket & IPCOOKIE_HIST_SUB_MASK) | (1 << IPCOOKIE_HIST_SUB_BITS))) << shift;
+}
+
+void ipcookie_hist_record(ipcookie_hists_t *hists, ipcookie_hist_id_t id, uint64_t ticks);
+
+#define IPCOOKIE_HIST_START(var) uint64_t var = ipcookie_hist_now()
+/* hists may be NULL: the shim with the histograms, cookied without */
+#define IPCOOKIE_HIST_RECORD(hists, id, var) do { \
+    if (hists) { \
+      ipcookie_hist_record(hists, id, ipcookie_hist_now() - (var)); \
+    } \
+  } while (0)
+
+#else
+
+#define IPCOOKIE_HIST_START(var) do { } while (0)
+#define IPCOOKIE_HIST_RECORD(hists, id, var) do { } while (0)
+
+#endif
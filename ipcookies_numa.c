@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "ipcookies.h"
+
+int ipcookie_numa_nodes(void) {
+  char buf[64];
+  char *p;
+  int nodes = 1;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+
+  if (!f) {
+    return 1;
+  }
+  /* e.g. "0-1", or "0,2-3"; the highest one counts */
+  if (fgets(buf, sizeof(buf), f)) {
+    for (p = buf; *p; p++) {
+      if ((p == buf || p[-1] == '-' || p[-1] == ',') && *p >= '0' && *p <= '9') {
+        nodes = atoi(p) + 1;
+      }
+    }
+  }
+  fclose(f);
+  return nodes > IPCOOKIE_NUMA_MAX_NODES ? IPCOOKIE_NUMA_MAX_NODES : nodes;
+}
+
+#ifdef __linux__
+
+/* Bind the whole pages within [start, start + len) to the node */
+static int ipcookie_numa_bind(void *start, size_t len, int node) {
+  uintptr_t from = ((uintptr_t)start + IPCOOKIE_NUMA_PAGE_SIZE - 1) & ~(uintptr_t)(IPCOOKIE_NUMA_PAGE_SIZE - 1);
+  uintptr_t to = ((uintptr_t)start + len) & ~(uintptr_t)(IPCOOKIE_NUMA_PAGE_SIZE - 1);
+  unsigned long nodemask = 1UL << node;
+
+  if (to <= from) {
+    return -1;
+  }
+  return syscall(SYS_mbind, from, to - from, MPOL_PREFERRED, &nodemask,
+                 sizeof(nodemask) * 8, MPOL_MF_MOVE);
+}
+
+void ipcookie_numa_shard_location(ipcookie_cache_t *cache, int32_t *ret_nodes) {
+  void *pages[IPCOOKIE_CACHE_SHARDS];
+  int status[IPCOOKIE_CACHE_SHARDS];
+  int s;
+
+  for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+    uintptr_t p = (uintptr_t)&cache->slots[s * (IPCOOKIE_CACHE_SIZE / IPCOOKIE_CACHE_SHARDS)];
+    pages[s] = (void *)((p + IPCOOKIE_NUMA_PAGE_SIZE - 1) & ~(uintptr_t)(IPCOOKIE_NUMA_PAGE_SIZE - 1));
+    /* fault it into our page tables, move_pages() only sees those */
+    (void)*(volatile uint8_t *)pages[s];
+  }
+  /* with no target nodes, move_pages() only tells where they are */
+  if (syscall(SYS_move_pages, 0, IPCOOKIE_CACHE_SHARDS, pages, NULL, status, 0) == -1) {
+    for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+      status[s] = -1;
+    }
+  }
+  for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+    ret_nodes[s] = status[s] < 0 ? -1 : status[s];
+  }
+}
+
+#else
+
+static int ipcookie_numa_bind(void *start, size_t len, int node) {
+  errno = ENOSYS;
+  return -1;
+}
+
+void ipcookie_numa_shard_location(ipcookie_cache_t *cache, int32_t *ret_nodes) {
+  int s;
+  for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+    ret_nodes[s] = -1;
+  }
+}
+
+#endif
+
+void ipcookie_numa_invalidate(ipcookie_numa_t *numa) {
+  int n;
+  for (n = 0; n < IPCOOKIE_NUMA_MAX_NODES; n++) {
+    __atomic_store_n(&numa->replicas[n].valid, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void ipcookie_numa_place(ipcookie_full_state_t *ipck) {
+  ipcookie_numa_t *numa = &ipck->numa;
+  int nodes = ipcookie_numa_nodes();
+  size_t shard_buckets = IPCOOKIE_CACHE_BUCKETS / IPCOOKIE_CACHE_SHARDS;
+  int s, n;
+
+  for (s = 0; s < IPCOOKIE_CACHE_SHARDS; s++) {
+    int node = s % nodes;
+    numa->shard_node[s] = -1;
+    if (nodes > 1 &&
+        ipcookie_numa_bind(&ipck->cache.tags[s * shard_buckets],
+                           shard_buckets * sizeof(ipck->cache.tags[0]), node) == 0 &&
+        ipcookie_numa_bind(&ipck->cache.slots[s * shard_buckets * IPCOOKIE_CACHE_BUCKET_SIZE],
+                           shard_buckets * IPCOOKIE_CACHE_BUCKET_SIZE * sizeof(ipck->cache.slots[0]),
+                           node) == 0) {
+      numa->shard_node[s] = node;
+    }
+  }
+  for (n = 0; n < nodes; n++) {
+    if (nodes > 1) {
+      ipcookie_numa_bind(&numa->replicas[n], sizeof(numa->replicas[n]), n);
+    }
+    numa->replicas[n].state = ipck->state;
+    __atomic_store_n(&numa->replicas[n].valid, 1, __ATOMIC_RELEASE);
+  }
+  numa->nodes = nodes;
+}
+
+ipcookie_state_t *ipcookies_view_state(ipcookie_view_t *view) {
+  unsigned int cpu, node = 0;
+
+#ifdef __linux__
+  if (getcpu(&cpu, &node) == -1) {
+    node = 0;
+  }
+#endif
+  if (view->numa && node < __atomic_load_n(&view->numa->nodes, __ATOMIC_RELAXED) &&
+      __atomic_load_n(&view->numa->replicas[node].valid, __ATOMIC_ACQUIRE)) {
+    return &view->numa->replicas[node].state;
+  }
+  return view->state;
+}
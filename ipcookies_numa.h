@@ -0,0 +1,66 @@
+/********************************************************************
+
+The placement of the shared memory on the NUMA hosts.
+
+The cache is split into IPCOOKIE_CACHE_SHARDS shards by the hash of
+the address: a shard is a contiguous range of the buckets (the top
+bits of the bucket index), with its tags and its slots. cookied binds
+the memory of each shard to a node, round robin over the nodes, so
+the cache is spread evenly over the memory of all of them rather than
+being wherever the first touch happened to put it. The binding is
+MPOL_PREFERRED, so a full node still gets the memory elsewhere.
+
+The state (the secret and the epoch), which every cookie operation
+reads and which cookied only writes when it starts, is replicated per
+node, each replica on its own page bound to its node; the shims read
+the replica of the node they run on, see ipcookies_view_state(), and
+the main copy if there is none.
+
+The binding is per page, so the pages straddling two shards stay
+wherever they are; with the huge pages the whole cache is a couple
+of pages, and the shards get bound to whatever node had the first
+touch - cookiectl stats shows where each shard actually is.
+
+Without the NUMA (or outside Linux) there is one node, nothing gets
+bound, and the replica of node 0 is used.
+
+********************************************************************/
+
+#define IPCOOKIE_CACHE_SHARDS 8
+#define IPCOOKIE_NUMA_MAX_NODES 8
+#define IPCOOKIE_NUMA_PAGE_SIZE 4096
+
+typedef struct ipcookie_numa_replica {
+  uint32_t valid;     /* the state below is a copy of the current one */
+  uint32_t padding;
+  ipcookie_state_t state;
+} __attribute__((aligned(IPCOOKIE_NUMA_PAGE_SIZE))) ipcookie_numa_replica_t;
+
+typedef struct ipcookie_numa {
+  uint32_t nodes;                              /* the replicas in use */
+  int32_t shard_node[IPCOOKIE_CACHE_SHARDS];   /* the node each shard is bound to, -1 if not */
+  ipcookie_numa_replica_t replicas[IPCOOKIE_NUMA_MAX_NODES];
+} ipcookie_numa_t;
+
+/* The shard of the bucket */
+#define IPCOOKIE_CACHE_SHARD_OF(bucket) \
+  ((bucket) / (IPCOOKIE_CACHE_BUCKETS / IPCOOKIE_CACHE_SHARDS))
+
+/* The number of the nodes on this host, at least 1 */
+int ipcookie_numa_nodes(void);
+
+/*
+ * cookied: bind the cache shards and the replicas to the nodes, and
+ * copy the current state into the replicas.
+ */
+struct ipcookie_full_state;
+void ipcookie_numa_place(struct ipcookie_full_state *ipck);
+
+/* cookied: the state is about to change, stop using the replicas */
+void ipcookie_numa_invalidate(ipcookie_numa_t *numa);
+
+/*
+ * The node where the first page of each shard's slots is now, or -1;
+ * for cookiectl.
+ */
+void ipcookie_numa_shard_location(ipcookie_cache_t *cache, int32_t *ret_nodes);
@@ -0,0 +1,146 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "ipcookies.h"
+
+#define IP6OPT_PAD1_TYPE 0
+#define IP6OPT_PADN_TYPE 1
+
+ipcookie_option_parse_t ipcookie_option_find_in_dstopts(uint8_t *dstopts, size_t len, uint8_t **ret_cookie) {
+  size_t hdrlen;
+  size_t off = 2;
+
+  if (len < 2) {
+    return IPCOOKIE_OPTION_MALFORMED;
+  }
+  hdrlen = 8 * (1 + (size_t)dstopts[1]);
+  if (hdrlen > len) {
+    return IPCOOKIE_OPTION_MALFORMED;
+  }
+  while (off < hdrlen) {
+    uint8_t *opt = dstopts + off;
+    if (opt[0] == IP6OPT_PAD1_TYPE) {
+      off++;
+      continue;
+    }
+    if (off + 2 > hdrlen || off + 2 + opt[1] > hdrlen) {
+      return IPCOOKIE_OPTION_MALFORMED;
+    }
+    if (opt[0] == IP6OPT_IPCOOKIE) {
+      if ((opt[1] != IP6OPT_IPCOOKIE_LEN) ||
+          (off % IP6OPT_IPCOOKIE_ALIGN_N != IP6OPT_IPCOOKIE_ALIGN_OFF)) {
+        return IPCOOKIE_OPTION_MALFORMED;
+      }
+      *ret_cookie = opt + 2;
+      return IPCOOKIE_OPTION_FOUND;
+    }
+    off += 2 + opt[1];
+  }
+  return IPCOOKIE_OPTION_ABSENT;
+}
+
+ipcookie_option_parse_t ipcookie_option_find(uint8_t *ip6_pkt, size_t len, uint8_t **ret_cookie) {
+  struct ip6_hdr *ip6 = (void *)ip6_pkt;
+  uint8_t nexthdr;
+  size_t off = sizeof(struct ip6_hdr);
+  int i;
+
+  if (len < sizeof(struct ip6_hdr) || (ip6_pkt[0] >> 4) != 6) {
+    return IPCOOKIE_OPTION_MALFORMED;
+  }
+  nexthdr = ip6->ip6_nxt;
+  for (i = 0; i < IPCOOKIE_OPTION_MAX_EXTHDRS; i++) {
+    uint8_t *hdr = ip6_pkt + off;
+    size_t hdrlen;
+
+    if (nexthdr != IPPROTO_HOPOPTS && nexthdr != IPPROTO_ROUTING &&
+        nexthdr != IPPROTO_FRAGMENT && nexthdr != IPPROTO_DSTOPTS &&
+        nexthdr != IPPROTO_AH) {
+      /* upper layer, or something we can not look past */
+      return IPCOOKIE_OPTION_ABSENT;
+    }
+    if (off + 8 > len) {
+      return IPCOOKIE_OPTION_MALFORMED;
+    }
+    switch (nexthdr) {
+      case IPPROTO_FRAGMENT:
+        if (((struct ip6_frag *)hdr)->ip6f_offlg & IP6F_OFF_MASK) {
+          /* not the first fragment, the rest of the chain is not here */
+          return IPCOOKIE_OPTION_ABSENT;
+        }
+        hdrlen = sizeof(struct ip6_frag);
+        break;
+      case IPPROTO_AH:
+        hdrlen = 4 * (2 + (size_t)hdr[1]);
+        break;
+      default:
+        hdrlen = 8 * (1 + (size_t)hdr[1]);
+        break;
+    }
+    if (off + hdrlen > len) {
+      return IPCOOKIE_OPTION_MALFORMED;
+    }
+    if (nexthdr == IPPROTO_DSTOPTS) {
+      ipcookie_option_parse_t res = ipcookie_option_find_in_dstopts(hdr, hdrlen, ret_cookie);
+      if (res != IPCOOKIE_OPTION_ABSENT) {
+        return res;
+      }
+    }
+    nexthdr = hdr[0];
+    off += hdrlen;
+  }
+  return IPCOOKIE_OPTION_ABSENT;
+}
+
+static size_t ipcookie_dstopt_pad(uint8_t *p, size_t npad) {
+  if (npad == 1) {
+    p[0] = IP6OPT_PAD1_TYPE;
+  } else if (npad > 1) {
+    p[0] = IP6OPT_PADN_TYPE;
+    p[1] = npad - 2;
+    memset(p + 2, 0, npad - 2);
+  }
+  return npad;
+}
+
+int ipcookie_dstopt_template_init(ipcookie_dstopt_template_t *tmpl, uint8_t next_header,
+                                  const uint8_t *other_opts, size_t other_opts_len) {
+  size_t off = 2;
+  size_t npad;
+
+  memset(tmpl, 0, sizeof(*tmpl));
+  if (off + other_opts_len + (IP6OPT_IPCOOKIE_ALIGN_N - 1) + 2 + IP6OPT_IPCOOKIE_LEN + 7 > sizeof(tmpl->buf)) {
+    return -1;
+  }
+  tmpl->buf[0] = next_header;
+  if (other_opts_len) {
+    memcpy(tmpl->buf + off, other_opts, other_opts_len);
+    off += other_opts_len;
+  }
+  npad = (IP6OPT_IPCOOKIE_ALIGN_N + IP6OPT_IPCOOKIE_ALIGN_OFF - (off % IP6OPT_IPCOOKIE_ALIGN_N)) % IP6OPT_IPCOOKIE_ALIGN_N;
+  off += ipcookie_dstopt_pad(tmpl->buf + off, npad);
+  tmpl->buf[off] = IP6OPT_IPCOOKIE;
+  tmpl->buf[off + 1] = IP6OPT_IPCOOKIE_LEN;
+  tmpl->cookie_offset = off + 2;
+  off += 2 + IP6OPT_IPCOOKIE_LEN;
+  off += ipcookie_dstopt_pad(tmpl->buf + off, (8 - (off % 8)) % 8);
+  tmpl->len = off;
+  tmpl->buf[1] = (off / 8) - 1;
+  return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef IPCOOKIES_OPTION_H
+#define IPCOOKIES_OPTION_H
+
+/********************************************************************
+
+The cookie itself is carried in the Destination Options header,
+as the following option:
+
+       0                   1                   2                   3
+       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+                                      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+                                      |  Option Type  | Opt Data Len  |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+      |                                                               |
+      +                                                               +
+      |                       Cookie (96 bit)                         |
+      +                                                               +
+      |                                                               |
+      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+Option Type: for the time being the RFC 4727 experimental value 0x1E,
+         "skip over this option" if not recognized, does not change en-route.
+
+Opt Data Len: 12.
+
+The alignment requirement is 4n+2, so the cookie is 32-bit aligned.
+With a single cookie option the Destination Options header is exactly
+16 bytes long and needs no padding.
+
+********************************************************************/
+
+#define IP6OPT_IPCOOKIE 0x1E
+#define IP6OPT_IPCOOKIE_LEN 12
+#define IP6OPT_IPCOOKIE_ALIGN_N 4
+#define IP6OPT_IPCOOKIE_ALIGN_OFF 2
+
+#ifndef __bpf__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/********************************************************************
+
+Finding the cookie in a received packet.
+
+ipcookie_option_find walks the extension header chain of the IPv6
+packet starting at ip6_pkt (the IPv6 header itself), and for each of
+the Destination Options headers on the way looks at the options.
+
+ipcookie_option_find_in_dstopts does the same for a single
+Destination Options header, e.g. as received in IPV6_DSTOPTS
+ancillary data.
+
+Nothing is copied: on IPCOOKIE_OPTION_FOUND the *ret_cookie points
+to the 12 bytes of the cookie within the packet itself.
+
+IPCOOKIE_OPTION_MALFORMED is returned if the cookie option has the
+wrong length or alignment, or if the headers are truncated; such
+a packet should be treated as carrying a cookie which did not verify.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_OPTION_FOUND = 0,
+  IPCOOKIE_OPTION_ABSENT,
+  IPCOOKIE_OPTION_MALFORMED
+} ipcookie_option_parse_t;
+
+/* How many extension headers we are prepared to walk over */
+#define IPCOOKIE_OPTION_MAX_EXTHDRS 8
+
+ipcookie_option_parse_t ipcookie_option_find(uint8_t *ip6_pkt, size_t len, uint8_t **ret_cookie);
+ipcookie_option_parse_t ipcookie_option_find_in_dstopts(uint8_t *dstopts, size_t len, uint8_t **ret_cookie);
+
+/********************************************************************
+
+Building the Destination Options header for sending.
+
+The header is laid out once per socket or flow into a template:
+any other options the caller wants to send, then the padding to
+satisfy the 4n+2 alignment, the cookie option, and the trailing
+padding up to the 8-octet boundary. Per packet only the 12 cookie
+bytes need to be patched in.
+
+The template buffer is usable as is for the IPV6_DSTOPTS ancillary
+data or socket option (where the kernel fills in the Next Header),
+or can be copied into the raw packet with ipcookie_dstopt_template_write.
+
+********************************************************************/
+
+#define IPCOOKIE_DSTOPT_TEMPLATE_MAX 64
+
+typedef struct ipcookie_dstopt_template {
+  uint8_t buf[IPCOOKIE_DSTOPT_TEMPLATE_MAX];
+  uint16_t len;           /* total length of the header, a multiple of 8 */
+  uint16_t cookie_offset; /* where within buf the 12 cookie bytes go */
+} ipcookie_dstopt_template_t;
+
+/*
+ * Returns 0 on success, -1 if the other_opts do not fit.
+ * other_opts may be NULL if other_opts_len is zero.
+ */
+
+int ipcookie_dstopt_template_init(ipcookie_dstopt_template_t *tmpl, uint8_t next_header,
+                                  const uint8_t *other_opts, size_t other_opts_len);
+
+static inline void ipcookie_dstopt_template_patch(ipcookie_dstopt_template_t *tmpl, const uint8_t *cookie) {
+  memcpy(tmpl->buf + tmpl->cookie_offset, cookie, IP6OPT_IPCOOKIE_LEN);
+}
+
+/*
+ * Copy the template with the cookie patched in to dst, which has
+ * to have the room for tmpl->len bytes. Returns tmpl->len.
+ */
+
+static inline size_t ipcookie_dstopt_template_write(ipcookie_dstopt_template_t *tmpl, uint8_t *dst,
+                                                    const uint8_t *cookie) {
+  memcpy(dst, tmpl->buf, tmpl->len);
+  memcpy(dst + tmpl->cookie_offset, cookie, IP6OPT_IPCOOKIE_LEN);
+  return tmpl->len;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "ipcookies.h"
+
+uint32_t ipcookie_policy_lookup(ipcookie_policy_t *policy, struct in6_addr *addr) {
+  ipcookie_policy_table_t *t;
+  uint32_t seq, word, n;
+  int byte;
+
+  if (!policy) {
+    return 0;
+  }
+  for (;;) {
+    t = &policy->tables[__atomic_load_n(&policy->active, __ATOMIC_ACQUIRE) & 1];
+    seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      /* reused by a load since we looked at active */
+      continue;
+    }
+    word = __atomic_load_n(&t->root[(addr->s6_addr[0] << 8) | addr->s6_addr[1]], __ATOMIC_RELAXED);
+    for (byte = IPCOOKIE_POLICY_ROOT_BITS / 8; (word & IPCOOKIE_POLICY_NODE_FLAG) && byte < 16; byte++) {
+      n = word & ~IPCOOKIE_POLICY_NODE_FLAG;
+      if (n >= IPCOOKIE_POLICY_NODES) {
+        /* half written, the seq tells */
+        break;
+      }
+      word = __atomic_load_n(&t->node[n][addr->s6_addr[byte]], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) == seq) {
+      return (word & IPCOOKIE_POLICY_NODE_FLAG) ? 0 : word;
+    }
+  }
+}
+
+static void ipcookie_policy_fill(uint32_t *words, uint32_t first, uint32_t count, uint32_t policy) {
+  uint32_t i;
+  for (i = first; i < first + count; i++) {
+    words[i] = policy;
+  }
+}
+
+/*
+ * Put the rule into the table; the shorter prefixes must be in already,
+ * so the rule only overwrites the words of the shorter (or the same) ones.
+ */
+static int ipcookie_policy_insert(ipcookie_policy_table_t *t, ipcookie_policy_rule_t *rule) {
+  uint8_t *a = rule->prefix.s6_addr;
+  uint32_t *slot, *words;
+  uint32_t span, n;
+  int bits = IPCOOKIE_POLICY_ROOT_BITS;
+
+  if (rule->plen <= IPCOOKIE_POLICY_ROOT_BITS) {
+    span = 1 << (IPCOOKIE_POLICY_ROOT_BITS - rule->plen);
+    ipcookie_policy_fill(t->root, ((a[0] << 8) | a[1]) & ~(span - 1), span, rule->policy);
+    return 0;
+  }
+  slot = &t->root[(a[0] << 8) | a[1]];
+  for (;;) {
+    if (!(*slot & IPCOOKIE_POLICY_NODE_FLAG)) {
+      /* the new node inherits the policy of the shorter prefix */
+      if (t->nodes == IPCOOKIE_POLICY_NODES) {
+        errno = ENOSPC;
+        return -1;
+      }
+      n = t->nodes++;
+      ipcookie_policy_fill(t->node[n], 0, IPCOOKIE_POLICY_NODE_SIZE, *slot);
+      *slot = IPCOOKIE_POLICY_NODE_FLAG | n;
+    }
+    words = t->node[*slot & ~IPCOOKIE_POLICY_NODE_FLAG];
+    if (rule->plen <= bits + 8) {
+      span = 1 << (bits + 8 - rule->plen);
+      ipcookie_policy_fill(words, a[bits / 8] & ~(span - 1), span, rule->policy);
+      return 0;
+    }
+    slot = &words[a[bits / 8]];
+    bits += 8;
+  }
+}
+
+/* The shorter prefixes first, and the rules for the same one in the given order */
+static int ipcookie_policy_rule_cmp(const void *a, const void *b) {
+  ipcookie_policy_rule_t *ra = *(ipcookie_policy_rule_t **)a;
+  ipcookie_policy_rule_t *rb = *(ipcookie_policy_rule_t **)b;
+
+  if (ra->plen != rb->plen) {
+    return ra->plen < rb->plen ? -1 : 1;
+  }
+  return ra < rb ? -1 : ra > rb;
+}
+
+/* Take the writer flag, from a loader that died holding it if need be */
+static int ipcookie_policy_lock(ipcookie_policy_t *policy) {
+  uint32_t holder = 0;
+
+  if (__atomic_compare_exchange_n(&policy->writer, &holder, getpid(), 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  if (kill(holder, 0) == -1 && errno == ESRCH &&
+      __atomic_compare_exchange_n(&policy->writer, &holder, getpid(), 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  errno = EBUSY;
+  return -1;
+}
+
+int ipcookie_policy_load(ipcookie_policy_t *policy, ipcookie_policy_rule_t *rules, int n_rules) {
+  ipcookie_policy_rule_t **sorted = malloc((n_rules + 1) * sizeof(*sorted));
+  ipcookie_policy_table_t *t;
+  uint32_t next;
+  int i, res = 0;
+
+  if (!sorted) {
+    return -1;
+  }
+  if (ipcookie_policy_lock(policy) == -1) {
+    free(sorted);
+    return -1;
+  }
+  /* only now: a load that held the flag until a moment ago may have swapped them */
+  next = !(__atomic_load_n(&policy->active, __ATOMIC_ACQUIRE) & 1);
+  t = &policy->tables[next];
+  for (i = 0; i < n_rules; i++) {
+    sorted[i] = &rules[i];
+  }
+  qsort(sorted, n_rules, sizeof(*sorted), ipcookie_policy_rule_cmp);
+
+  /* the lookups still on this table from before the last swap will retry */
+  __atomic_store_n(&t->seq, t->seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memset(t->root, 0, sizeof(t->root));
+  t->nodes = 0;
+  t->rules = n_rules;
+  for (i = 0; i < n_rules && res == 0; i++) {
+    res = ipcookie_policy_insert(t, sorted[i]);
+  }
+  __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+
+  if (res == 0) {
+    __atomic_store_n(&policy->active, next, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&policy->loads, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&policy->writer, 0, __ATOMIC_RELEASE);
+  free(sorted);
+  return res;
+}
+
+int ipcookie_policy_parse(char *line, ipcookie_policy_rule_t *ret_rule) {
+  char buf[256];
+  char *tok, *save, *slash, *end;
+  uint32_t action = IPCOOKIE_POLICY_DEFAULT;
+  uint32_t exempt = 0;
+  long lifetime_log2 = 0;
+  int i;
+
+  snprintf(buf, sizeof(buf), "%s", line);
+  buf[strcspn(buf, "#")] = 0;
+  if (!(tok = strtok_r(buf, " \t\r\n", &save))) {
+    return 0;
+  }
+  memset(ret_rule, 0, sizeof(*ret_rule));
+  ret_rule->plen = 128;
+  if ((slash = strchr(tok, '/'))) {
+    *slash++ = 0;
+    ret_rule->plen = strtol(slash, &end, 10);
+    if (end == slash || *end || ret_rule->plen > 128) {
+      return -1;
+    }
+  }
+  if (inet_pton(AF_INET6, tok, &ret_rule->prefix) != 1) {
+    return -1;
+  }
+  for (i = 0; i < 16; i++) {
+    int bits = ret_rule->plen - 8 * i;
+    ret_rule->prefix.s6_addr[i] &= bits >= 8 ? 0xFF : bits <= 0 ? 0 : (0xFF00 >> bits) & 0xFF;
+  }
+
+  while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+    if (!strcmp(tok, "exempt")) {
+      exempt = IPCOOKIE_POLICY_EXEMPT;
+      continue;
+    }
+    if (action != IPCOOKIE_POLICY_DEFAULT) {
+      return -1;
+    }
+    if (!strcmp(tok, "use")) {
+      action = IPCOOKIE_POLICY_USE;
+    } else if (!strcmp(tok, "never")) {
+      action = IPCOOKIE_POLICY_NEVER;
+    } else if (!strcmp(tok, "try-later")) {
+      /* the infinite one is "never" */
+      action = IPCOOKIE_POLICY_TRY_LATER;
+      if (!(tok = strtok_r(NULL, " \t\r\n", &save))) {
+        return -1;
+      }
+      lifetime_log2 = strtol(tok, &end, 10);
+      if (end == tok || *end || lifetime_log2 < 0 || lifetime_log2 >= IPCOOKIE_LIFETIME_LOG2_INFINITE) {
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+  }
+  if (action == IPCOOKIE_POLICY_DEFAULT && !exempt) {
+    return -1;
+  }
+  ret_rule->policy = IPCOOKIE_POLICY_MAKE(action, lifetime_log2) | exempt;
+  return 1;
+}
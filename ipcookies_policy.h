@@ -0,0 +1,112 @@
+/********************************************************************
+
+The policy: what to do with the cookies per peer prefix, as loaded by
+the operator (cookiectl policy load) into the shared memory.
+
+Each prefix maps to an action for the new entries of the outbound
+path, which overrides the default_use_ipcookies of the caller:
+
+  use        - send the cookies
+  never      - do not, for as long as the entry lives
+  try-later  - do not for now, but try them after 2^lifetime_log2
+               seconds, as a peer in the fallback would
+
+and/or the exempt flag, which lets the packets from the prefix in
+without checking their cookie (and without the SET-COOKIE back).
+The longest matching prefix wins; a peer matching none gets the
+default of the caller and is not exempt.
+
+The action applies as the entry of the peer is made: the entries
+already in the cache keep theirs until they are evicted or the cache
+is emptied (e.g. by the restart of cookied).
+
+The table is a multibit trie with the leaves pushed down (DIR-16-8):
+the first 16 bits of the address index the root array, and each
+further byte the array of 256 words of a node, until a word with the
+policy itself. A lookup is thus one load for the prefixes up to /16,
+and one more per byte below that - e.g. 7 for a /64 - the first of
+them into the root array, which stays in the cache for the popular
+prefixes. The table has a fixed room for IPCOOKIE_POLICY_NODES nodes.
+
+There are two tables: the lookups use the active one, and a load
+fills the other and then makes it the active one with a single store,
+so the traffic never waits for a load. A lookup which started on the
+table which then got reused by the next load notices that by the
+sequence number of the table, and retries on the new one. Only one
+load at a time: the writer flag.
+
+********************************************************************/
+
+#define IPCOOKIE_POLICY_ROOT_BITS 16
+#define IPCOOKIE_POLICY_ROOT_SIZE (1 << IPCOOKIE_POLICY_ROOT_BITS)
+#define IPCOOKIE_POLICY_NODE_SIZE 256
+#define IPCOOKIE_POLICY_NODES 1024
+
+typedef enum {
+  IPCOOKIE_POLICY_DEFAULT = 0,   /* as the caller says */
+  IPCOOKIE_POLICY_USE,
+  IPCOOKIE_POLICY_NEVER,
+  IPCOOKIE_POLICY_TRY_LATER,
+  IPCOOKIE_POLICY_ACTION_COUNT
+} ipcookie_policy_action_t;
+
+#define IPCOOKIE_POLICY_ACTION_NAMES { "default", "use", "never", "try-later" }
+
+/*
+ * The policy of a prefix, as a word of the table: the action in the
+ * bits 0-3, the lifetime_log2 of try-later in the bits 4-7, and the
+ * flag(s) above. Zero is the default, for the addresses with no rule.
+ */
+#define IPCOOKIE_POLICY_ACTION(policy) ((policy) & 0xF)
+#define IPCOOKIE_POLICY_LIFETIME_LOG2(policy) (((policy) >> 4) & 0xF)
+#define IPCOOKIE_POLICY_EXEMPT 0x100
+#define IPCOOKIE_POLICY_MAKE(action, lifetime_log2) ((action) | ((lifetime_log2) << 4))
+
+/* A word of the table pointing to a node rather than holding a policy */
+#define IPCOOKIE_POLICY_NODE_FLAG 0x80000000
+
+typedef struct ipcookie_policy_table {
+  uint32_t seq;          /* odd while the table is being filled */
+  uint32_t nodes;        /* in use */
+  uint32_t rules;        /* the table was made of */
+  uint32_t padding;
+  uint32_t root[IPCOOKIE_POLICY_ROOT_SIZE] __attribute__((aligned(64)));
+  uint32_t node[IPCOOKIE_POLICY_NODES][IPCOOKIE_POLICY_NODE_SIZE];
+} ipcookie_policy_table_t;
+
+typedef struct ipcookie_policy {
+  uint32_t active;       /* the table the lookups use */
+  uint32_t writer;       /* someone is loading */
+  uint64_t loads;        /* so far */
+  ipcookie_policy_table_t tables[2];
+} ipcookie_policy_t;
+
+/* A rule, as given to the load */
+typedef struct ipcookie_policy_rule {
+  struct in6_addr prefix;
+  uint32_t plen;
+  uint32_t policy;
+} ipcookie_policy_rule_t;
+
+/*
+ * The policy for the address, zero (the default) if policy is NULL,
+ * for the shared memory of the cookied without the policy section.
+ */
+uint32_t ipcookie_policy_lookup(ipcookie_policy_t *policy, struct in6_addr *addr);
+
+/*
+ * Compile the rules (in any order; of the rules for the same prefix,
+ * the last one counts) into the inactive table and make it the active
+ * one. Returns -1 with errno EBUSY if another load is in progress,
+ * or ENOSPC if the rules need more than IPCOOKIE_POLICY_NODES nodes,
+ * and the active table stays as it was.
+ */
+int ipcookie_policy_load(ipcookie_policy_t *policy, ipcookie_policy_rule_t *rules, int n_rules);
+
+/*
+ * Parse a line of the policy file: "<prefix>/<plen> <action>... [# comment]",
+ * where the action is one or both of use|never|try-later <lifetime_log2>
+ * and exempt. Returns 1 and fills in the rule, 0 for an empty line,
+ * -1 for a line that makes no sense.
+ */
+int ipcookie_policy_parse(char *line, ipcookie_policy_rule_t *ret_rule);
@@ -0,0 +1,122 @@
+#ifndef IPCOOKIES_PRF_H
+#define IPCOOKIES_PRF_H
+
+/********************************************************************
+
+The strong PRF used to derive the stateless cookies.
+
+The cookie is the 96 lowest significant bits of SipHash-2-4 (in its
+128-bit output variant), keyed by the first 16 bytes of
+ipcookie_secret, over the following 24-byte message:
+
+   +----------------------------------+--------------------------+
+   |  peer address (16 bytes)         | timestamp (8 bytes, LE)  |
+   +----------------------------------+--------------------------+
+
+Everything here is a self-contained static inline with no libc
+dependencies, so that the very same code can be compiled into
+the userspace library and into the BPF programs (xdp_ipcookies.c),
+which therefore produce bit-identical cookies for the same state.
+
+All the multi-byte quantities are assembled byte by byte in little
+endian order, so the result does not depend on the host byte order.
+
+********************************************************************/
+
+#ifndef __bpf__
+#include <stdint.h>
+#endif
+
+#define IPCOOKIE_PRF_KEY_SIZE 16
+#define IPCOOKIE_PRF_OUT_SIZE 12
+
+static inline uint64_t ipcookie_prf_rotl(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t ipcookie_prf_load64_le(const uint8_t *p) {
+  return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+         ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+         ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+         ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline void ipcookie_prf_store64_le(uint8_t *p, uint64_t v, int nbytes) {
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    p[i] = 0xff & (v >> (8*i));
+  }
+}
+
+#define IPCOOKIE_PRF_SIPROUND(v0, v1, v2, v3)   \
+  do {                                          \
+    v0 += v1; v1 = ipcookie_prf_rotl(v1, 13);   \
+    v1 ^= v0; v0 = ipcookie_prf_rotl(v0, 32);   \
+    v2 += v3; v3 = ipcookie_prf_rotl(v3, 16);   \
+    v3 ^= v2;                                   \
+    v0 += v3; v3 = ipcookie_prf_rotl(v3, 21);   \
+    v3 ^= v0;                                   \
+    v2 += v1; v1 = ipcookie_prf_rotl(v1, 17);   \
+    v1 ^= v2; v2 = ipcookie_prf_rotl(v2, 32);   \
+  } while (0)
+
+#define IPCOOKIE_PRF_COMPRESS(v0, v1, v2, v3, m) \
+  do {                                           \
+    v3 ^= (m);                                   \
+    IPCOOKIE_PRF_SIPROUND(v0, v1, v2, v3);       \
+    IPCOOKIE_PRF_SIPROUND(v0, v1, v2, v3);       \
+    v0 ^= (m);                                   \
+  } while (0)
+
+/*
+ * key: IPCOOKIE_PRF_KEY_SIZE bytes, peer: 16 bytes of the IPv6 address,
+ * out: IPCOOKIE_PRF_OUT_SIZE bytes of the resulting cookie.
+ */
+
+static inline void ipcookie_prf(const uint8_t *key, const uint8_t *peer,
+                                uint64_t timestamp, uint8_t *out) {
+  uint64_t k0 = ipcookie_prf_load64_le(key);
+  uint64_t k1 = ipcookie_prf_load64_le(key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t last = ((uint64_t)24) << 56;
+  uint64_t m;
+  int i;
+
+  m = ipcookie_prf_load64_le(peer);
+  IPCOOKIE_PRF_COMPRESS(v0, v1, v2, v3, m);
+  m = ipcookie_prf_load64_le(peer + 8);
+  IPCOOKIE_PRF_COMPRESS(v0, v1, v2, v3, m);
+  IPCOOKIE_PRF_COMPRESS(v0, v1, v2, v3, timestamp);
+  IPCOOKIE_PRF_COMPRESS(v0, v1, v2, v3, last);
+
+  v2 ^= 0xee;
+  for (i = 0; i < 4; i++) {
+    IPCOOKIE_PRF_SIPROUND(v0, v1, v2, v3);
+  }
+  ipcookie_prf_store64_le(out, v0 ^ v1 ^ v2 ^ v3, 8);
+
+  v1 ^= 0xdd;
+  for (i = 0; i < 4; i++) {
+    IPCOOKIE_PRF_SIPROUND(v0, v1, v2, v3);
+  }
+  ipcookie_prf_store64_le(out + 8, v0 ^ v1 ^ v2 ^ v3, IPCOOKIE_PRF_OUT_SIZE - 8);
+}
+
+/*
+ * The epoch arithmetic shared with ipcookie_get_timestamp_curr():
+ * the biased "now" with its LSBs zeroed out. The PREVIOUS timestamp
+ * is this value minus 2^halflife_log2. The time bias is expected
+ * to be below "now", see ipcookie_state_init().
+ */
+
+static inline int64_t ipcookie_prf_timestamp_curr(uint32_t time_bias,
+                                                  uint8_t halflife_log2, int64_t now) {
+  /* unsigned and a mask rather than %, BPF has no signed modulo */
+  uint64_t biased_now = now - time_bias;
+  return (int64_t)(biased_now & ~((((uint64_t)1) << (1+halflife_log2)) - 1));
+}
+
+#endif
@@ -0,0 +1,52 @@
+/********************************************************************
+
+The static tracepoints (USDT) of the cookie state machine.
+
+These are the <sys/sdt.h> probes (systemtap-sdt-dev on Debian,
+systemtap-sdt-devel on Fedora), under the "ipcookies" provider.
+A probe is a single nop in the code plus an ELF note, so it costs
+nothing until bpftrace or perf attach to it; the arguments are
+only evaluated by the attached tracer. Without <sys/sdt.h>, or with
+IPCOOKIES_NO_PROBES defined, the probes are compiled out.
+
+The peer is always the first argument, as a pointer to the
+16-byte address; the second one is the flags_and_lifetime_log2
+of the cache entry, unless noted otherwise:
+
+  ipcookies:fallback(peer, flags)            entered the fallback mode
+  ipcookies:late_recovery(peer, flags)       renew after the renew time
+  ipcookies:renew(peer, flags)               renew within the renew time
+  ipcookies:setcookie_accepted(peer, lt2)    SET-COOKIE updated the entry
+  ipcookies:setcookie_ignored(peer, reason)  see ipcookie_probe_ignored_t
+  ipcookies:spoof(peer, match)               a SETCOOKIE-NOT-EXPECTED with
+                                             our cookie, match is the
+                                             ipcookie_verify_stateless()
+                                             result
+
+e.g. "perf list sdt_ipcookies:*" after "perf buildid-cache --add",
+or see scripts/fallback_rate.bt.
+
+********************************************************************/
+
+#ifndef IPCOOKIES_PROBES_H
+#define IPCOOKIES_PROBES_H
+
+typedef enum {
+  IPCOOKIE_PROBE_IGNORED_ECHO_MISMATCH = 1,
+  IPCOOKIE_PROBE_IGNORED_NO_ENTRY = 2,
+} ipcookie_probe_ignored_t;
+
+#if !defined(IPCOOKIES_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IPCOOKIES_HAVE_PROBES
+#endif
+#endif
+
+#ifdef IPCOOKIES_HAVE_PROBES
+#define IPCOOKIE_PROBE2(name, arg1, arg2) DTRACE_PROBE2(ipcookies, name, arg1, arg2)
+#else
+#define IPCOOKIE_PROBE2(name, arg1, arg2) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "ipcookies.h"
+#include "ipcookies_snapshot.h"
+
+#define IPCOOKIE_SNAPSHOT_TS_RANGE 0x1000000
+
+static uint64_t ipcookie_snapshot_fnv1a(uint64_t h, void *data, size_t len) {
+  uint8_t *p = data;
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define IPCOOKIE_SNAPSHOT_FNV1A_INIT 0xcbf29ce484222325ULL
+
+int ipcookie_snapshot_save(ipcookie_full_state_t *ipck, char *path) {
+  char tmp_path[PATH_MAX];
+  ipcookie_snapshot_hdr_t hdr;
+  ipcookie_snapshot_entry_t *entries;
+  ipcookie_entry_t *ce;
+  uint64_t csum;
+  FILE *f;
+  int fd;
+
+  /* take the copy first, the cache keeps changing under us */
+  if (posix_memalign((void **)&entries, IPCOOKIE_CACHE_LINE_SIZE, IPCOOKIE_CACHE_SIZE * sizeof(*entries))) {
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IPCOOKIE_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.version = IPCOOKIE_SNAPSHOT_VERSION;
+  hdr.entry_size = sizeof(ipcookie_snapshot_entry_t);
+  hdr.saved_at = time(NULL);
+  hdr.state = ipck->state;
+  for (ce = ipcookie_cache_entry_next(&ipck->cache, NULL); ce && hdr.entry_count < IPCOOKIE_CACHE_SIZE;
+       ce = ipcookie_cache_entry_next(&ipck->cache, ce)) {
+    entries[hdr.entry_count] = *ipcookie_cache_entry_slot(&ipck->cache, ce);
+    if (ipcookie_cache_slot_in_use(&entries[hdr.entry_count])) {
+      hdr.entry_count++;
+    }
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  /* left over by a save that crashed, if there */
+  unlink(tmp_path);
+  /* the state holds the secret: no one else may read it, nor plant a link for us to write through */
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd == -1) {
+    free(entries);
+    return -1;
+  }
+  f = fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    unlink(tmp_path);
+    free(entries);
+    return -1;
+  }
+  csum = ipcookie_snapshot_fnv1a(IPCOOKIE_SNAPSHOT_FNV1A_INIT, &hdr, sizeof(hdr));
+  csum = ipcookie_snapshot_fnv1a(csum, entries, hdr.entry_count * sizeof(*entries));
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(entries, sizeof(*entries), hdr.entry_count, f);
+  fwrite(&csum, sizeof(csum), 1, f);
+  free(entries);
+  if (fflush(f) || ferror(f) || fsync(fileno(f))) {
+    fclose(f);
+    unlink(tmp_path);
+    return -1;
+  }
+  fclose(f);
+  return rename(tmp_path, path);
+}
+
+int ipcookie_snapshot_load(ipcookie_full_state_t *ipck, char *path) {
+  ipcookie_snapshot_hdr_t hdr;
+  ipcookie_snapshot_entry_t *entries = NULL;
+  time_t now = time(NULL);
+  uint64_t csum, file_csum;
+  int i, restored = 0;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, IPCOOKIE_SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != IPCOOKIE_SNAPSHOT_VERSION ||
+      hdr.entry_size != sizeof(ipcookie_snapshot_entry_t) ||
+      hdr.entry_count > IPCOOKIE_CACHE_SIZE) {
+    goto invalid;
+  }
+  if (hdr.saved_at > now || now - hdr.saved_at >= IPCOOKIE_SNAPSHOT_TS_RANGE) {
+    /* the 24-bit mtimes can not be expanded reliably any more */
+    goto invalid;
+  }
+  if (posix_memalign((void **)&entries, IPCOOKIE_CACHE_LINE_SIZE, hdr.entry_count * sizeof(*entries) + 1)) {
+    entries = NULL;
+    goto invalid;
+  }
+  if (fread(entries, sizeof(*entries), hdr.entry_count, f) != hdr.entry_count ||
+      fread(&file_csum, sizeof(file_csum), 1, f) != 1) {
+    goto invalid;
+  }
+  csum = ipcookie_snapshot_fnv1a(IPCOOKIE_SNAPSHOT_FNV1A_INIT, &hdr, sizeof(hdr));
+  csum = ipcookie_snapshot_fnv1a(csum, entries, hdr.entry_count * sizeof(*entries));
+  if (csum != file_csum) {
+    goto invalid;
+  }
+  fclose(f);
+
+  ipck->state = hdr.state;
+  ipcookie_cache_init(&ipck->cache, &ipck->state);
+  for (i = 0; i < hdr.entry_count; i++) {
+    ipcookie_entry_t *ce = &entries[i].entry;
+    time_t mtime = expand_timestamp(hdr.saved_at, ce->mtime_hi8, ce->mtime_lo16);
+    ipcookie_cache_slot_t evicted;
+    if (!ipcookie_cache_slot_in_use(&entries[i]) || now - mtime >= IPCOOKIE_SNAPSHOT_TS_RANGE) {
+      continue;
+    }
+    ipcookie_cache_slot_restore(&ipck->cache, &entries[i], &evicted);
+    restored += !ipcookie_cache_slot_in_use(&evicted);
+  }
+  free(entries);
+  return restored;
+
+invalid:
+  free(entries);
+  fclose(f);
+  errno = EINVAL;
+  return -1;
+}
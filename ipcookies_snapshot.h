@@ -0,0 +1,56 @@
+/********************************************************************
+
+The snapshot of the cookie state and of the peer cache on the disk,
+so that cookied can be restarted without forgetting all the cookies
+learned from the peers (and without changing the secret, so the
+cookies we have handed out stay valid).
+
+The file is the header with the magic, the version, the size of
+an entry (the slot of the cache: the address of the peer, or its hash
+with the compact cache, and the ipcookie_entry_t), the time it was
+saved, the state, and the number of the
+entries, followed by all the non-empty entries, then a 64-bit FNV-1a
+checksum of everything before it. It is written into a temporary file
+which is then renamed over the old one, so a crash during the write
+leaves the previous snapshot intact. The state includes the secret,
+so the file is only readable by its owner.
+
+The entries only carry the low 24 bits of their mtime, so on the load
+they are expanded against the time of the save, and only those still
+within the 24-bit range of the current time are taken. A snapshot
+older than that, or from the future, or from a different build, is
+refused as a whole.
+
+The shims keep running while the snapshot is taken, so an entry
+can be caught halfway through an update; the worst this does is to
+make the peer send us a SET-COOKIE once more after the restart.
+
+********************************************************************/
+
+#define IPCOOKIE_SNAPSHOT_MAGIC "IPCKSNAP"
+#define IPCOOKIE_SNAPSHOT_VERSION 1
+
+typedef struct ipcookie_snapshot_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  int64_t saved_at;
+  ipcookie_state_t state;
+  uint32_t entry_count;
+} ipcookie_snapshot_hdr_t;
+
+/*
+ * The entry as stored: its slot of the cache. The hashes of the compact
+ * cache are keyed by the secret, which the snapshot restores as well.
+ */
+typedef ipcookie_cache_slot_t ipcookie_snapshot_entry_t;
+
+/* Return 0 on success, -1 with errno set on failure */
+int ipcookie_snapshot_save(ipcookie_full_state_t *ipck, char *path);
+
+/*
+ * Restore the state and the cache (emptying it first). Return the number
+ * of the entries restored, or -1 with errno set if there was no usable
+ * snapshot, in which case ipck is left untouched.
+ */
+int ipcookie_snapshot_load(ipcookie_full_state_t *ipck, char *path);
@@ -17,17 +17,20 @@
 #include <fcntl.h>
 
 #include "ipcookies.h"
+#include "ipcookies_prf.h"
 
 time_t ipcookie_get_timestamp_curr(ipcookie_state_t *state, time_t now) {
-  /* we need a biased timestamp to avoid everyone in the world synchronizing */
-  time_t biased_now = now - state->time_bias;
-  /* zero out the LSBs of the biased timestamp */
-  return (biased_now - (biased_now % (1 << (1+state->halflife_log2))));
+  /*
+   * we need a biased timestamp to avoid everyone in the world synchronizing,
+   * then zero out the LSBs of the biased timestamp
+   */
+  return ipcookie_prf_timestamp_curr(state->time_bias, state->halflife_log2, now);
 }
 
 void ipcookie_set_stateless_with_timestamp(ipcookie_state_t *state,
                        ipcookie_t *target_cookie, struct in6_addr *peer, time_t now) {
-  /* strong PRF(state->*, peer, now) needs to go here */
+  /* strong PRF(state->*, peer, now), see ipcookies_prf.h */
+  ipcookie_prf(state->ipcookie_secret, peer->s6_addr, (uint64_t)now, *target_cookie);
 }
 
 ipcookie_match_enum_t ipcookie_verify_stateless(ipcookie_state_t *state,
@@ -35,6 +38,10 @@ ipcookie_match_enum_t ipcookie_verify_stateless(ipcookie_state_t *state,
   time_t now = time(NULL);
   time_t good_timestamp = ipcookie_get_timestamp_curr(state, now);
   ipcookie_t good_cookie;
+  if (!test_cookie) {
+    /* no cookie at all can not match anything */
+    return IPCOOKIE_NOMATCH;
+  }
   ipcookie_set_stateless_with_timestamp(state, &good_cookie, src, good_timestamp);
   if (!memcmp(&good_cookie, test_cookie, sizeof(ipcookie_t))) {
     return IPCOOKIE_MATCH_CURR;
@@ -54,3 +61,19 @@ void ipcookie_set_stateless(ipcookie_state_t *state, ipcookie_t *target_cookie,
                           ipcookie_get_timestamp_curr(state, now));
 }
 
+
+void ipcookie_state_init(ipcookie_state_t *state) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1) {
+    die_perror("ipcookies open /dev/urandom");
+  }
+  if (read(fd, state->ipcookie_secret, sizeof(state->ipcookie_secret)) != sizeof(state->ipcookie_secret)) {
+    die_perror("ipcookies read /dev/urandom");
+  }
+  if (read(fd, &state->time_bias, sizeof(state->time_bias)) != sizeof(state->time_bias)) {
+    die_perror("ipcookies read /dev/urandom");
+  }
+  /* keep the biased timestamp positive, the BPF side uses unsigned arithmetic */
+  state->time_bias &= 0xFFFFFF;
+  close(fd);
+}
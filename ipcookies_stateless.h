@@ -5,6 +5,11 @@ and verification.
 
 ********************************************************************/
 
+/*
+ * Only the first IPCOOKIE_PRF_KEY_SIZE bytes of ipcookie_secret
+ * currently key the PRF, see ipcookies_prf.h.
+ */
+
 typedef struct ipcookie_state {
   /* time biasing to avoid the synchronization between different instances */
   uint32_t time_bias;
@@ -51,14 +56,23 @@ typedef uint8_t ipcookie_t[12];
  *     IPCOOKIE_NOMATCH: not matched
  *     IPCOOKIE_MATCH_PREV: matched the previous cookie
  *     IPCOOKIE_MATCH_CURR: matched the current cookie
+ *  and the inbound check of the shim also:
+ *     IPCOOKIE_ADMITTED: no cookie, let in within the budget of the source
  */
 
 typedef enum {
   IPCOOKIE_NOMATCH = 0,
   IPCOOKIE_MATCH_PREV,
-  IPCOOKIE_MATCH_CURR
+  IPCOOKIE_MATCH_CURR,
+  IPCOOKIE_ADMITTED
 } ipcookie_match_enum_t;
 
 ipcookie_match_enum_t ipcookie_verify_stateless(ipcookie_state_t *state, ipcookie_t *test_cookie, struct in6_addr *src);
 
 void ipcookie_set_stateless(ipcookie_state_t *state, ipcookie_t *target_cookie, struct in6_addr *peer);
+
+/*
+ * Fill in the secret and the time bias with fresh random values.
+ */
+
+void ipcookie_state_init(ipcookie_state_t *state);
@@ -0,0 +1,40 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#define __APPLE_USE_RFC_3542
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <netinet/icmp6.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include "ipcookies.h"
+
+int ipcookie_stats_cpu_slot(void) {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return cpu % IPCOOKIE_STATS_MAX_CPUS;
+  }
+#endif
+  return 0;
+}
+
+uint64_t ipcookie_stat_sum(ipcookie_stats_t *stats, ipcookie_stat_t stat) {
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < IPCOOKIE_STATS_MAX_CPUS; i++) {
+    sum += __atomic_load_n(&stats->cpu[i].counters[stat], __ATOMIC_RELAXED);
+  }
+  return sum;
+}
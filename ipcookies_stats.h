@@ -0,0 +1,98 @@
+/********************************************************************
+
+The statistics counters, kept in the shared memory next to the cache,
+so both cookied and all the shims feed the same set.
+
+Every counter is kept per CPU, and the per-CPU blocks are padded
+to the whole cache lines, so the hot path increments from the
+different CPUs never share a cache line. The reader (cookiectl stats)
+sums them up. The increments are relaxed atomics, since the different
+processes may still land on the same CPU slot.
+
+The hits in the per-thread L1 caches of the shims are not counted in
+cache_lookups, and are added to l1_hits in batches, so that counter
+lags behind by up to a batch per thread.
+
+********************************************************************/
+
+typedef enum {
+  IPCOOKIE_STAT_CACHE_LOOKUPS = 0,
+  IPCOOKIE_STAT_CACHE_MISSES,
+  IPCOOKIE_STAT_CACHE_ALLOCATIONS,
+  IPCOOKIE_STAT_CACHE_EVICTIONS,
+  IPCOOKIE_STAT_VERIFY_CURR,
+  IPCOOKIE_STAT_VERIFY_PREV,
+  IPCOOKIE_STAT_VERIFY_NOMATCH,
+  IPCOOKIE_STAT_SETCOOKIE_SENT,
+  IPCOOKIE_STAT_FALLBACKS_ENTERED,
+  IPCOOKIE_STAT_SPOOF_EVENTS,
+  IPCOOKIE_STAT_L1_HITS,
+  IPCOOKIE_STAT_COLD_DEMOTIONS,
+  IPCOOKIE_STAT_COLD_PROMOTIONS,
+  IPCOOKIE_STAT_INBOUND_EXEMPT,
+  IPCOOKIE_STAT_UNVERIFIED_ADMITTED,
+  IPCOOKIE_STAT_AMP_TRUNCATED,
+  IPCOOKIE_STAT_AMP_REFUSED,
+  IPCOOKIE_STAT_COUNT
+} ipcookie_stat_t;
+
+#define IPCOOKIE_STAT_NAMES { \
+  "cache_lookups",          \
+  "cache_misses",           \
+  "cache_allocations",      \
+  "cache_evictions",        \
+  "verify_curr",            \
+  "verify_prev",            \
+  "verify_nomatch",         \
+  "setcookie_sent",         \
+  "fallbacks_entered",      \
+  "spoof_events",           \
+  "l1_hits",                \
+  "cold_demotions",         \
+  "cold_promotions",        \
+  "inbound_exempt",         \
+  "unverified_admitted",    \
+  "amp_truncated",          \
+  "amp_refused",            \
+}
+
+/*
+ * How the shared memory is backed, as set up by cookied, see
+ * open_ipcookies_shm(). The page size is the effective one: e.g.
+ * THP asked for but disabled for the shared memory by the kernel
+ * shows as the small pages.
+ */
+
+typedef enum {
+  IPCOOKIE_PAGES_SMALL = 0,
+  IPCOOKIE_PAGES_THP,
+  IPCOOKIE_PAGES_HUGETLBFS
+} ipcookie_page_mode_t;
+
+#define IPCOOKIE_PAGE_MODE_NAMES { "small", "thp", "hugetlbfs" }
+
+#define IPCOOKIE_CACHE_LINE_SIZE 64
+#define IPCOOKIE_STATS_MAX_CPUS 256
+
+typedef struct ipcookie_stats_cpu {
+  uint64_t counters[IPCOOKIE_STAT_COUNT];
+} __attribute__((aligned(IPCOOKIE_CACHE_LINE_SIZE))) ipcookie_stats_cpu_t;
+
+typedef struct ipcookie_stats {
+  uint64_t page_size;
+  uint32_t page_mode;    /* ipcookie_page_mode_t */
+  ipcookie_stats_cpu_t cpu[IPCOOKIE_STATS_MAX_CPUS];
+} ipcookie_stats_t;
+
+/* The slot of the CPU we are running on right now */
+int ipcookie_stats_cpu_slot(void);
+
+static inline void ipcookie_stat_add(ipcookie_stats_t *stats, ipcookie_stat_t stat, uint64_t n) {
+  __atomic_fetch_add(&stats->cpu[ipcookie_stats_cpu_slot()].counters[stat], n, __ATOMIC_RELAXED);
+}
+
+static inline void ipcookie_stat_inc(ipcookie_stats_t *stats, ipcookie_stat_t stat) {
+  ipcookie_stat_add(stats, stat, 1);
+}
+
+uint64_t ipcookie_stat_sum(ipcookie_stats_t *stats, ipcookie_stat_t stat);
@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# The spoofed-flood harness: cookied and a shim-enabled UDP sink in a
+# network namespace, the ipcookies_flood generator blasting at them over
+# a veth pair from the outside.
+#
+# Usage (as root, from the top of the tree after "make"):
+#
+#   scripts/netns_flood.sh [<mode> [<seconds> [<pps>]]]
+#
+# where the mode is one of those of ipcookies_flood (default: bogus),
+# pps of 0 means as fast as possible. The extra arguments to the
+# generator may be passed in FLOOD_ARGS, e.g. FLOOD_ARGS="-k 1000".
+#
+# It reports, over the run:
+#   input pps:        the packets received on the namespace side of the veth
+#   processed pps:    the UDP datagrams delivered to the sink, or the ICMP
+#                     messages delivered to cookied's raw socket
+#   ICMP out/input:   the ICMPv6 IP cookie messages (type 66) sent from the
+#                     namespace per input packet
+#   CPU ns/packet:    the user+system CPU of cookied and the sink, and the
+#                     softirq CPU of the whole host, per input packet
+
+set -e
+
+MODE=${1:-bogus}
+SECONDS_RUN=${2:-10}
+PPS=${3:-0}
+
+NS=ipck-flood
+GEN_IF=ipckgen0
+NS_IF=ipckns0
+GEN_ADDR=2001:db8:f100::1
+NS_ADDR=2001:db8:f100::2
+PORT=5353
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+
+cleanup() {
+  [ -n "$SINK_PID" ] && kill "$SINK_PID" 2>/dev/null || true
+  [ -n "$COOKIED_PID" ] && kill "$COOKIED_PID" 2>/dev/null || true
+  ip link del "$GEN_IF" 2>/dev/null || true
+  ip netns del "$NS" 2>/dev/null || true
+}
+trap cleanup EXIT INT TERM
+
+ns_snmp6() {
+  ip netns exec "$NS" awk -v k="$1" '$1 == k { print $2 }' /proc/net/snmp6
+}
+
+ns_raw6_drops() {
+  ip netns exec "$NS" awk 'NR > 1 { d += $NF } END { print d + 0 }' /proc/net/raw6
+}
+
+ns_if_stat() {
+  ip netns exec "$NS" cat "/sys/class/net/$NS_IF/statistics/$1"
+}
+
+proc_cpu_ticks() {
+  # utime + stime
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+host_softirq_ticks() {
+  awk '$1 == "cpu" { print $8 }' /proc/stat
+}
+
+ip netns add "$NS"
+ip link add "$GEN_IF" type veth peer name "$NS_IF"
+ip link set "$NS_IF" netns "$NS"
+ip addr add "$GEN_ADDR/64" dev "$GEN_IF" nodad
+ip link set "$GEN_IF" up
+ip netns exec "$NS" ip link set lo up
+ip netns exec "$NS" ip addr add "$NS_ADDR/64" dev "$NS_IF" nodad
+ip netns exec "$NS" ip link set "$NS_IF" up
+# the replies to the forged sources go back towards the generator
+ip netns exec "$NS" ip -6 route add default via "$GEN_ADDR" dev "$NS_IF"
+
+ip netns exec "$NS" "$TOP/cookied" > /dev/null &
+COOKIED_PID=$!
+ip netns exec "$NS" "$TOP/ipcookies_flood" -r "$PORT" > /dev/null &
+SINK_PID=$!
+sleep 1
+
+NS_MAC=$(ip netns exec "$NS" cat "/sys/class/net/$NS_IF/address")
+
+RX0=$(ns_if_stat rx_packets)
+UDP0=$(ns_snmp6 Udp6InDatagrams)
+ICMPIN0=$(ns_snmp6 Icmp6InMsgs)
+RAWDROP0=$(ns_raw6_drops)
+ICMPOUT0=$(ns_snmp6 Icmp6OutType66)
+CPU0=$(( $(proc_cpu_ticks "$COOKIED_PID") + $(proc_cpu_ticks "$SINK_PID") ))
+SOFTIRQ0=$(host_softirq_ticks)
+
+"$TOP/ipcookies_flood" -i "$GEN_IF" -d "$NS_MAC" -D "$NS_ADDR" -m "$MODE" \
+    -t "$SECONDS_RUN" -p "$PPS" -P "$PORT" $FLOOD_ARGS
+sleep 1
+
+RX1=$(ns_if_stat rx_packets)
+UDP1=$(ns_snmp6 Udp6InDatagrams)
+ICMPIN1=$(ns_snmp6 Icmp6InMsgs)
+RAWDROP1=$(ns_raw6_drops)
+ICMPOUT1=$(ns_snmp6 Icmp6OutType66)
+CPU1=$(( $(proc_cpu_ticks "$COOKIED_PID") + $(proc_cpu_ticks "$SINK_PID") ))
+SOFTIRQ1=$(host_softirq_ticks)
+
+case "$MODE" in
+  setcookie|notexpected)
+    PROCESSED=$(( (ICMPIN1 - ICMPIN0) - (RAWDROP1 - RAWDROP0) ))
+    ;;
+  *)
+    PROCESSED=$(( UDP1 - UDP0 ))
+    ;;
+esac
+
+awk -v mode="$MODE" -v secs="$SECONDS_RUN" -v rx=$((RX1 - RX0)) -v processed="$PROCESSED" \
+    -v icmpout=$(( ${ICMPOUT1:-0} - ${ICMPOUT0:-0} )) -v cpu=$((CPU1 - CPU0)) \
+    -v softirq=$((SOFTIRQ1 - SOFTIRQ0)) -v hz="$(getconf CLK_TCK)" 'BEGIN {
+  if (rx == 0) { rx = 1 }
+  printf "mode:             %s\n", mode
+  printf "input pps:        %.0f\n", rx / secs
+  printf "processed pps:    %.0f\n", processed / secs
+  printf "ICMP out/input:   %.3f\n", icmpout / rx
+  printf "CPU ns/packet:    %.1f (cookied+sink), %.1f (softirq)\n", cpu * 1e9 / hz / rx, softirq * 1e9 / hz / rx
+}'
+
+echo
+"$TOP/cookiectl" stats
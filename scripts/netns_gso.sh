@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# The GSO/GRO test: the ipcookies_flood GSO sender sends the UDP_SEGMENT
+# super-buffers with the cookie attached once per buffer, and the sink,
+# with UDP_GRO on, checks them once per buffer it gets. Two runs:
+#
+#   loopback:  both in one namespace, sharing one cookied
+#   veth:      from one namespace to another over a veth pair, each
+#              with its own cookied (and shared memory), so the cookie
+#              the sink accepts is learned from its SET-COOKIE first
+#
+# Usage (as root, from the top of the tree after "make"):
+#
+#   scripts/netns_gso.sh [<seconds> [<sends per second> [<segments> [<segment size>]]]]
+#
+# Each run reports the segments sent, the datagrams and the buffers
+# the sink got them in (fewer buffers than datagrams: GRO coalesced
+# them; GRO on the veth needs ethtool), and how many of the datagrams
+# verified. It fails unless all the segments arrived, and all of them
+# verified but those sent before the cookie got learned or renewed.
+
+set -e
+
+SECONDS_RUN=${1:-2}
+PPS=${2:-100}
+SEGMENTS=${3:-8}
+SEGMENT_SIZE=${4:-1000}
+
+NS_TX=ipck-gso-tx
+NS_RX=ipck-gso-rx
+TX_IF=ipckgso0
+RX_IF=ipckgso1
+TX_ADDR=2001:db8:f200::1
+RX_ADDR=2001:db8:f200::2
+PORT=5353
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+LOG=$(mktemp -d)
+
+cleanup() {
+  ip netns pids "$NS_TX" 2>/dev/null | xargs -r kill 2>/dev/null || true
+  ip netns pids "$NS_RX" 2>/dev/null | xargs -r kill 2>/dev/null || true
+  ip netns del "$NS_TX" 2>/dev/null || true
+  ip netns del "$NS_RX" 2>/dev/null || true
+  rm -rf "$LOG"
+}
+trap cleanup EXIT INT TERM
+
+ip netns add "$NS_TX"
+ip netns add "$NS_RX"
+ip link add "$TX_IF" netns "$NS_TX" type veth peer name "$RX_IF" netns "$NS_RX"
+ip netns exec "$NS_TX" ip link set lo up
+ip netns exec "$NS_RX" ip link set lo up
+ip netns exec "$NS_TX" ip addr add "$TX_ADDR/64" dev "$TX_IF" nodad
+ip netns exec "$NS_RX" ip addr add "$RX_ADDR/64" dev "$RX_IF" nodad
+ip netns exec "$NS_TX" ip link set "$TX_IF" up
+ip netns exec "$NS_RX" ip link set "$RX_IF" up
+if command -v ethtool > /dev/null; then
+  ip netns exec "$NS_RX" ethtool -K "$RX_IF" gro on || true
+fi
+
+# each namespace gets its own /dev/shm, so its own cookied and secret:
+# "ip netns exec" runs everything in a mount namespace of its own
+ip netns exec "$NS_RX" sh -c "
+  mount -t tmpfs tmpfs /dev/shm &&
+  '$TOP/cookied' > /dev/null &
+  sleep 1
+  exec '$TOP/ipcookies_flood' -r '$PORT'" > "$LOG/sink" &
+SINK_PID=$!
+# until its first report
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -s "$LOG/sink" ] && break
+  sleep 0.5
+done
+
+FAILED=0
+
+# <name> <destination> <command to enter the namespace with> <setup>
+gso_run() {
+  NAME=$1
+  DST=$2
+  ENTER=$3
+  SETUP=$4
+
+  BEFORE=$(tail -n 1 "$LOG/sink")
+  $ENTER sh -c "
+    $SETUP
+    exec '$TOP/ipcookies_flood' -g '$SEGMENT_SIZE' -n '$SEGMENTS' -D '$DST' \
+        -t '$SECONDS_RUN' -p '$PPS' -P '$PORT'" > "$LOG/$NAME"
+  sleep 2
+  AFTER=$(tail -n 1 "$LOG/sink")
+  SENDS=$(awk '{ print $3 }' "$LOG/$NAME")
+
+  # the sink prints its running totals every second
+  echo "$BEFORE" "$AFTER" | awk -v name="$NAME" -v sent=$((SENDS * SEGMENTS)) -v segs="$SEGMENTS" -v secs="$SECONDS_RUN" '{
+    datagrams = $16 - $3; buffers = $18 - $5; curr = $20 - $7; prev = $22 - $9
+    # the veth sender gets the SET-COOKIE back within a few sends, and
+    # while the entry lifetime is short a buffer per second renews it
+    ok = (datagrams == sent && curr + prev >= sent - (secs + 5) * segs)
+    printf "%-10s %6d segments sent, %6d datagrams in %6d buffers, %6d verified: %s\n",
+           name, sent, datagrams, buffers, curr + prev, ok ? "ok" : "FAIL"
+    exit !ok
+  }' || FAILED=1
+}
+
+# the loopback sender joins the sink in its namespaces, /dev/shm included
+gso_run loopback ::1 "nsenter -t $SINK_PID -n -m" ""
+gso_run veth "$RX_ADDR" "ip netns exec $NS_TX" "
+  mount -t tmpfs tmpfs /dev/shm &&
+  '$TOP/cookied' > /dev/null &
+  sleep 1"
+
+exit $FAILED
@@ -2,6 +2,8 @@
 #include <sys/socket.h>
 #define __APPLE_USE_RFC_3542
 #include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -18,27 +20,45 @@
 
 #include "ipcookies.h"
 #include "shim_ipcookies.h"
+#include "ipcookies_probes.h"
 
-void ipcookie_entry_enter_fallback_mode(ipcookie_entry_t *ce) {
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+
+/* In the single writer mode (cookied -w), see ipcookies_cmds.h */
+static inline int ipcookies_shim_single_writer(void *ipck) {
+  return (((ipcookie_view_t *)ipck)->incompat_features & IPCOOKIE_FEATURE_SINGLE_WRITER) != 0;
+}
+
+void ipcookie_entry_enter_fallback_mode(ipcookie_entry_t *ce, struct in6_addr *peer) {
   ipcookie_entry_set_disable_cookies(ce);
   ipcookie_entry_update_mtime(ce);
   ipcookie_entry_set_lifetime_log2(ce, IPCOOKIE_FALLBACK_LT2);
+  IPCOOKIE_PROBE2(fallback, peer->s6_addr, ce->flags_and_lifetime_log2);
 }
 
-void ipcookie_entry_enter_late_recovery_mode(ipcookie_entry_t *ce) {
+void ipcookie_entry_enter_late_recovery_mode(ipcookie_entry_t *ce, struct in6_addr *peer) {
   ipcookie_entry_set_expecting_setcookie(ce);
   ipcookie_entry_mtime_backdate_by_lifetime_log2(ce);
+  IPCOOKIE_PROBE2(late_recovery, peer->s6_addr, ce->flags_and_lifetime_log2);
 }
 
-void ipcookie_entry_past_renew_with_cookie(ipcookie_entry_t *ce, struct in6_addr *peer, void **ret_cookie) {
+void ipcookie_entry_past_renew_with_cookie(void *ipck, ipcookie_entry_t *ce, struct in6_addr *peer, void **ret_cookie) {
   if(ipcookie_entry_isset_expecting_setcookie(ce)) {
-    ipcookie_entry_enter_fallback_mode(ce);
+    ipcookie_entry_enter_fallback_mode(ce, peer);
+    /* in the single writer mode, cookied tells when it does it */
+    if (!ipcookies_shim_single_writer(ipck)) {
+      ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_FALLBACKS_ENTERED);
+      ipcookie_event_log(((ipcookie_view_t *)ipck)->events, IPCOOKIE_EVENT_FALLBACK,
+                         ce->flags_and_lifetime_log2, peer, ce->ipcookie);
+    }
   } else {
-    ipcookie_entry_enter_late_recovery_mode(ce);
+    ipcookie_entry_enter_late_recovery_mode(ce, peer);
   }
 }
 
-void ipcookie_entry_within_renew_with_cookie(ipcookie_entry_t *ce) {
+void ipcookie_entry_within_renew_with_cookie(ipcookie_entry_t *ce, struct in6_addr *peer) {
   /*
    * If the expecting cookie flag is not set, set it
    * and rewind the mtime so that we wait for
@@ -48,10 +68,11 @@ void ipcookie_entry_within_renew_with_cookie(ipcookie_entry_t *ce) {
   if (!ipcookie_entry_isset_expecting_setcookie(ce)) {
     ipcookie_entry_set_expecting_setcookie(ce);
     ipcookie_entry_mtime_backdate_by_lifetime_log2(ce);
+    IPCOOKIE_PROBE2(renew, peer->s6_addr, ce->flags_and_lifetime_log2);
   }
 }
 
-void ipcookies_shim_outbound_ipcookie_entry_exists(ipcookie_entry_t *ce, struct in6_addr *peer, void **ret_cookie) {
+void ipcookies_shim_outbound_ipcookie_entry_exists(void *ipck, ipcookie_entry_t *ce, struct in6_addr *peer, void **ret_cookie) {
   int ts_check = check_ipcookie_entry_timestamp(ce);
   if(ipcookie_entry_isset_disable_cookies(ce)) {
     switch(ts_check) {
@@ -72,65 +93,374 @@ void ipcookies_shim_outbound_ipcookie_entry_exists(ipcookie_entry_t *ce, struct
 	/* do nothing */
 	break;
       case IPCOOKIE_TS_RENEW_TIME:
-	ipcookie_entry_within_renew_with_cookie(ce);
+	ipcookie_entry_within_renew_with_cookie(ce, peer);
 	break;
       case IPCOOKIE_TS_PAST_RENEW_TIME:
-        ipcookie_entry_past_renew_with_cookie(ce, peer, ret_cookie);
+        ipcookie_entry_past_renew_with_cookie(ipck, ce, peer, ret_cookie);
 	break;
     }
   }
 }
 
-ipcookie_entry_t *ipcookies_shim_outbound_no_ipcookie_entry(void *ipck, int default_use_ipcookies, struct in6_addr *peer, void **ret_cookie) {
-  ipcookie_entry_t *ce = ipcookie_cache_entry_allocate(&((ipcookie_full_state_t *)ipck)->cache, peer);
-  if (ce) {
-    if (default_use_ipcookies) {
-      ipcookie_entry_clear_disable_cookies(ce);
-      ipcookie_entry_set_expecting_setcookie(ce);
-      ipcookie_entry_set_lifetime_log2(ce, 0);
-      ipcookie_set_stateless(&((ipcookie_full_state_t *)ipck)->state, &ce->ipcookie, peer);
+/* The entry for a peer we have not had one for, as the policy for it says */
+void ipcookies_shim_outbound_new_ipcookie_entry(void *ipck, ipcookie_entry_t *ce, int default_use_ipcookies, struct in6_addr *peer) {
+  uint32_t policy = ipcookie_policy_lookup(((ipcookie_view_t *)ipck)->policy, peer);
+  int lifetime_log2 = IPCOOKIE_LIFETIME_LOG2_INFINITE;
+
+  switch (IPCOOKIE_POLICY_ACTION(policy)) {
+    case IPCOOKIE_POLICY_USE:
+      default_use_ipcookies = 1;
+      break;
+    case IPCOOKIE_POLICY_NEVER:
+      default_use_ipcookies = 0;
+      break;
+    case IPCOOKIE_POLICY_TRY_LATER:
+      default_use_ipcookies = 0;
+      lifetime_log2 = IPCOOKIE_POLICY_LIFETIME_LOG2(policy);
+      break;
+  }
+  if (default_use_ipcookies) {
+    ipcookie_entry_clear_disable_cookies(ce);
+    ipcookie_entry_set_expecting_setcookie(ce);
+    ipcookie_entry_set_lifetime_log2(ce, 0);
+    ipcookie_set_stateless(ipcookies_view_state((ipcookie_view_t *)ipck), &ce->ipcookie, peer);
+  } else {
+    ipcookie_entry_set_disable_cookies(ce);
+    ipcookie_entry_clear_expecting_setcookie(ce);
+    ipcookie_entry_set_lifetime_log2(ce, lifetime_log2);
+    if (lifetime_log2 != IPCOOKIE_LIFETIME_LOG2_INFINITE) {
+      /* the cookie it goes out with once the lifetime is up: not a guessable one */
+      ipcookie_set_stateless(ipcookies_view_state((ipcookie_view_t *)ipck), &ce->ipcookie, peer);
     } else {
-      ipcookie_entry_set_disable_cookies(ce);
-      ipcookie_entry_clear_expecting_setcookie(ce);
-      ipcookie_entry_set_lifetime_log2(ce, IPCOOKIE_LIFETIME_LOG2_INFINITE);
       memset(ce->ipcookie, 0, sizeof(ce->ipcookie));
     }
-    ipcookie_entry_update_mtime(ce);
   }
-  return ce;
+  ipcookie_entry_update_mtime(ce);
 }
 
-int ipcookies_shim_outbound_cookie(void *ipck, int default_use_ipcookies, struct in6_addr *peer, void **ret_cookie) {
-  ipcookie_entry_t *ce = ipcookie_cache_entry_find_by_address(&((ipcookie_full_state_t *)ipck)->cache, peer);
+ipcookie_entry_t *ipcookies_shim_outbound_no_ipcookie_entry(void *ipck, int default_use_ipcookies, struct in6_addr *peer, void **ret_cookie) {
+  ipcookie_cmds_t *cmds = ((ipcookie_view_t *)ipck)->cmds;
+  ipcookie_cache_slot_t evicted;
+  ipcookie_entry_t *ce = ipcookie_cache_entry_allocate(((ipcookie_view_t *)ipck)->cache, peer, &evicted);
+  if (ipcookie_cache_slot_in_use(&evicted)) {
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_CACHE_EVICTIONS);
+    if (cmds && ipcookie_cache_slot_peer(&evicted)) {
+      /* for the cold tier */
+      ipcookie_cmd_post(cmds, IPCOOKIE_CMD_DEMOTE, ipcookie_cache_slot_peer(&evicted), NULL, &evicted.entry);
+    }
+  }
   if (ce) {
-    ipcookies_shim_outbound_ipcookie_entry_exists(ce, peer, ret_cookie);
-  } else {
-    ce = ipcookies_shim_outbound_no_ipcookie_entry(ipck, default_use_ipcookies, peer, ret_cookie);
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_CACHE_ALLOCATIONS);
+    ipcookies_shim_outbound_new_ipcookie_entry(ipck, ce, default_use_ipcookies, peer);
+    if (cmds) {
+      /* the cold tier may have a better one */
+      ipcookie_cmd_post(cmds, IPCOOKIE_CMD_PROMOTE, peer, ce, NULL);
+    }
   }
+  return ce;
+}
+
+/*
+ * The single writer mode, see ipcookies_cmds.h: do to a copy of the
+ * entry what the above would do to it, and have cookied do the same
+ * to the real one. The copy is what the packet goes out with; its
+ * cookie must stay put until the caller is done with it, so the copy
+ * is per thread, and valid until the next call.
+ */
+static __thread ipcookie_entry_t ipcookies_shim_pending_entry;
+
+ipcookie_entry_t *ipcookies_shim_outbound_post(void *ipck, ipcookie_entry_t *ce, int default_use_ipcookies,
+                                               struct in6_addr *peer, void **ret_cookie) {
+  ipcookie_entry_t *pending = &ipcookies_shim_pending_entry;
+
   if (ce) {
-    if(ipcookie_entry_isset_disable_cookies(ce)) {
-      return 0;
-    } else {
-      *ret_cookie = ce->ipcookie;
-      return 1;
+    ipcookie_entry_t observed = *ce;
+    *pending = observed;
+    ipcookies_shim_outbound_ipcookie_entry_exists(ipck, pending, peer, ret_cookie);
+    if (memcmp(pending, &observed, sizeof(observed))) {
+      ipcookie_cmd_post(((ipcookie_view_t *)ipck)->cmds, IPCOOKIE_CMD_UPDATE, peer, &observed, pending);
     }
   } else {
+    memset(pending, 0, sizeof(*pending));
+    ipcookies_shim_outbound_new_ipcookie_entry(ipck, pending, default_use_ipcookies, peer);
+    ipcookie_cmd_post(((ipcookie_view_t *)ipck)->cmds, IPCOOKIE_CMD_ALLOCATE, peer, NULL, pending);
+  }
+  return pending;
+}
+
+/********************************************************************
+
+The per-thread L1 cache in front of the shared one.
+
+Most of the packets go to a peer whose entry is IPCOOKIE_TS_STILL_VALID,
+and for those the outbound path changes nothing in the entry. Each
+thread thus remembers, in a small direct-mapped table, the entries it
+has last seen in that state: the peer, the entry, the generation of
+the shared cache, the mtime and flags of the entry as they were, and
+the second at which the entry stops being still valid.
+
+A hit there is only trusted while all of that holds: the cache was
+not emptied since (the generation), the slot still has the same peer
+(it was not evicted and reused), the mtime and the flags did not
+change (nobody renewed, disabled or re-enabled it) and the entry did
+not get too old. The cookie itself is then read from the shared entry,
+so a hit does no writes to the shared memory at all - the hits are
+counted per thread and only added to the l1_hits counter in batches.
+
+Anything else goes the full way through the shared cache, which
+refills the L1 entry if the result is still valid.
+
+********************************************************************/
+
+#define IPCOOKIE_L1_SIZE 256          /* a power of two */
+#define IPCOOKIE_L1_STATS_BATCH 256
+
+typedef struct ipcookie_l1_entry {
+  struct in6_addr peer;
+  void *ipck;                 /* the shared memory the entry is in, NULL if unused */
+  ipcookie_entry_t *ce;
+  uint32_t generation;        /* of the shared cache */
+  uint32_t entry_head;        /* the mtime and the flags of the entry */
+  time_t valid_until;
+} ipcookie_l1_entry_t;
+
+static __thread ipcookie_l1_entry_t ipcookie_l1[IPCOOKIE_L1_SIZE];
+static __thread uint32_t ipcookie_l1_hits;   /* not yet added to the stats */
+
+static inline ipcookie_l1_entry_t *ipcookie_l1_entry(struct in6_addr *peer) {
+  uint32_t a[4];
+  memcpy(a, peer, sizeof(a));
+  return &ipcookie_l1[((a[0] ^ a[1] ^ a[2] ^ a[3]) * 0x9E3779B1) >> 24 & (IPCOOKIE_L1_SIZE - 1)];
+}
+
+/* The mtime and the flags (with the lifetime) of the entry, as one word */
+static inline uint32_t ipcookie_l1_entry_head(ipcookie_entry_t *ce) {
+  uint32_t head;
+  memcpy(&head, ce, sizeof(head));
+  return head;
+}
+
+static void ipcookie_l1_fill(ipcookie_l1_entry_t *l1, void *ipck, ipcookie_entry_t *ce,
+                             struct in6_addr *peer, time_t now) {
+  l1->peer = *peer;
+  l1->ipck = ipck;
+  l1->ce = ce;
+  l1->generation = __atomic_load_n(&((ipcookie_view_t *)ipck)->cache->generation, __ATOMIC_RELAXED);
+  l1->entry_head = ipcookie_l1_entry_head(ce);
+  l1->valid_until = ipcookie_entry_valid_until(ce, now);
+}
+
+static inline int ipcookie_l1_valid(ipcookie_l1_entry_t *l1, void *ipck, struct in6_addr *peer, time_t now) {
+  ipcookie_cache_t *cache = ((ipcookie_view_t *)ipck)->cache;
+  return l1->ipck == ipck && now < l1->valid_until &&
+         !memcmp(&l1->peer, peer, sizeof(*peer)) &&
+         l1->generation == __atomic_load_n(&cache->generation, __ATOMIC_RELAXED) &&
+         l1->entry_head == ipcookie_l1_entry_head(l1->ce) &&
+         ipcookie_cache_entry_is_for(cache, l1->ce, peer);
+}
+
+int ipcookies_shim_outbound_cookie(void *ipck, int default_use_ipcookies, struct in6_addr *peer, void **ret_cookie) {
+  IPCOOKIE_HIST_START(t_start);
+  ipcookie_l1_entry_t *l1 = ipcookie_l1_entry(peer);
+  time_t now = time(NULL);
+  ipcookie_entry_t *ce;
+  int res = 0;
+
+  if (!ipck) {
+    /* no shared memory we could use, see mmap_ipcookies(): no cookies */
     return 0;
   }
+
+  if (ipcookie_l1_valid(l1, ipck, peer, now)) {
+    ce = l1->ce;
+    if (++ipcookie_l1_hits == IPCOOKIE_L1_STATS_BATCH) {
+      ipcookie_stat_add(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_L1_HITS, ipcookie_l1_hits);
+      ipcookie_l1_hits = 0;
+    }
+  } else {
+    /* cookied may have restarted in the other mode meanwhile */
+    ipcookies_view_refresh(ipck);
+    ce = ipcookie_cache_entry_find_by_address(((ipcookie_view_t *)ipck)->cache, peer);
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_CACHE_LOOKUPS);
+    if (!ce) {
+      ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_CACHE_MISSES);
+    }
+    if (ipcookies_shim_single_writer(ipck)) {
+      if (ce) {
+        /* the L1 entry is only of use once cookied has made it still valid */
+        ipcookie_l1_fill(l1, ipck, ce, peer, now);
+      }
+      ce = ipcookies_shim_outbound_post(ipck, ce, default_use_ipcookies, peer, ret_cookie);
+    } else {
+      if (ce) {
+        ipcookies_shim_outbound_ipcookie_entry_exists(ipck, ce, peer, ret_cookie);
+      } else {
+        ce = ipcookies_shim_outbound_no_ipcookie_entry(ipck, default_use_ipcookies, peer, ret_cookie);
+      }
+      if (ce) {
+        ipcookie_l1_fill(l1, ipck, ce, peer, now);
+      }
+    }
+  }
+  if (ce && !ipcookie_entry_isset_disable_cookies(ce)) {
+    *ret_cookie = ce->ipcookie;
+    res = 1;
+  }
+  IPCOOKIE_HIST_RECORD(((ipcookie_view_t *)ipck)->hists, IPCOOKIE_HIST_OUTBOUND_COOKIE, t_start);
+  return res;
 }
 
-int ipcookies_shim_inbound_check_cookie(void *ipck, struct in6_addr *peer, void *cookie) {
+/* The segments of a GRO buffer share the cookie, but each takes from the budgets */
+static int ipcookies_shim_inbound_check_segments(void *ipck, struct in6_addr *peer, void *cookie, int segments) {
+  IPCOOKIE_HIST_START(t_start);
   ipcookie_t requested_cookie;
-  int res = ipcookie_verify_stateless(&((ipcookie_full_state_t *)ipck)->state, cookie, peer);
+  int res;
+  static const ipcookie_stat_t verify_stats[] = {
+    [IPCOOKIE_NOMATCH] = IPCOOKIE_STAT_VERIFY_NOMATCH,
+    [IPCOOKIE_MATCH_PREV] = IPCOOKIE_STAT_VERIFY_PREV,
+    [IPCOOKIE_MATCH_CURR] = IPCOOKIE_STAT_VERIFY_CURR,
+  };
 
+  if (!ipck) {
+    /* nothing to verify against, let it in as if there were no cookies */
+    return IPCOOKIE_ADMITTED;
+  }
+  if (ipcookie_policy_lookup(((ipcookie_view_t *)ipck)->policy, peer) & IPCOOKIE_POLICY_EXEMPT) {
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_INBOUND_EXEMPT);
+    IPCOOKIE_HIST_RECORD(((ipcookie_view_t *)ipck)->hists, IPCOOKIE_HIST_INBOUND_CHECK_COOKIE, t_start);
+    return IPCOOKIE_MATCH_CURR;
+  }
+  if (!cookie && ipcookie_budget_admit(((ipcookie_view_t *)ipck)->budget, peer, segments)) {
+    ipcookie_stat_add(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_UNVERIFIED_ADMITTED, segments);
+    IPCOOKIE_HIST_RECORD(((ipcookie_view_t *)ipck)->hists, IPCOOKIE_HIST_INBOUND_CHECK_COOKIE, t_start);
+    return IPCOOKIE_ADMITTED;
+  }
+  res = ipcookie_verify_stateless(ipcookies_view_state((ipcookie_view_t *)ipck), cookie, peer);
+  ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, verify_stats[res]);
+  if (res == IPCOOKIE_NOMATCH && cookie) {
+    /* a wrong cookie, rather than no cookie at all */
+    ipcookie_hh_add(((ipcookie_view_t *)ipck)->hh, IPCOOKIE_HH_NOMATCH, peer);
+  }
   if (res < IPCOOKIE_MATCH_CURR) {
     /* Either no match or the match on prev cookie, build and send SET-COOKIE */
-    ipcookie_set_stateless(&((ipcookie_full_state_t *)ipck)->state, &requested_cookie, peer);
+    ipcookie_set_stateless(ipcookies_view_state((ipcookie_view_t *)ipck), &requested_cookie, peer);
     ipcookies_icmp_send(ICMP6_IC_SET_COOKIE, cookie, &requested_cookie, peer);
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_SETCOOKIE_SENT);
   }
+  IPCOOKIE_HIST_RECORD(((ipcookie_view_t *)ipck)->hists, IPCOOKIE_HIST_INBOUND_CHECK_COOKIE, t_start);
   return res;
 }
 
+int ipcookies_shim_inbound_check_cookie(void *ipck, struct in6_addr *peer, void *cookie) {
+  return ipcookies_shim_inbound_check_segments(ipck, peer, cookie, 1);
+}
+
+int ipcookies_shim_inbound_response(void *ipck, struct in6_addr *peer, size_t received_bytes,
+                                    size_t response_bytes, size_t min_bytes, size_t *ret_allowed) {
+  int verdict;
+
+  if (!ipck) {
+    *ret_allowed = response_bytes;
+    return IPCOOKIE_AMP_OK;
+  }
+  verdict = ipcookie_budget_respond(((ipcookie_view_t *)ipck)->budget, peer, received_bytes,
+                                    response_bytes, min_bytes, ret_allowed);
+  if (verdict == IPCOOKIE_AMP_TRUNCATE) {
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_AMP_TRUNCATED);
+  } else if (verdict == IPCOOKIE_AMP_REFUSE) {
+    ipcookie_stat_inc(((ipcookie_view_t *)ipck)->stats, IPCOOKIE_STAT_AMP_REFUSED);
+  }
+  return verdict;
+}
+
+int ipcookies_shim_inbound_check_packet(void *ipck, uint8_t *ip6_pkt, size_t len) {
+  struct ip6_hdr *ip6 = (void *)ip6_pkt;
+  uint8_t *cookie = NULL;
+  ipcookie_t malformed_cookie = { 0 };
+
+  switch (ipcookie_option_find(ip6_pkt, len, &cookie)) {
+    case IPCOOKIE_OPTION_FOUND:
+      break;
+    case IPCOOKIE_OPTION_ABSENT:
+      cookie = NULL;
+      break;
+    case IPCOOKIE_OPTION_MALFORMED:
+      if (len < sizeof(*ip6)) {
+        return IPCOOKIE_NOMATCH;
+      }
+      cookie = malformed_cookie;
+      break;
+  }
+  return ipcookies_shim_inbound_check_cookie(ipck, &ip6->ip6_src, cookie);
+}
+
+int ipcookies_shim_udp_socket_init(int fd, int enable_gro) {
+  int on = 1;
+  if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVDSTOPTS, &on, sizeof(on)) == -1) {
+    return -1;
+  }
+#ifdef UDP_GRO
+  if (enable_gro && setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+int ipcookies_shim_outbound_msghdr(void *ipck, int default_use_ipcookies, struct in6_addr *peer,
+                                   ipcookie_dstopt_template_t *tmpl, struct msghdr *msg, size_t control_size) {
+  void *cookie = NULL;
+  struct cmsghdr *cmsg;
+
+  if (!ipcookies_shim_outbound_cookie(ipck, default_use_ipcookies, peer, &cookie)) {
+    return 0;
+  }
+  if (CMSG_ALIGN(msg->msg_controllen) + CMSG_SPACE(tmpl->len) > control_size) {
+    return -1;
+  }
+  ipcookie_dstopt_template_patch(tmpl, cookie);
+  cmsg = (void *)((uint8_t *)msg->msg_control + CMSG_ALIGN(msg->msg_controllen));
+  cmsg->cmsg_level = IPPROTO_IPV6;
+  cmsg->cmsg_type = IPV6_DSTOPTS;
+  cmsg->cmsg_len = CMSG_LEN(tmpl->len);
+  memcpy(CMSG_DATA(cmsg), tmpl->buf, tmpl->len);
+  msg->msg_controllen = CMSG_ALIGN(msg->msg_controllen) + CMSG_SPACE(tmpl->len);
+  return 1;
+}
+
+int ipcookies_shim_inbound_check_msghdr(void *ipck, struct msghdr *msg, size_t len, int *ret_segments) {
+  struct sockaddr_in6 *src = msg->msg_name;
+  struct cmsghdr *cmsg;
+  uint8_t *cookie = NULL;
+  ipcookie_t malformed_cookie = { 0 };
+  int segments = 1;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_DSTOPTS && !cookie) {
+      if (ipcookie_option_find_in_dstopts(CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0), &cookie) ==
+          IPCOOKIE_OPTION_MALFORMED) {
+        cookie = malformed_cookie;
+      }
+#ifdef UDP_GRO
+    } else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      if (gso_size > 0) {
+        segments = (len + gso_size - 1) / gso_size;
+      }
+#endif
+    }
+  }
+  if (ret_segments) {
+    *ret_segments = segments;
+  }
+  if (!src || msg->msg_namelen < sizeof(*src) || src->sin6_family != AF_INET6) {
+    /* no source to check the cookie against, nor to send the SET-COOKIE to */
+    return IPCOOKIE_NOMATCH;
+  }
+  return ipcookies_shim_inbound_check_segments(ipck, &src->sin6_addr, cookie, segments);
+}
+
 #ifndef SHIM_IPCOOKIE_LIBRARY
 
 int main(int argc, char *argv[]) {
@@ -1,4 +1,9 @@
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ipcookies_option.h"
 
 /*********************************************************************
 
@@ -10,9 +15,20 @@ The cookie to set is passed via an output parameter pointer. The function as the
 effect of creating the necessary state within ipck database if needed.
 
 The parameter default_use_ipcookies defines what to do if the cookie
-does not already exist.
+does not already exist, unless the policy loaded by cookiectl has
+a rule for the peer (see ipcookies_policy.h).
+
+The sender has to take care to add the cookie via the mechanism of choice,
+e.g. with the Destination Options template from ipcookies_option.h.
 
-The sender has to take care to add the cookie via the mechanism of choice.
+In the single writer mode (cookied -w, see ipcookies_cmds.h) the state
+is changed by cookied on our behalf, and the returned cookie may be a
+per-thread copy, valid until the next call from the same thread.
+
+The ipck of all the functions is what mmap_ipcookies() returned. If
+that was NULL (no shared memory this build can use), they work as if
+there were no cookies: none is attached to what is sent, and all that
+is received is IPCOOKIE_ADMITTED, with no limit on the responses.
 
 *********************************************************************/
 
@@ -30,10 +46,98 @@ change the state recorded within ipck database.
 
 If the cookie option was not present in the packet, then the caller
 should pass the NULL as a cookie parameter. This allows the routine
-to perform a policy check of what to do with such packets.
+to perform a policy check of what to do with such packets: within
+the budget of the source, they are let in (IPCOOKIE_ADMITTED), the
+rest get the SET-COOKIE as a wrong cookie would (see ipcookies_budget.h).
+
+The packets from the prefixes the policy exempts are passed without
+any check, as if their cookie was good.
 
 *********************************************************************/
 
 int ipcookies_shim_inbound_check_cookie(void *ipck, struct in6_addr *peer, void *cookie);
 
 
+
+/*********************************************************************
+
+Before responding to a packet that was let in without a verified
+cookie (IPCOOKIE_ADMITTED), the application calls
+ipcookies_shim_inbound_response with the size of the request and
+of the response it is about to send, to keep the amplification
+within the budget of the peer's prefix (see ipcookies_budget.h).
+The received_bytes is only to be counted once: for the further
+responses to the same request, pass zero.
+
+It returns IPCOOKIE_AMP_OK to send the response as it is,
+IPCOOKIE_AMP_TRUNCATE to send no more than *ret_allowed bytes of it
+(at least min_bytes), or IPCOOKIE_AMP_REFUSE to send nothing.
+
+*********************************************************************/
+
+int ipcookies_shim_inbound_response(void *ipck, struct in6_addr *peer, size_t received_bytes,
+                                    size_t response_bytes, size_t min_bytes, size_t *ret_allowed);
+
+
+
+
+/*********************************************************************
+
+For the callers which have the whole IPv6 packet at hand, starting
+at the IPv6 header, ipcookies_shim_inbound_check_packet locates the
+cookie option in place and then does the same as the above.
+A malformed cookie option is treated as a cookie which did not verify.
+
+*********************************************************************/
+
+int ipcookies_shim_inbound_check_packet(void *ipck, uint8_t *ip6_pkt, size_t len);
+
+
+
+/*********************************************************************
+
+Batched UDP: the UDP_SEGMENT (GSO) senders and UDP_GRO receivers.
+
+The cookie is per-peer, so there is no need to handle it per segment.
+On the send path the application attaches the Destination Options
+as IPV6_DSTOPTS ancillary data once per super-buffer, alongside
+its UDP_SEGMENT one, and the kernel replicates the IPv6 extension
+headers onto every segment. ipcookies_shim_outbound_msghdr does
+the ipcookies_shim_outbound_cookie() decision, patches the cookie
+into the template and appends the IPV6_DSTOPTS control message
+to msg (at msg_controllen, within control_size bytes of msg_control).
+It returns the same as ipcookies_shim_outbound_cookie(), or -1 if
+the control buffer is too small. IPCOOKIES_SHIM_CMSG_SPACE is the
+control buffer room it needs.
+
+NB: the UDP_SEGMENT size must leave the room for tmpl->len bytes
+of the extension header within the path MTU, else the kernel
+refuses the send with EINVAL.
+
+On the receive path the kernel coalesces the datagrams into a single
+GRO buffer only if they are of the same flow and their extension
+headers are identical, so all the segments share the source and the
+cookie option: ipcookies_shim_inbound_check_msghdr verifies it
+once for the whole buffer of len bytes, and, if the UDP_GRO control
+message is present, reports the number of the segments it covered
+via ret_segments (may be NULL). A buffer without the cookie takes
+a token per segment from the budgets (see ipcookies_budget.h), all
+of them or none, as its datagrams would one by one. Where the stack
+hands the segments over one by one (e.g. the GSO packets with the
+extension headers get segmented on loopback), this degrades to the
+per-datagram check.
+msg_name needs to hold the IPv6 source address, else the buffer is
+IPCOOKIE_NOMATCH, and the socket needs to have the IPV6_RECVDSTOPTS
+on, which ipcookies_shim_udp_socket_init does, together with UDP_GRO
+if asked to. scripts/netns_gso.sh tests it over loopback and veth.
+
+*********************************************************************/
+
+#define IPCOOKIES_SHIM_CMSG_SPACE CMSG_SPACE(IPCOOKIE_DSTOPT_TEMPLATE_MAX)
+
+int ipcookies_shim_udp_socket_init(int fd, int enable_gro);
+
+int ipcookies_shim_outbound_msghdr(void *ipck, int default_use_ipcookies, struct in6_addr *peer,
+                                   ipcookie_dstopt_template_t *tmpl, struct msghdr *msg, size_t control_size);
+
+int ipcookies_shim_inbound_check_msghdr(void *ipck, struct msghdr *msg, size_t len, int *ret_segments);
@@ -0,0 +1,232 @@
+/********************************************************************
+
+The tc egress program for the outbound cookie insertion.
+
+This does in the kernel what ipcookies_shim_outbound_cookie() does
+in the application: it looks up the destination in the peer map
+(the in-kernel mirror of ipcookie_cache_t, see ipcookies_bpf.h),
+creating the entry according to the default policy if needed,
+runs the same renew/fallback state machine as
+ipcookies_shim_outbound_ipcookie_entry_exists(), and if the cookies
+are enabled for the peer, inserts the 16-byte Destination Options
+header with the cookie option right after the IPv6 header.
+
+The upper layer checksums do not need to be touched: the pseudo-header
+carries the upper layer length and protocol, neither of which change.
+
+Only the packets with no extension headers get the cookie inserted,
+and the packets which would exceed the MTU with the extra 16 bytes
+are sent as is; the routes towards the cookie-speaking peers should
+leave the room for the option.
+
+cookied keeps the peer map current from the received SET-COOKIE
+messages, see process_icmp_set_cookie().
+
+Build with "make bpf", then e.g.:
+
+  tc qdisc add dev eth0 clsact
+  tc filter add dev eth0 egress bpf da obj tc_ipcookies.bpf.o sec tc
+  cookied -x /sys/fs/bpf/tc/globals/ipcookies_state_map \
+          -p /sys/fs/bpf/tc/globals/ipcookies_peer_map -u
+
+********************************************************************/
+
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/ipv6.h>
+#include <linux/in6.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+typedef __u8 uint8_t;
+typedef __u16 uint16_t;
+typedef __u32 uint32_t;
+typedef __u64 uint64_t;
+typedef __s64 int64_t;
+
+#include "ipcookies_stateless.h"
+#include "ipcookies_option.h"
+#include "ipcookies_prf.h"
+#include "ipcookies_bpf.h"
+
+/*
+ * These mirror the IPCOOKIE_T_RECOVER, IPCOOKIE_FALLBACK_LT2,
+ * IPCOOKIE_TRY_LT2 and IPCOOKIE_LIFETIME_LOG2_INFINITE from ipcookies.h,
+ * which is not usable from BPF.
+ */
+#define IPCOOKIE_BPF_T_RECOVER 3
+#define IPCOOKIE_BPF_FALLBACK_LT2 8
+#define IPCOOKIE_BPF_TRY_LT2 3
+#define IPCOOKIE_BPF_LIFETIME_LOG2_INFINITE 0xF
+
+/* ... and these the ipcookie_ts_check_t */
+#define IPCOOKIE_BPF_TS_STILL_VALID 0
+#define IPCOOKIE_BPF_TS_RENEW_TIME 1
+#define IPCOOKIE_BPF_TS_PAST_RENEW_TIME 2
+
+/* The Destination Options header with just the cookie option in it */
+#define IPCOOKIES_TC_DSTOPT_LEN 16
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, ipcookie_bpf_state_t);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} ipcookies_state_map SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, IPCOOKIES_BPF_PEER_MAP_SIZE);
+  __type(key, struct in6_addr);
+  __type(value, ipcookie_bpf_peer_t);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} ipcookies_peer_map SEC(".maps");
+
+static __always_inline void tc_ipcookies_set_mtime(ipcookie_bpf_peer_t *bp, __s64 now) {
+  bp->mtime_lo16 = 0xffff & now;
+  bp->mtime_hi8 = 0xff & (now >> 16);
+}
+
+static __always_inline void tc_ipcookies_set_lifetime_log2(ipcookie_bpf_peer_t *bp, __u8 lt2) {
+  bp->flags_and_lifetime_log2 &= ~IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2;
+  bp->flags_and_lifetime_log2 |= lt2 & IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2;
+}
+
+/* Same as check_ipcookie_entry_timestamp(), with expand_timestamp() inlined */
+
+static __always_inline int tc_ipcookies_check_timestamp(ipcookie_bpf_peer_t *bp, __s64 now) {
+  __s64 now_lo24 = now & 0xFFFFFF;
+  __s64 ts_lo24 = bp->mtime_lo16 | (bp->mtime_hi8 << 16);
+  __s64 ts = now ^ now_lo24;
+  __u8 lt2 = bp->flags_and_lifetime_log2 & IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2;
+  __s64 lifetime = 1 << lt2;
+
+  if (now_lo24 < ts_lo24) {
+    ts -= 0x1000000;
+  }
+  ts |= ts_lo24;
+  if ((now < ts + lifetime) || (lt2 == IPCOOKIE_BPF_LIFETIME_LOG2_INFINITE)) {
+    return IPCOOKIE_BPF_TS_STILL_VALID;
+  } else if (now < ts + lifetime + IPCOOKIE_BPF_T_RECOVER) {
+    return IPCOOKIE_BPF_TS_RENEW_TIME;
+  }
+  return IPCOOKIE_BPF_TS_PAST_RENEW_TIME;
+}
+
+/* The ipcookies_shim_outbound_ipcookie_entry_exists() state machine */
+
+static __always_inline void tc_ipcookies_entry_exists(ipcookie_bpf_peer_t *bp, __s64 now) {
+  int ts_check = tc_ipcookies_check_timestamp(bp, now);
+  __u8 lt2 = bp->flags_and_lifetime_log2 & IPCOOKIE_BPF_PEER_MASK_LIFETIME_LOG2;
+
+  if (ts_check == IPCOOKIE_BPF_TS_STILL_VALID) {
+    return;
+  }
+  if (bp->flags_and_lifetime_log2 & IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES) {
+    /* fallback wait-out period has expired, try the cookies again */
+    bp->flags_and_lifetime_log2 &= ~IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES;
+    tc_ipcookies_set_mtime(bp, now);
+    tc_ipcookies_set_lifetime_log2(bp, IPCOOKIE_BPF_TRY_LT2);
+  } else if (bp->flags_and_lifetime_log2 & IPCOOKIE_BPF_PEER_FLAG_EXPECTING_SETCOOKIE) {
+    if (ts_check == IPCOOKIE_BPF_TS_PAST_RENEW_TIME) {
+      /* enter the fallback mode */
+      bp->flags_and_lifetime_log2 |= IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES;
+      tc_ipcookies_set_mtime(bp, now);
+      tc_ipcookies_set_lifetime_log2(bp, IPCOOKIE_BPF_FALLBACK_LT2);
+    }
+  } else {
+    /* within renew, or the late recovery: both rewind the mtime */
+    bp->flags_and_lifetime_log2 |= IPCOOKIE_BPF_PEER_FLAG_EXPECTING_SETCOOKIE;
+    tc_ipcookies_set_mtime(bp, now - (1 << lt2));
+  }
+}
+
+/* The ipcookies_shim_outbound_no_ipcookie_entry() equivalent */
+
+static __always_inline ipcookie_bpf_peer_t *tc_ipcookies_entry_create(ipcookie_bpf_state_t *bst,
+                                                      struct in6_addr *peer, __s64 now) {
+  ipcookie_bpf_peer_t bp = {};
+  __u8 peer_bytes[16];
+
+  if (bst->tc_default_use_ipcookies) {
+    __s64 ts = ipcookie_prf_timestamp_curr(bst->state.time_bias, bst->state.halflife_log2 & 0xF, now);
+    __builtin_memcpy(peer_bytes, peer, sizeof(peer_bytes));
+    ipcookie_prf(bst->state.ipcookie_secret, peer_bytes, (__u64)ts, bp.ipcookie);
+    /* lifetime_log2 of zero */
+    bp.flags_and_lifetime_log2 = IPCOOKIE_BPF_PEER_FLAG_EXPECTING_SETCOOKIE;
+  } else {
+    bp.flags_and_lifetime_log2 = IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES |
+                                 IPCOOKIE_BPF_LIFETIME_LOG2_INFINITE;
+  }
+  tc_ipcookies_set_mtime(&bp, now);
+  /* someone else might have just created it, in which case we use theirs */
+  bpf_map_update_elem(&ipcookies_peer_map, peer, &bp, BPF_NOEXIST);
+  return bpf_map_lookup_elem(&ipcookies_peer_map, peer);
+}
+
+SEC("tc")
+int tc_ipcookies_egress(struct __sk_buff *skb) {
+  void *data = (void *)(long)skb->data;
+  void *data_end = (void *)(long)skb->data_end;
+  struct ethhdr *eth = data;
+  struct ipv6hdr *ip6 = (void *)(eth + 1);
+  struct in6_addr daddr;
+  ipcookie_bpf_state_t *bst;
+  ipcookie_bpf_peer_t *bp;
+  __u8 dstopt[IPCOOKIES_TC_DSTOPT_LEN];
+  __u16 payload_len;
+  __u32 mtu_len = 0;
+  __u8 nexthdr;
+  __u32 key = 0;
+  __s64 now;
+
+  if ((void *)(ip6 + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IPV6)) {
+    return TC_ACT_OK;
+  }
+  nexthdr = ip6->nexthdr;
+  if (nexthdr != IPPROTO_UDP && nexthdr != IPPROTO_TCP) {
+    return TC_ACT_OK;
+  }
+  bst = bpf_map_lookup_elem(&ipcookies_state_map, &key);
+  if (!bst) {
+    return TC_ACT_OK;
+  }
+  daddr = ip6->daddr;
+  payload_len = bpf_ntohs(ip6->payload_len);
+  now = ipcookies_bpf_now(bst);
+
+  bp = bpf_map_lookup_elem(&ipcookies_peer_map, &daddr);
+  if (bp) {
+    tc_ipcookies_entry_exists(bp, now);
+  } else {
+    bp = tc_ipcookies_entry_create(bst, &daddr, now);
+  }
+  if (!bp || (bp->flags_and_lifetime_log2 & IPCOOKIE_BPF_PEER_FLAG_DISABLE_COOKIES)) {
+    return TC_ACT_OK;
+  }
+  if (bpf_check_mtu(skb, 0, &mtu_len, IPCOOKIES_TC_DSTOPT_LEN, 0) != BPF_MTU_CHK_RET_SUCCESS) {
+    return TC_ACT_OK;
+  }
+
+  dstopt[0] = nexthdr;
+  dstopt[1] = (IPCOOKIES_TC_DSTOPT_LEN / 8) - 1;
+  dstopt[2] = IP6OPT_IPCOOKIE;
+  dstopt[3] = IP6OPT_IPCOOKIE_LEN;
+  __builtin_memcpy(dstopt + 4, bp->ipcookie, IP6OPT_IPCOOKIE_LEN);
+
+  if (bpf_skb_adjust_room(skb, IPCOOKIES_TC_DSTOPT_LEN, BPF_ADJ_ROOM_NET, 0)) {
+    return TC_ACT_OK;
+  }
+  nexthdr = IPPROTO_DSTOPTS;
+  payload_len = bpf_htons(payload_len + IPCOOKIES_TC_DSTOPT_LEN);
+  bpf_skb_store_bytes(skb, ETH_HLEN + __builtin_offsetof(struct ipv6hdr, nexthdr), &nexthdr, sizeof(nexthdr), 0);
+  bpf_skb_store_bytes(skb, ETH_HLEN + __builtin_offsetof(struct ipv6hdr, payload_len), &payload_len, sizeof(payload_len), 0);
+  bpf_skb_store_bytes(skb, ETH_HLEN + sizeof(struct ipv6hdr), dstopt, sizeof(dstopt), 0);
+  return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,195 @@
+/********************************************************************
+
+The XDP program for the inbound cookie verification.
+
+This does the same job as ipcookies_shim_inbound_check_cookie() does
+on the receive path, but before the packet has cost us a trip through
+the stack and a socket wakeup: it walks the IPv6 extension headers,
+finds the cookie option within the Destination Options header, and
+verifies it against the CURRENT and the PREVIOUS stateless cookies,
+calculated with the same PRF (ipcookies_prf.h) from the state cookied
+mirrors into the pinned ipcookies_state_map.
+
+The packets without the cookie option, or the ones which verify,
+are passed to the stack. The ones which fail are handled according
+to xdp_fail_action in the state map, see ipcookies_bpf.h.
+
+Build with "make bpf" (needs clang and the libbpf headers), then e.g.:
+
+  ip link set dev veth0 xdpgeneric obj xdp_ipcookies.bpf.o sec xdp
+  cookied -x /sys/fs/bpf/ipcookies_state_map
+
+scripts/netns_xdp.sh does that on a veth pair and checks what gets past.
+
+********************************************************************/
+
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ipv6.h>
+#include <linux/in6.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+typedef __u8 uint8_t;
+typedef __u16 uint16_t;
+typedef __u32 uint32_t;
+typedef __u64 uint64_t;
+typedef __s64 int64_t;
+
+#include "ipcookies_stateless.h"
+#include "ipcookies_option.h"
+#include "ipcookies_prf.h"
+#include "ipcookies_bpf.h"
+
+/* How many extension headers we are prepared to skip to find the Destination Options */
+#define IPCOOKIES_XDP_MAX_EXTHDRS 4
+/* How many options within the Destination Options header we look at */
+#define IPCOOKIES_XDP_MAX_OPTIONS 8
+
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, __u32);
+  __type(value, ipcookie_bpf_state_t);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} ipcookies_state_map SEC(".maps");
+
+struct {
+  __uint(type, BPF_MAP_TYPE_XSKMAP);
+  __uint(max_entries, 64);
+  __type(key, __u32);
+  __type(value, __u32);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} ipcookies_xsks_map SEC(".maps");
+
+/*
+ * Returns the pointer to the 12 bytes of the cookie within the packet,
+ * or NULL if there is none or the option is malformed.
+ */
+
+static __always_inline __u8 *xdp_ipcookies_find_cookie(void *data, void *data_end) {
+  struct ethhdr *eth = data;
+  struct ipv6hdr *ip6;
+  __u8 *hdr;
+  __u8 nexthdr;
+  int i;
+
+  if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IPV6)) {
+    return NULL;
+  }
+  ip6 = (void *)(eth + 1);
+  if ((void *)(ip6 + 1) > data_end) {
+    return NULL;
+  }
+  nexthdr = ip6->nexthdr;
+  hdr = (void *)(ip6 + 1);
+
+#pragma unroll
+  for (i = 0; i < IPCOOKIES_XDP_MAX_EXTHDRS; i++) {
+    __u32 hdrlen;
+    if ((void *)(hdr + 2) > data_end) {
+      return NULL;
+    }
+    hdrlen = 8 * (1 + hdr[1]);
+    if (nexthdr == IPPROTO_DSTOPTS) {
+      __u32 off = 2;
+      int j;
+#pragma unroll
+      for (j = 0; j < IPCOOKIES_XDP_MAX_OPTIONS; j++) {
+        __u8 *opt = hdr + off;
+        if (off + 2 > hdrlen || (void *)(opt + 2) > data_end) {
+          return NULL;
+        }
+        if (opt[0] == 0) {
+          /* Pad1 */
+          off++;
+          continue;
+        }
+        if (opt[0] == IP6OPT_IPCOOKIE) {
+          if (opt[1] != IP6OPT_IPCOOKIE_LEN ||
+              off % IP6OPT_IPCOOKIE_ALIGN_N != IP6OPT_IPCOOKIE_ALIGN_OFF ||
+              off + 2 + IP6OPT_IPCOOKIE_LEN > hdrlen ||
+              (void *)(opt + 2 + IP6OPT_IPCOOKIE_LEN) > data_end) {
+            return NULL;
+          }
+          return opt + 2;
+        }
+        off += 2 + opt[1];
+      }
+      return NULL;
+    } else if (nexthdr == IPPROTO_HOPOPTS || nexthdr == IPPROTO_ROUTING) {
+      nexthdr = hdr[0];
+      hdr += hdrlen;
+    } else if (nexthdr == IPPROTO_FRAGMENT) {
+      nexthdr = hdr[0];
+      hdr += 8;
+    } else {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static __always_inline int xdp_ipcookies_cookie_eq(const __u8 *a, const __u8 *b) {
+  int i;
+  __u8 diff = 0;
+#pragma unroll
+  for (i = 0; i < IP6OPT_IPCOOKIE_LEN; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+SEC("xdp")
+int xdp_ipcookies_verify(struct xdp_md *ctx) {
+  void *data = (void *)(long)ctx->data;
+  void *data_end = (void *)(long)ctx->data_end;
+  struct ipv6hdr *ip6 = data + sizeof(struct ethhdr);
+  ipcookie_bpf_state_t *bst;
+  __u8 test_cookie[IP6OPT_IPCOOKIE_LEN];
+  __u8 good_cookie[IP6OPT_IPCOOKIE_LEN];
+  __u8 src[16];
+  __u8 *cookie;
+  __u32 key = 0;
+  __s64 now;
+  __s64 ts;
+
+  cookie = xdp_ipcookies_find_cookie(data, data_end);
+  if (!cookie) {
+    return XDP_PASS;
+  }
+  bst = bpf_map_lookup_elem(&ipcookies_state_map, &key);
+  if (!bst) {
+    return XDP_PASS;
+  }
+  /* the cookie was found, so the IPv6 header is within the packet */
+  if ((void *)(ip6 + 1) > data_end) {
+    return XDP_PASS;
+  }
+  __builtin_memcpy(src, &ip6->saddr, sizeof(src));
+  __builtin_memcpy(test_cookie, cookie, sizeof(test_cookie));
+
+  now = ipcookies_bpf_now(bst);
+  ts = ipcookie_prf_timestamp_curr(bst->state.time_bias, bst->state.halflife_log2 & 0xF, now);
+  ipcookie_prf(bst->state.ipcookie_secret, src, (__u64)ts, good_cookie);
+  if (xdp_ipcookies_cookie_eq(good_cookie, test_cookie)) {
+    return XDP_PASS;
+  }
+  ts -= (1 << (bst->state.halflife_log2 & 0xF));
+  ipcookie_prf(bst->state.ipcookie_secret, src, (__u64)ts, good_cookie);
+  if (xdp_ipcookies_cookie_eq(good_cookie, test_cookie)) {
+    return XDP_PASS;
+  }
+
+  switch (bst->xdp_fail_action) {
+    case IPCOOKIE_XDP_FAIL_DROP:
+      return XDP_DROP;
+    case IPCOOKIE_XDP_FAIL_REDIRECT:
+      return bpf_redirect_map(&ipcookies_xsks_map, ctx->rx_queue_index, XDP_PASS);
+  }
+  return XDP_PASS;
+}
+
+char _license[] SEC("license") = "Dual MIT/GPL";